@@ -0,0 +1,410 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+/* misp-bench: runs the workloads of this directory and reports their
+   speed, optionally against a baseline saved by a previous run. */
+
+#include "defs.h"
+#include "misp.h"
+#include "parser.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#ifndef MISP_BENCH_DIR
+#define MISP_BENCH_DIR "bench"
+#endif
+
+/* Free cells given to every workload */
+#define BENCH_MEMORY (1 << 18)
+
+/* Steps between two looks at the heap and the frames */
+#define BENCH_SLICE 4096
+
+#define MAX_WORKLOADS 64
+
+static const char *const default_workloads[]
+    = { "fib", "count", "reverse", "sort", "let", "cond" };
+
+typedef struct
+{
+  char name[64];
+  uint64_t steps;
+  uint64_t ns;           /* best run */
+  size_t peak_heap;      /* cells */
+  size_t peak_frames;
+  int64_t result;        /* the value of the program when a number */
+  bool has_result;
+} result_t;
+
+static uint64_t
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char *
+read_file (const char *path, size_t *len)
+{
+  FILE *f = fopen (path, "rb");
+  char *s = NULL;
+  if (!f)
+    {
+      return NULL;
+    }
+  if (!fseek (f, 0, SEEK_END) && (*len = ftell (f)) != (size_t)-1
+      && !fseek (f, 0, SEEK_SET) && (s = malloc (*len + 1))
+      && fread (s, 1, *len, f) != *len)
+    {
+      free (s);
+      s = NULL;
+    }
+  fclose (f);
+  return s;
+}
+
+static size_t
+heap_used (misp_t *M)
+{
+  misp_heap_t *H = &M->heap;
+  return H->top - H->base - H->free_cells + H->end - H->arena;
+}
+
+static size_t
+frame_depth (misp_t *M)
+{
+  size_t depth = 0;
+  misp_env_flush (M);
+  for (cell_t env = M->env; LIST_LEN (env); depth++)
+    {
+      CELL_READ (&M->mem[(LIST_PTR (env) + FRAME_PARENT) * CELL_SIZE], &env);
+    }
+  return depth;
+}
+
+// Runs the source s once, filling r. Returns false if it did not halt
+// cleanly.
+static bool
+run_once (const char *s, size_t len, bool bytecode, result_t *r)
+{
+  size_t mem_size = (len + BENCH_MEMORY) * CELL_SIZE;
+  mem_size = (mem_size + MISP_CACHE_LINE - 1) / MISP_CACHE_LINE
+             * MISP_CACHE_LINE;
+  uint8_t *mem = mmap (NULL, mem_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  size_t code_size;
+  cell_t init;
+  misp_t M;
+  bool ok = false;
+
+  if (mem == MAP_FAILED)
+    {
+      return false;
+    }
+  if (misp_parse_mem (s, len, mem, mem_size, &code_size, &init))
+    {
+      fprintf (stderr, "%s: cannot parse\n", r->name);
+      munmap (mem, mem_size);
+      return false;
+    }
+  misp_init (&M, mem, mem_size, init);
+  if (bytecode && !misp_bc_init (&M))
+    {
+      fprintf (stderr, "%s: cannot allocate the bytecode engine\n", r->name);
+      goto out;
+    }
+
+  uint64_t steps = 0, start = now ();
+  size_t heap = 0, frames = 0;
+  while (!M.halted)
+    {
+      steps += misp_run (&M, BENCH_SLICE);
+      if (heap_used (&M) > heap)
+        {
+          heap = heap_used (&M);
+        }
+      if (!M.halted && frame_depth (&M) > frames)
+        {
+          frames = frame_depth (&M);
+        }
+    }
+  uint64_t ns = now () - start;
+
+  if (M.panic_code.type)
+    {
+      fprintf (stderr, "%s: PANIC: %d\n", r->name, M.panic_code.type);
+      goto out;
+    }
+  if (!r->ns || ns < r->ns)
+    {
+      r->ns = ns ? ns : 1;
+    }
+  r->steps = steps;
+  r->peak_heap = heap;
+  r->peak_frames = frames;
+  r->has_result = IS_NUM (M.result);
+  r->result = r->has_result ? NUM_VAL (M.result) : 0;
+  ok = true;
+
+out:
+  misp_deinit (&M);
+  munmap (mem, mem_size);
+  return ok;
+}
+
+static bool
+run_workload (const char *workload, int runs, bool bytecode, result_t *r)
+{
+  char path[4096];
+  const char *base = strrchr (workload, '/');
+  bool is_path = base || strstr (workload, ".misp");
+  size_t len;
+
+  snprintf (r->name, sizeof (r->name), "%s", base ? base + 1 : workload);
+  if (strstr (r->name, ".misp"))
+    {
+      *strstr (r->name, ".misp") = 0;
+    }
+  snprintf (path, sizeof (path), is_path ? "%s" : MISP_BENCH_DIR "/%s.misp",
+            workload);
+
+  char *s = read_file (path, &len);
+  if (!s)
+    {
+      fprintf (stderr, "Cannot read %s\n", path);
+      return false;
+    }
+  bool ok = true;
+  for (int i = 0; i < runs && ok; i++)
+    {
+      ok = run_once (s, len, bytecode, r);
+    }
+  free (s);
+  return ok;
+}
+
+static double
+ns_per_step (const result_t *r)
+{
+  return r->steps ? (double)r->ns / r->steps : 0;
+}
+
+static int
+write_json (const char *path, const result_t *results, size_t n,
+            bool bytecode, int runs)
+{
+  FILE *f = fopen (path, "w");
+  if (!f)
+    {
+      return -1;
+    }
+  fprintf (f, "{\n  \"engine\": \"%s\",\n", bytecode ? "bytecode" : "tree");
+#ifdef MISP_CELL_TAGGED
+  fprintf (f, "  \"cells\": \"tagged\",\n");
+#else
+  fprintf (f, "  \"cells\": \"packed\",\n");
+#endif
+  fprintf (f, "  \"runs\": %d,\n  \"workloads\": [\n", runs);
+  /* a workload per line, which is what read_baseline expects */
+  for (size_t i = 0; i < n; i++)
+    {
+      const result_t *r = &results[i];
+      fprintf (f,
+               "    { \"name\": \"%s\", \"steps\": %lu, \"ns\": %lu, "
+               "\"steps_per_sec\": %.0f, \"ns_per_step\": %.3f, "
+               "\"peak_heap\": %zu, \"peak_frames\": %zu",
+               r->name, r->steps, r->ns, 1e9 * r->steps / r->ns,
+               ns_per_step (r), r->peak_heap, r->peak_frames);
+      if (r->has_result)
+        {
+          fprintf (f, ", \"result\": %ld", r->result);
+        }
+      fprintf (f, " }%s\n", i + 1 < n ? "," : "");
+    }
+  fprintf (f, "  ]\n}\n");
+  return fclose (f) ? -1 : 0;
+}
+
+// Reads the workloads of a file written by write_json.
+static size_t
+read_baseline (const char *path, result_t *base, size_t max)
+{
+  FILE *f = fopen (path, "r");
+  char line[1024];
+  size_t n = 0;
+  if (!f)
+    {
+      return 0;
+    }
+  while (n < max && fgets (line, sizeof (line), f))
+    {
+      const char *p = strstr (line, "\"name\": \"");
+      const char *q;
+      result_t *r = &base[n];
+      if (!p)
+        {
+          continue;
+        }
+      memset (r, 0, sizeof (*r));
+      sscanf (p + 9, "%63[^\"]", r->name);
+      if ((q = strstr (line, "\"steps\": ")))
+        {
+          r->steps = strtoull (q + 9, NULL, 10);
+        }
+      if ((q = strstr (line, "\"ns\": ")))
+        {
+          r->ns = strtoull (q + 6, NULL, 10);
+        }
+      if ((q = strstr (line, "\"result\": ")))
+        {
+          r->has_result = true;
+          r->result = strtoll (q + 10, NULL, 10);
+        }
+      n++;
+    }
+  fclose (f);
+  return n;
+}
+
+static const result_t *
+find (const result_t *results, size_t n, const char *name)
+{
+  for (size_t i = 0; i < n; i++)
+    {
+      if (!strcmp (results[i].name, name))
+        {
+          return &results[i];
+        }
+    }
+  return NULL;
+}
+
+int
+main (int argc, const char *argv[])
+{
+  bool bytecode = false;
+  int runs = 3;
+  double threshold = 5;
+  const char *output = NULL, *baseline = NULL;
+  const char *workloads[MAX_WORKLOADS];
+  size_t count = 0;
+
+  for (int i = 1; i < argc; i++)
+    {
+      if (!strcmp ("-b", argv[i]) || !strcmp ("--bytecode", argv[i]))
+        {
+          bytecode = true;
+        }
+      else if ((!strcmp ("-n", argv[i]) || !strcmp ("--runs", argv[i]))
+               && i + 1 < argc)
+        {
+          runs = atoi (argv[++i]);
+        }
+      else if ((!strcmp ("-o", argv[i]) || !strcmp ("--output", argv[i]))
+               && i + 1 < argc)
+        {
+          output = argv[++i];
+        }
+      else if ((!strcmp ("-c", argv[i]) || !strcmp ("--compare", argv[i]))
+               && i + 1 < argc)
+        {
+          baseline = argv[++i];
+        }
+      else if ((!strcmp ("-t", argv[i]) || !strcmp ("--threshold", argv[i]))
+               && i + 1 < argc)
+        {
+          threshold = strtod (argv[++i], NULL);
+        }
+      else if (argv[i][0] != '-' && count < MAX_WORKLOADS)
+        {
+          workloads[count++] = argv[i];
+        }
+      else
+        {
+          printf ("misp-bench [-b] [-n runs] [-o results.json] "
+                  "[-c baseline.json] [-t percent] [workload...]\n");
+          return 0;
+        }
+    }
+  if (!count)
+    {
+      count = sizeof (default_workloads) / sizeof (default_workloads[0]);
+      memcpy (workloads, default_workloads, sizeof (default_workloads));
+    }
+  if (runs < 1)
+    {
+      runs = 1;
+    }
+
+  result_t results[MAX_WORKLOADS] = { 0 };
+  result_t base[MAX_WORKLOADS];
+  size_t base_count = 0;
+  if (baseline && !(base_count = read_baseline (baseline, base,
+                                                MAX_WORKLOADS)))
+    {
+      fprintf (stderr, "Cannot read the baseline %s\n", baseline);
+      return 1;
+    }
+
+  int status = 0;
+  printf ("%-10s %12s %10s %8s %10s %7s %14s\n", "workload", "steps",
+          "Msteps/s", "ns/step", "heap", "frames", "baseline");
+  for (size_t i = 0; i < count; i++)
+    {
+      result_t *r = &results[i];
+      if (!run_workload (workloads[i], runs, bytecode, r))
+        {
+          status = 1;
+          continue;
+        }
+      printf ("%-10s %12lu %10.2f %8.2f %10zu %7zu", r->name, r->steps,
+              1e3 * r->steps / r->ns, ns_per_step (r), r->peak_heap,
+              r->peak_frames);
+
+      /* compared by time, the step counts change with the engine */
+      const result_t *b = find (base, base_count, r->name);
+      if (b && b->ns)
+        {
+          double change = 100.0 * ((double)r->ns - b->ns) / b->ns;
+          printf (" %+13.1f%%", change);
+          if (b->has_result != r->has_result || b->result != r->result)
+            {
+              printf (" WRONG RESULT");
+              status = 1;
+            }
+          else if (change > threshold)
+            {
+              printf (" REGRESSION");
+              status = 1;
+            }
+        }
+      printf ("\n");
+    }
+
+  if (output && write_json (output, results, count, bytecode, runs))
+    {
+      fprintf (stderr, "Cannot write %s\n", output);
+      status = 1;
+    }
+  return status;
+}
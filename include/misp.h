@@ -0,0 +1,311 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#ifndef MISP_H
+#define MISP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef MISP_CELL_TAGGED
+typedef struct
+{
+  uint64_t w;
+} cell_t;
+#else
+typedef struct
+{
+  uint64_t dt;
+  uint8_t mt;
+} cell_t;
+#endif
+
+typedef enum
+{
+  MISP_PANIC_NO = 0,
+  MISP_PANIC_TYPE_ERROR = 1,
+  MISP_PANIC_OUT_OF_BOUNDS = 2,
+  MISP_PANIC_INVALID_OPC = 3,
+  MISP_PANIC_BAD_NODE = 4,
+  MISP_PANIC_BAD_NODE_PARAMS = 5,
+  MISP_PANIC_OUT_OF_MEMORY = 6,
+  MISP_PANIC_STACK_OVERFLOW = 7,
+} misp_panic_type_t;
+
+typedef struct
+{
+  misp_panic_type_t type;
+  cell_t node;
+} misp_panic_t;
+
+typedef enum
+{
+  MISP_GC_IDLE = 0,
+  MISP_GC_MARK = 1,
+  MISP_GC_SWEEP = 2,
+} misp_gc_phase_t;
+
+typedef struct
+{
+  size_t start;
+  size_t size; /* in cells, header included */
+} misp_block_t;
+
+#define MISP_GC_PAUSE_BUCKETS 32
+
+typedef struct
+{
+  /* all positions are cell indices into mem */
+  size_t base;      /* first cell of the collected heap */
+  size_t top;       /* next free cell (bump pointer) */
+  size_t end;       /* one past the last heap cell */
+  size_t arena;     /* first cell of the arena, growing down from end */
+  size_t threshold; /* heap usage that triggers the next collection */
+
+  uint64_t *starts; /* bit per heap cell, set on object headers */
+  uint64_t *marks;  /* bit per heap cell, set on live object headers */
+
+  size_t *gray; /* mark stack of object headers */
+  size_t gray_size;
+  size_t gray_capacity;
+
+  /* INCREMENTAL MODE */
+  bool incremental;
+  size_t interval;  /* steps between two slices */
+  size_t budget;    /* cells of work done by a slice */
+  size_t countdown; /* steps left until the next slice */
+  misp_gc_phase_t phase;
+  size_t cursor;   /* next root cell to scan, or next object to sweep */
+  size_t scan;     /* next cell of the object being scanned */
+  size_t scan_end; /* end of the object being scanned */
+
+  misp_block_t *free; /* blocks reclaimed by the sweep, in address order */
+  size_t free_size;
+  size_t free_capacity;
+  size_t free_cells;
+
+  /* STATISTICS */
+  size_t collections;
+  size_t growths; /* times the heap grew into the rest of mem */
+  size_t live;    /* cells in use after the last collection */
+  uint64_t pauses[MISP_GC_PAUSE_BUCKETS]; /* pauses[i] counts pauses of
+                                             [2^i, 2^(i+1)[ ns */
+  uint64_t max_pause;                     /* ns */
+} misp_heap_t;
+
+typedef struct
+{
+  cell_t parent;
+  cell_t node;
+  cell_t args;
+  cell_t stack;
+  cell_t trap;
+} misp_frame_t;
+
+typedef struct
+{
+  /* MEMORY */
+  uint8_t *mem;
+  size_t mem_size;
+  size_t mem_limit; /* bytes mapped at mem, the heap grows up to them */
+  cell_t frames; /* region holding the env frame chain */
+  misp_heap_t heap;
+
+  /* CONTROL FLOW */
+  cell_t env;
+  misp_frame_t frame; /* header of env, written back to mem lazily */
+  bool trapped;
+  bool halted;
+  cell_t result; /* value of the root node once halted without panic */
+
+  misp_panic_t panic_code;
+
+  /* BYTECODE ENGINE */
+  struct misp_bc *bc;
+
+  /* TRACING */
+  struct misp_trace *trace; /* records the steps of the tree walker */
+
+  /* NATIVE FUNCTIONS */
+  struct misp_natives *natives; /* registered by misp_register */
+
+  /* PARALLEL LISTS */
+  struct misp_par *par; /* threads of pmap and preduce, started on first use */
+
+  /* CLONING */
+  bool mem_mapped; /* mem was mapped by misp_clone, misp_deinit unmaps it */
+  struct misp_snapshot *snapshot; /* taken by misp_share */
+} misp_t;
+
+typedef enum
+{
+  MISP_PARSER_ERROR_OK = 0,
+  MISP_PARSER_INVALID,
+  MISP_PARSER_OUT_OF_MEMORY,
+} misp_parser_error_type_t;
+
+misp_parser_error_type_t misp_parse_string (const char *s, uint8_t *tree[],
+                                            size_t *tree_size, cell_t *root);
+
+/* misp_parse_mem writes the cells straight to the start of mem, which is
+   then handed to misp_init with root. The end of mem is used as scratch
+   while parsing. Several top level forms are wrapped in a do. */
+
+// Parses the len chars at s, e.g. a mmaped file.
+misp_parser_error_type_t misp_parse_mem (const char *s, size_t len,
+                                         uint8_t *mem, size_t mem_size,
+                                         size_t *code_size, cell_t *root);
+
+void misp_init (misp_t *M, uint8_t *mem, size_t mem_size, cell_t init);
+
+/* Flags of misp_mem_map */
+#define MISP_MEM_HUGE 0x1 /* back mem with huge pages when possible */
+
+// Maps limit bytes of zeroed memory for misp_init, rounded up to a huge
+// page. Pages are only backed once touched, so limit can be far more than
+// the mem_size given to misp_init. NULL when it cannot be mapped.
+uint8_t *misp_mem_map (size_t limit, int flags);
+
+void misp_mem_unmap (uint8_t *mem, size_t limit);
+
+// Lets the heap of M grow in place when a collection cannot satisfy an
+// allocation, doubling it each time until mem_size reaches limit bytes.
+// mem must be mapped that far, e.g. by misp_mem_map.
+void misp_mem_limit (misp_t *M, size_t limit);
+
+void misp_deinit (misp_t *M);
+
+// One step of the tree walker.
+void misp_execute (misp_t *M);
+
+// Runs until M halts, panics or max_steps steps were done, and returns the
+// number of steps done. Uses the bytecode engine when it was set up.
+uint64_t misp_run (misp_t *M, uint64_t max_steps);
+
+// Sets up the bytecode engine. Lists are compiled on their first
+// evaluation into a linear bytecode run by misp_bc_run, which gives the
+// same results and panics as misp_execute. M must not have been stepped
+// yet.
+bool misp_bc_init (misp_t *M);
+
+// Runs at most max_steps instructions, returns the number executed.
+uint64_t misp_bc_run (misp_t *M, uint64_t max_steps);
+
+// Mark-compact collection of the heap. Roots are every cell outside of the
+// heap (the code, the root args and the env frame chain). Lists pointing
+// into the heap, including slices, are rewritten in place. Only call this
+// between two steps.
+void misp_gc (misp_t *M);
+
+// Switches the collector to incremental mark and sweep: once the heap usage
+// crosses its threshold, every interval steps do about budget cells of
+// collection work. Lists no longer move, apart from the
+// full collection done when an allocation cannot be satisfied. An interval
+// of 0 switches back to stop-the-world collections.
+void misp_gc_incremental (misp_t *M, size_t interval, size_t budget);
+
+// Takes a snapshot of M for misp_clone: mem goes to a memfd and the state
+// is copied. M can keep running, clones start from the snapshot.
+bool misp_share (misp_t *M);
+
+// Makes out a new VM in the state of tmpl. When tmpl was shared, the mem of
+// out is a private mapping of the snapshot, pages are only copied when out
+// writes them. Otherwise mem is copied. out is released by misp_deinit.
+bool misp_clone (const misp_t *tmpl, misp_t *out);
+
+/* Steps a job runs before going back to its deque */
+#define MISP_JOB_DEFAULT_SLICE (1 << 16)
+
+typedef struct
+{
+  misp_t *vm;      /* set up by the caller, with misp_init or misp_clone */
+  uint64_t steps;  /* steps done */
+  uint64_t slices; /* times the job was picked up by a worker */
+} misp_job_t;
+
+// Runs the VM of every job until it halts, over threads worker threads, the
+// calling thread included. The jobs are spread over a deque per worker,
+// and are run slice steps at a time; a worker out of jobs steals from the
+// others. The value of each program is left in vm->result, a panic in
+// vm->panic_code.
+void misp_jobs_run (misp_job_t *jobs, size_t count, size_t threads,
+                    uint64_t slice);
+
+/* Native functions are C functions run by nodes whose op is their opcode,
+   like the built-in ops. The params are evaluated first and handed over
+   checked against the signature, what the function leaves in ret is the
+   value of the node. The bytecode engine calls them directly. */
+
+#define MISP_OPC_NATIVE_BASE 128
+#define MISP_NATIVES_MAX 128
+#define MISP_NATIVE_MAX_ARITY 8
+
+// Returns MISP_PANIC_NO, or the panic of the node.
+typedef misp_panic_type_t (*misp_native_fn_t) (misp_t *M, const cell_t *args,
+                                               cell_t *ret, void *data);
+
+typedef enum
+{
+  MISP_NATIVE_OK = 0,
+  MISP_NATIVE_BAD_OPC,       /* not in the native range */
+  MISP_NATIVE_TAKEN,         /* opc has a function already */
+  MISP_NATIVE_BAD_SIGNATURE, /* unknown type or too many params */
+  MISP_NATIVE_OUT_OF_MEMORY,
+} misp_native_error_t;
+
+// Registers fn under opc, from MISP_OPC_NATIVE_BASE on, for M and the VMs
+// cloned from it afterwards. signature has a char per param: 'n' for a
+// number, 'l' for a list, 'a' for either. Nodes with another number of
+// params panic with MISP_PANIC_BAD_NODE_PARAMS, params of the wrong type
+// with MISP_PANIC_TYPE_ERROR. Register before running M.
+misp_native_error_t misp_register (misp_t *M, uint64_t opc,
+                                   const char *signature, misp_native_fn_t fn,
+                                   void *data);
+
+/* Cells for the host */
+
+cell_t misp_num (int64_t n);
+int64_t misp_num_val (cell_t c);
+bool misp_is_num (cell_t c);
+bool misp_is_list (cell_t c);
+size_t misp_list_len (cell_t list);
+
+// The cell i of list, i < misp_list_len (list).
+cell_t misp_list_at (misp_t *M, cell_t list, size_t i);
+
+void misp_list_put (misp_t *M, cell_t list, size_t i, cell_t c);
+
+// Allocates a zeroed list in the heap, false when out of memory. The lists
+// the caller holds may have moved afterwards, a native function reads its
+// args again with misp_native_args.
+bool misp_list_new (misp_t *M, size_t len, cell_t *list);
+
+// Copies the n args of the native function being run to args.
+void misp_native_args (misp_t *M, cell_t *args, size_t n);
+
+// The args of the root frame, the cells below the heap that programs get
+// and set.
+cell_t misp_root_args (misp_t *M);
+
+// Evaluates the list node in a new root frame with args, on an M that
+// halted, and leaves its value in ret. False when it panicked, the panic
+// is in M->panic_code. Not for native functions, which run inside M.
+bool misp_call (misp_t *M, cell_t node, cell_t args, cell_t *ret);
+
+#endif
@@ -0,0 +1,954 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#include "bytecode.h"
+#include "defs.h"
+#include "gc.h"
+#include "misp.h"
+#include "vm.h"
+#include <memory.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__GNUC__) && !defined(MISP_NO_THREADED)
+#define MISP_THREADED 1
+#endif
+
+bool
+misp_bc_init (misp_t *M)
+{
+  struct misp_bc *bc = calloc (1, sizeof (struct misp_bc));
+  if (!bc)
+    {
+      return false;
+    }
+  bc->code_lo = SIZE_MAX;
+  bc->pc = BC_NO_PC;
+  bc->tree_env = LIST_NULL;
+  M->bc = bc;
+  return true;
+}
+
+void
+misp_bc_reset (misp_t *M)
+{
+  M->bc->pc = BC_NO_PC;
+  M->bc->rets_size = 0;
+  M->bc->tree_env = LIST_NULL;
+}
+
+/* The engine keeps the current frame in locals: env, the args list, and the
+   stack as a base and a top (sp) cell index. The stack is only written back
+   to the frame cache by SYNC, before anything reading the frame. Like
+   misp_env_push, a push past the frame region panics. */
+
+#define CELL_AT(i) (&mem[(i) * CELL_SIZE])
+#define S(i, c) CELL_READ (CELL_AT (i), &(c))
+#define ARG(n, c) S (sp - k + (n), c)
+
+#define PUSH(c)                                                               \
+  {                                                                           \
+    cell_t pushed = (c);                                                      \
+    if (sp >= slimit)                                                         \
+      {                                                                       \
+        PANIC_AT (MISP_PANIC_STACK_OVERFLOW, M->frame.node);                  \
+      }                                                                       \
+    CELL_WRITE (CELL_AT (sp), pushed);                                        \
+    sp++;                                                                     \
+  }
+
+#define POP(c)                                                                \
+  {                                                                           \
+    sp--;                                                                     \
+    S (sp, c);                                                                \
+  }
+
+#define SYNC()                                                                \
+  {                                                                           \
+    M->frame.stack = LIST (sp - sbase, sbase);                                \
+    M->env = env;                                                             \
+  }
+
+#define LOAD_FRAME()                                                          \
+  {                                                                           \
+    env = M->env;                                                             \
+    args = M->frame.args;                                                     \
+    sbase = LIST_PTR (M->frame.stack);                                        \
+    sp = sbase + LIST_LEN (M->frame.stack);                                   \
+  }
+
+#define RETURN_K(c)                                                           \
+  {                                                                           \
+    sp -= k;                                                                  \
+    PUSH (c);                                                                 \
+  }
+
+#define PANIC_AT(type, node)                                                  \
+  {                                                                           \
+    panic = (misp_panic_t){ type, node };                                     \
+    goto panicked;                                                            \
+  }
+
+#define CHECK_NUM(c)                                                          \
+  if (!IS_NUM (c))                                                            \
+  PANIC_AT (MISP_PANIC_TYPE_ERROR, consts[node])
+
+#define CHECK_LIST(c)                                                         \
+  if (!IS_LIST (c))                                                           \
+  PANIC_AT (MISP_PANIC_TYPE_ERROR, consts[node])
+
+#define CHECK_BOUNDS(list, idx)                                               \
+  if (NUM_VAL (idx) >= LIST_LEN (list))                                       \
+  PANIC_AT (MISP_PANIC_OUT_OF_BOUNDS, consts[node])
+
+// Reads the operand a of a fused jump, see bytecode.h.
+#define OPERAND(a, c)                                                         \
+  if ((a) & 1)                                                                \
+    {                                                                         \
+      uint64_t i = NUM_VAL (consts[(a) >> 1]);                                \
+      if (i >= LIST_LEN (args))                                               \
+        {                                                                     \
+          PANIC_AT (MISP_PANIC_OUT_OF_BOUNDS, consts[((a) >> 1) + 1]);        \
+        }                                                                     \
+      S (LIST_PTR (args) + i, c);                                             \
+    }                                                                         \
+  else                                                                        \
+    {                                                                         \
+      c = consts[(a) >> 1];                                                   \
+    }
+
+#define GC_SAFEPOINT()                                                        \
+  if (M->heap.phase && !--M->heap.countdown)                                  \
+    {                                                                         \
+      misp_gc_step (M);                                                       \
+    }
+
+#ifdef MISP_THREADED
+#define OP(name) L_##name:
+#define DISPATCH()                                                            \
+  {                                                                           \
+    if (steps == max_steps)                                                   \
+      {                                                                       \
+        goto out_of_fuel;                                                     \
+      }                                                                       \
+    steps++;                                                                  \
+    goto *labels[code[pc++]];                                                 \
+  }
+#define RESUME() DISPATCH ()
+#else
+#define OP(name) case name:
+#define DISPATCH() continue
+#define RESUME() goto dispatch
+#endif
+
+#define NUMOP(name, expr)                                                     \
+  OP (name)                                                                   \
+  {                                                                           \
+    uint32_t k = code[pc++], node = code[pc++];                               \
+    cell_t a, b;                                                              \
+    ARG (0, a);                                                               \
+    ARG (1, b);                                                               \
+    CHECK_NUM (a);                                                            \
+    CHECK_NUM (b);                                                            \
+    int64_t x = NUM_VAL (a), y = NUM_VAL (b);                                 \
+    RETURN_K (NUM (expr));                                                    \
+  }                                                                           \
+  DISPATCH ();
+
+static void
+push_ret (struct misp_bc *bc, uint32_t pc)
+{
+  if (bc->rets_size == bc->rets_capacity)
+    {
+      bc->rets_capacity = bc->rets_capacity ? bc->rets_capacity * 2 : 64;
+      bc->rets = realloc (bc->rets, bc->rets_capacity * sizeof (uint32_t));
+      if (!bc->rets)
+        {
+          abort ();
+        }
+    }
+  bc->rets[bc->rets_size++] = pc;
+}
+
+// Steps the tree walker until the frame bc->tree_env is current again.
+static uint64_t
+run_tree (misp_t *M, uint64_t max_steps)
+{
+  struct misp_bc *bc = M->bc;
+  uint64_t steps = 0;
+  while (LIST_PTR (M->env) != LIST_PTR (bc->tree_env) && !M->halted
+         && steps < max_steps)
+    {
+      misp_execute (M);
+      steps++;
+    }
+  if (LIST_PTR (M->env) == LIST_PTR (bc->tree_env))
+    {
+      bc->tree_env = LIST_NULL;
+    }
+  return steps;
+}
+
+uint64_t
+misp_bc_run (misp_t *M, uint64_t max_steps)
+{
+  struct misp_bc *bc = M->bc;
+  uint8_t *mem = M->mem;
+  uint64_t steps = 0;
+  misp_panic_t panic;
+
+  if (M->halted)
+    {
+      return 0;
+    }
+  if (bc->pc == BC_NO_PC)
+    {
+      cell_t node = M->frame.node;
+      if (!IS_LIST (node) || !LIST_LEN (node))
+        {
+          M->halted = true;
+          M->panic_code = (misp_panic_t){ MISP_PANIC_BAD_NODE, node };
+          return 0;
+        }
+      bc->pc = misp_bc_unit (M, node);
+    }
+  if (LIST_LEN (bc->tree_env))
+    {
+      steps += run_tree (M, max_steps);
+      if (LIST_LEN (bc->tree_env) || M->halted)
+        {
+          return steps;
+        }
+    }
+
+  const uint32_t *code = bc->code;
+  const cell_t *consts = bc->consts;
+  uint32_t pc = bc->pc;
+  cell_t env, args;
+  size_t sbase, sp;
+  const size_t slimit = LIST_PTR (M->frames) + LIST_LEN (M->frames);
+  LOAD_FRAME ();
+
+#ifdef MISP_THREADED
+  static const void *labels[BC_COUNT] = {
+    [BC_PUSH] = &&L_BC_PUSH,       [BC_LOAD] = &&L_BC_LOAD,
+    [BC_POP] = &&L_BC_POP,         [BC_PICK] = &&L_BC_PICK,
+    [BC_SLIDE] = &&L_BC_SLIDE,     [BC_JMP] = &&L_BC_JMP,
+    [BC_JF] = &&L_BC_JF,           [BC_SELECT] = &&L_BC_SELECT,
+    [BC_EVAL] = &&L_BC_EVAL,       [BC_TAIL] = &&L_BC_TAIL,
+    [BC_RET] = &&L_BC_RET,         [BC_LET] = &&L_BC_LET,
+    [BC_TLET] = &&L_BC_TLET,       [BC_LEAVE] = &&L_BC_LEAVE,
+    [BC_MARK] = &&L_BC_MARK,       [BC_RELEASE] = &&L_BC_RELEASE,
+    [BC_TREE] = &&L_BC_TREE,       [BC_PANIC] = &&L_BC_PANIC,
+    [BC_NADD] = &&L_BC_NADD,       [BC_NSUB] = &&L_BC_NSUB,
+    [BC_NMUL] = &&L_BC_NMUL,       [BC_NDIV] = &&L_BC_NDIV,
+    [BC_NREM] = &&L_BC_NREM,       [BC_NMOD] = &&L_BC_NMOD,
+    [BC_NAND] = &&L_BC_NAND,       [BC_NOR] = &&L_BC_NOR,
+    [BC_NXOR] = &&L_BC_NXOR,       [BC_NLSR] = &&L_BC_NLSR,
+    [BC_NGRT] = &&L_BC_NGRT,       [BC_NGRTEQ] = &&L_BC_NGRTEQ,
+    [BC_NLSREQ] = &&L_BC_NLSREQ,   [BC_NADDK] = &&L_BC_NADDK,
+    [BC_NSUBK] = &&L_BC_NSUBK,     [BC_NMULK] = &&L_BC_NMULK,
+    [BC_NDIVK] = &&L_BC_NDIVK,     [BC_NREMK] = &&L_BC_NREMK,
+    [BC_NMODK] = &&L_BC_NMODK,     [BC_NANDK] = &&L_BC_NANDK,
+    [BC_NORK] = &&L_BC_NORK,       [BC_NXORK] = &&L_BC_NXORK,
+    [BC_NLSRK] = &&L_BC_NLSRK,     [BC_NGRTK] = &&L_BC_NGRTK,
+    [BC_NGRTEQK] = &&L_BC_NGRTEQK, [BC_NLSREQK] = &&L_BC_NLSREQK,
+    [BC_JNLSR] = &&L_BC_JNLSR,     [BC_JNGRT] = &&L_BC_JNGRT,
+    [BC_JNGRTEQ] = &&L_BC_JNGRTEQ, [BC_JNLSREQ] = &&L_BC_JNLSREQ,
+    [BC_GETK] = &&L_BC_GETK,       [BC_SETK] = &&L_BC_SETK,
+    [BC_INCK] = &&L_BC_INCK,       [BC_NNOT] = &&L_BC_NNOT,
+    [BC_EQ] = &&L_BC_EQ,           [BC_EQN] = &&L_BC_EQN,
+    [BC_GET] = &&L_BC_GET,         [BC_SET] = &&L_BC_SET,
+    [BC_LNEW] = &&L_BC_LNEW,       [BC_LLEN] = &&L_BC_LLEN,
+    [BC_LGET] = &&L_BC_LGET,       [BC_LSET] = &&L_BC_LSET,
+    [BC_LSUB] = &&L_BC_LSUB,       [BC_LCOPY] = &&L_BC_LCOPY,
+    [BC_LFILL] = &&L_BC_LFILL,     [BC_LCAT] = &&L_BC_LCAT,
+    [BC_ALLOC] = &&L_BC_ALLOC,     [BC_DBUG] = &&L_BC_DBUG,
+    [BC_HASH] = &&L_BC_HASH,       [BC_TYPED] = &&L_BC_TYPED,
+    [BC_NATIVE] = &&L_BC_NATIVE,
+  };
+  DISPATCH ();
+#else
+dispatch:
+  for (;;)
+    {
+      if (steps == max_steps)
+        {
+          goto out_of_fuel;
+        }
+      steps++;
+      switch (code[pc++])
+        {
+#endif
+
+  OP (BC_PUSH)
+  {
+    PUSH (consts[code[pc++]]);
+  }
+  DISPATCH ();
+
+  OP (BC_LOAD)
+  {
+    cell_t c;
+    S (code[pc++], c);
+    PUSH (c);
+  }
+  DISPATCH ();
+
+  OP (BC_POP)
+  {
+    sp--;
+  }
+  DISPATCH ();
+
+  OP (BC_PICK)
+  {
+    cell_t c;
+    S (sp - 1 - code[pc++], c);
+    PUSH (c);
+  }
+  DISPATCH ();
+
+  OP (BC_SLIDE)
+  {
+    cell_t c;
+    POP (c);
+    sp -= code[pc++];
+    PUSH (c);
+  }
+  DISPATCH ();
+
+  OP (BC_JMP)
+  {
+    pc = code[pc];
+    GC_SAFEPOINT ();
+  }
+  DISPATCH ();
+
+  OP (BC_JF)
+  {
+    cell_t c;
+    POP (c);
+    if (IS_TRUE (c))
+      {
+        pc++;
+      }
+    else
+      {
+        pc = code[pc];
+      }
+  }
+  DISPATCH ();
+
+  OP (BC_SELECT)
+  {
+    cell_t r, a, b;
+    POP (r);
+    POP (b);
+    POP (a);
+    PUSH (IS_TRUE (r) ? a : b);
+  }
+  DISPATCH ();
+
+  OP (BC_TAIL)
+  {
+    cell_t v;
+    S (sp - 1, v);
+    if (IS_LIST (v) && LIST_LEN (v)
+        && LIST_PTR (v) + LIST_LEN (v) <= M->heap.base)
+      {
+        sp = sbase;
+        SYNC ();
+        misp_env_tail (M, v);
+        GC_SAFEPOINT ();
+        pc = misp_bc_unit (M, v);
+        code = bc->code;
+        consts = bc->consts;
+        LOAD_FRAME ();
+        DISPATCH ();
+      }
+  }
+  /* anything else is evaluated in a new frame */
+
+  OP (BC_EVAL)
+  {
+    cell_t v, trap;
+    POP (v);
+    if (IS_NUM (v))
+      {
+        PUSH (v);
+        DISPATCH ();
+      }
+
+    SYNC ();
+    misp_env_trap (M, &trap);
+    misp_env_begin (M, v, args, trap);
+    if (M->halted)
+      {
+        bc->pc = pc;
+        return steps;
+      }
+    GC_SAFEPOINT ();
+    if (!LIST_LEN (v) || LIST_PTR (v) + LIST_LEN (v) > M->heap.base)
+      {
+        /* lists in the heap move, leave them to the tree walker */
+        bc->tree_env = env;
+        goto tree;
+      }
+
+    push_ret (bc, pc);
+    pc = misp_bc_unit (M, v);
+    code = bc->code;
+    consts = bc->consts;
+    LOAD_FRAME ();
+  }
+  DISPATCH ();
+
+  OP (BC_RET)
+  {
+    cell_t r;
+    POP (r);
+    SYNC ();
+    misp_env_ret (M, r);
+    if (M->halted)
+      {
+        bc->pc = pc;
+        return steps;
+      }
+    pc = bc->rets[--bc->rets_size];
+    LOAD_FRAME ();
+  }
+  DISPATCH ();
+
+  OP (BC_LET)
+  {
+    uint32_t k = code[pc++], body = code[pc++];
+    SYNC ();
+    misp_env_begin (M, consts[body], LIST (k, sp - k), LIST_NULL);
+    if (M->halted)
+      {
+        bc->pc = pc;
+        return steps;
+      }
+    LOAD_FRAME ();
+  }
+  DISPATCH ();
+
+  OP (BC_TLET)
+  {
+    uint32_t k = code[pc++], body = code[pc++];
+    SYNC ();
+    misp_env_rebind (M, consts[body], k);
+    LOAD_FRAME ();
+  }
+  DISPATCH ();
+
+  OP (BC_LEAVE)
+  {
+    uint32_t k = code[pc++];
+    cell_t r;
+    POP (r);
+    M->env = M->frame.parent;
+    misp_env_load (M);
+    LOAD_FRAME ();
+    RETURN_K (r);
+  }
+  DISPATCH ();
+
+  OP (BC_TREE)
+  {
+    cell_t trap;
+    SYNC ();
+    misp_env_trap (M, &trap);
+    misp_env_begin (M, consts[code[pc++]], args, trap);
+    if (M->halted)
+      {
+        bc->pc = pc;
+        return steps;
+      }
+    bc->tree_env = env;
+    goto tree;
+  }
+
+  OP (BC_PANIC)
+  {
+    misp_panic_type_t type = code[pc++];
+    PANIC_AT (type, consts[code[pc++]]);
+  }
+
+  NUMOP (BC_NADD, x + y)
+  NUMOP (BC_NSUB, x - y)
+  NUMOP (BC_NMUL, x * y)
+  NUMOP (BC_NDIV, x / y)
+  NUMOP (BC_NREM, x % y)
+  NUMOP (BC_NMOD, (x % y + y) % y)
+  NUMOP (BC_NAND, x & y)
+  NUMOP (BC_NOR, x | y)
+  NUMOP (BC_NXOR, x ^ y)
+  NUMOP (BC_NLSR, x < y)
+  NUMOP (BC_NGRT, x > y)
+  NUMOP (BC_NGRTEQ, x >= y)
+  NUMOP (BC_NLSREQ, x <= y)
+
+#define NUMOPK(name, expr)                                                    \
+  OP (name)                                                                   \
+  {                                                                           \
+    uint32_t c = code[pc++], node = code[pc++];                               \
+    cell_t a;                                                                 \
+    S (sp - 1, a);                                                            \
+    CHECK_NUM (a);                                                            \
+    int64_t x = NUM_VAL (a), y = NUM_VAL (consts[c]);                         \
+    cell_t r = NUM (expr);                                                    \
+    CELL_WRITE (CELL_AT (sp - 1), r);                                         \
+  }                                                                           \
+  DISPATCH ();
+
+  NUMOPK (BC_NADDK, x + y)
+  NUMOPK (BC_NSUBK, x - y)
+  NUMOPK (BC_NMULK, x * y)
+  NUMOPK (BC_NDIVK, x / y)
+  NUMOPK (BC_NREMK, x % y)
+  NUMOPK (BC_NMODK, (x % y + y) % y)
+  NUMOPK (BC_NANDK, x & y)
+  NUMOPK (BC_NORK, x | y)
+  NUMOPK (BC_NXORK, x ^ y)
+  NUMOPK (BC_NLSRK, x < y)
+  NUMOPK (BC_NGRTK, x > y)
+  NUMOPK (BC_NGRTEQK, x >= y)
+  NUMOPK (BC_NLSREQK, x <= y)
+
+#define JUMPOP(name, expr)                                                    \
+  OP (name)                                                                   \
+  {                                                                           \
+    uint32_t a = code[pc++], b = code[pc++], node = code[pc++];               \
+    cell_t ca, cb;                                                            \
+    OPERAND (a, ca);                                                          \
+    OPERAND (b, cb);                                                          \
+    CHECK_NUM (ca);                                                           \
+    CHECK_NUM (cb);                                                           \
+    int64_t x = NUM_VAL (ca), y = NUM_VAL (cb);                               \
+    pc = (expr) ? pc + 1 : code[pc];                                          \
+  }                                                                           \
+  DISPATCH ();
+
+  JUMPOP (BC_JNLSR, x < y)
+  JUMPOP (BC_JNGRT, x > y)
+  JUMPOP (BC_JNGRTEQ, x >= y)
+  JUMPOP (BC_JNLSREQ, x <= y)
+
+  OP (BC_GETK)
+  {
+    uint32_t n = code[pc++], node = code[pc++];
+    cell_t r;
+    if (n >= LIST_LEN (args))
+      {
+        PANIC_AT (MISP_PANIC_OUT_OF_BOUNDS, consts[node]);
+      }
+    S (LIST_PTR (args) + n, r);
+    PUSH (r);
+  }
+  DISPATCH ();
+
+  OP (BC_SETK)
+  {
+    uint32_t n = code[pc++], node = code[pc++];
+    cell_t c;
+    if (n >= LIST_LEN (args))
+      {
+        PANIC_AT (MISP_PANIC_OUT_OF_BOUNDS, consts[node]);
+      }
+    S (sp - 1, c);
+    misp_list_set (M, args, c, n);
+    misp_bc_written (M, LIST_PTR (args) + n);
+  }
+  DISPATCH ();
+
+  OP (BC_INCK)
+  {
+    uint32_t n = code[pc++], c = code[pc++], node = code[pc++];
+    cell_t r;
+    if (n >= LIST_LEN (args))
+      {
+        PANIC_AT (MISP_PANIC_OUT_OF_BOUNDS, consts[node + 1]);
+      }
+    S (LIST_PTR (args) + n, r);
+    CHECK_NUM (r);
+    r = NUM (NUM_VAL (r) + NUM_VAL (consts[c]));
+    misp_list_set (M, args, r, n);
+    misp_bc_written (M, LIST_PTR (args) + n);
+    PUSH (r);
+  }
+  DISPATCH ();
+
+  OP (BC_NNOT)
+  {
+    uint32_t k = code[pc++], node = code[pc++];
+    cell_t c;
+    ARG (0, c);
+    CHECK_NUM (c);
+    RETURN_K (NUM (~NUM_VAL (c)));
+  }
+  DISPATCH ();
+
+  OP (BC_EQ)
+  OP (BC_EQN)
+  {
+    bool negate = code[pc - 1] == BC_EQN;
+    uint32_t k = code[pc++], node = code[pc++];
+    cell_t a, b;
+    bool eq;
+    ARG (0, a);
+    ARG (1, b);
+    if (IS_LIST (a))
+      {
+        CHECK_LIST (b);
+        eq = LIST_LEN (a) == LIST_LEN (b) && LIST_PTR (a) == LIST_PTR (b);
+      }
+    else
+      {
+        CHECK_NUM (b);
+        eq = NUM_VAL (a) == NUM_VAL (b);
+      }
+    RETURN_K (NUM (eq != negate));
+  }
+  DISPATCH ();
+
+  OP (BC_GET)
+  {
+    uint32_t k = code[pc++], node = code[pc++];
+    cell_t idx, r;
+    ARG (0, idx);
+    CHECK_NUM (idx);
+    CHECK_BOUNDS (args, idx);
+    S (LIST_PTR (args) + NUM_VAL (idx), r);
+    RETURN_K (r);
+  }
+  DISPATCH ();
+
+  OP (BC_SET)
+  {
+    uint32_t k = code[pc++], node = code[pc++];
+    cell_t idx, c;
+    ARG (0, idx);
+    ARG (1, c);
+    CHECK_NUM (idx);
+    CHECK_BOUNDS (args, idx);
+    misp_list_set (M, args, c, NUM_VAL (idx));
+    misp_bc_written (M, LIST_PTR (args) + NUM_VAL (idx));
+    RETURN_K (c);
+  }
+  DISPATCH ();
+
+  OP (BC_LNEW)
+  {
+    uint32_t k = code[pc++], node = code[pc++];
+    cell_t list;
+    SYNC ();
+    GC_SAFEPOINT ();
+    if (!misp_alloc (M, k, &list))
+      {
+        PANIC_AT (MISP_PANIC_OUT_OF_MEMORY, consts[node]);
+      }
+    // the params may have moved, but the stack did not
+    memcpy (CELL_AT (LIST_PTR (list)), CELL_AT (sp - k), k * CELL_SIZE);
+    RETURN_K (list);
+  }
+  DISPATCH ();
+
+  OP (BC_LLEN)
+  {
+    uint32_t k = code[pc++], node = code[pc++];
+    cell_t list;
+    ARG (0, list);
+    CHECK_LIST (list);
+    RETURN_K (NUM (LIST_LEN (list)));
+  }
+  DISPATCH ();
+
+  OP (BC_LGET)
+  {
+    uint32_t k = code[pc++], node = code[pc++];
+    cell_t list, idx, r;
+    ARG (0, list);
+    ARG (1, idx);
+    CHECK_LIST (list);
+    CHECK_NUM (idx);
+    CHECK_BOUNDS (list, idx);
+    S (LIST_PTR (list) + NUM_VAL (idx), r);
+    RETURN_K (r);
+  }
+  DISPATCH ();
+
+  OP (BC_LSET)
+  {
+    uint32_t k = code[pc++], node = code[pc++];
+    cell_t list, idx, c;
+    ARG (0, list);
+    ARG (1, idx);
+    ARG (2, c);
+    CHECK_LIST (list);
+    CHECK_NUM (idx);
+    CHECK_BOUNDS (list, idx);
+    misp_list_set (M, list, c, NUM_VAL (idx));
+    misp_bc_written (M, LIST_PTR (list) + NUM_VAL (idx));
+    RETURN_K (c);
+  }
+  DISPATCH ();
+
+  OP (BC_LSUB)
+  {
+    uint32_t k = code[pc++], node = code[pc++];
+    cell_t list, a, b;
+    ARG (0, list);
+    ARG (1, a);
+    ARG (2, b);
+    CHECK_LIST (list);
+    CHECK_NUM (a);
+    CHECK_NUM (b);
+    CHECK_BOUNDS (list, a);
+    if (NUM_VAL (b) > LIST_LEN (list) || NUM_VAL (b) < NUM_VAL (a))
+      {
+        PANIC_AT (MISP_PANIC_OUT_OF_BOUNDS, consts[node]);
+      }
+    RETURN_K (LIST (NUM_VAL (b) - NUM_VAL (a), LIST_PTR (list) + NUM_VAL (a)));
+  }
+  DISPATCH ();
+
+  OP (BC_LCOPY)
+  {
+    uint32_t k = code[pc++], node = code[pc++];
+    cell_t dst, src;
+    struct misp_typed t;
+    misp_panic_type_t type;
+    ARG (0, dst);
+    ARG (1, src);
+    CHECK_LIST (dst);
+    CHECK_LIST (src);
+    if (misp_typed_of (M, dst, &t) || misp_typed_of (M, src, &t))
+      {
+        type = misp_typed_copy (M, dst, src);
+        misp_bc_written_range (M, LIST_PTR (dst),
+                               LIST_PTR (dst) + LIST_LEN (dst));
+        if (type)
+          {
+            PANIC_AT (type, consts[node]);
+          }
+        RETURN_K (dst);
+        DISPATCH ();
+      }
+    if (LIST_LEN (src) > LIST_LEN (dst))
+      {
+        PANIC_AT (MISP_PANIC_OUT_OF_BOUNDS, consts[node]);
+      }
+    misp_list_copy (M, dst, src);
+    misp_bc_written_range (M, LIST_PTR (dst), LIST_PTR (dst) + LIST_LEN (src));
+    RETURN_K (dst);
+  }
+  DISPATCH ();
+
+  OP (BC_LFILL)
+  {
+    uint32_t k = code[pc++], node = code[pc++];
+    cell_t list, c;
+    struct misp_typed t;
+    ARG (0, list);
+    ARG (1, c);
+    CHECK_LIST (list);
+    if (!misp_typed_of (M, list, &t))
+      {
+        misp_list_fill (M, list, c);
+      }
+    else if (misp_typed_fill (M, &t, c))
+      {
+        PANIC_AT (MISP_PANIC_TYPE_ERROR, consts[node]);
+      }
+    misp_bc_written_range (M, LIST_PTR (list),
+                           LIST_PTR (list) + LIST_LEN (list));
+    RETURN_K (list);
+  }
+  DISPATCH ();
+
+  OP (BC_LCAT)
+  {
+    uint32_t k = code[pc++], node = code[pc++];
+    cell_t list, r;
+    struct misp_typed t;
+    misp_panic_type_t type;
+    size_t len = 0;
+    bool typed = false;
+    for (uint32_t i = 0; i < k; i++)
+      {
+        ARG (i, list);
+        CHECK_LIST (list);
+        typed = typed || misp_typed_of (M, list, &t);
+        len += LIST_LEN (list);
+      }
+    SYNC ();
+    GC_SAFEPOINT ();
+    if (typed)
+      {
+        if ((type = misp_typed_cat (M, sp - k, k, &r)))
+          {
+            PANIC_AT (type, consts[node]);
+          }
+        RETURN_K (r);
+        DISPATCH ();
+      }
+    if (len > LIST_MAX_LEN || !misp_alloc (M, len, &r))
+      {
+        PANIC_AT (MISP_PANIC_OUT_OF_MEMORY, consts[node]);
+      }
+    // the lists may have moved, the stack holds them as they are now
+    len = 0;
+    for (uint32_t i = 0; i < k; i++)
+      {
+        ARG (i, list);
+        memcpy (CELL_AT (LIST_PTR (r) + len), CELL_AT (LIST_PTR (list)),
+                LIST_LEN (list) * CELL_SIZE);
+        len += LIST_LEN (list);
+      }
+    RETURN_K (r);
+  }
+  DISPATCH ();
+
+  OP (BC_ALLOC)
+  {
+    uint32_t k = code[pc++], node = code[pc++];
+    cell_t len, r;
+    ARG (0, len);
+    CHECK_NUM (len);
+    SYNC ();
+    if (!misp_arena_alloc (M, NUM_VAL (len), &r))
+      {
+        PANIC_AT (MISP_PANIC_OUT_OF_MEMORY, consts[node]);
+      }
+    RETURN_K (r);
+  }
+  DISPATCH ();
+
+  OP (BC_MARK)
+  {
+    PUSH (NUM (M->heap.end - M->heap.arena));
+  }
+  DISPATCH ();
+
+  OP (BC_RELEASE)
+  {
+    cell_t mark, r;
+    POP (r);
+    POP (mark);
+    M->heap.arena = M->heap.end - NUM_VAL (mark);
+    PUSH (r);
+  }
+  DISPATCH ();
+
+  OP (BC_DBUG)
+  {
+    uint32_t k = code[pc++], node = code[pc++];
+    cell_t c;
+    (void)node;
+    ARG (0, c);
+    flockfile (stdout);
+    misp_debug (M, c);
+    printf ("\n");
+    funlockfile (stdout);
+    RETURN_K (c);
+  }
+  DISPATCH ();
+
+  OP (BC_HASH)
+  {
+    uint32_t k = code[pc++], node = code[pc++], opc = code[pc++];
+    cell_t r;
+    misp_panic_type_t type;
+    SYNC ();
+    GC_SAFEPOINT ();
+    if ((type = misp_hash_op (M, opc, sp - k, k, &r)))
+      {
+        PANIC_AT (type, consts[node]);
+      }
+    RETURN_K (r);
+  }
+  DISPATCH ();
+
+  OP (BC_TYPED)
+  {
+    uint32_t k = code[pc++], node = code[pc++], opc = code[pc++];
+    cell_t r;
+    misp_panic_type_t type;
+    SYNC ();
+    GC_SAFEPOINT ();
+    if ((type = misp_typed_op (M, opc, sp - k, k, &r)))
+      {
+        PANIC_AT (type, consts[node]);
+      }
+    RETURN_K (r);
+  }
+  DISPATCH ();
+
+  OP (BC_NATIVE)
+  {
+    uint32_t k = code[pc++], node = code[pc++];
+    const struct misp_native *n = &M->natives->fns[code[pc++]];
+    cell_t a[MISP_NATIVE_MAX_ARITY], r;
+    misp_panic_type_t type;
+    for (uint32_t i = 0; i < k; i++)
+      {
+        ARG (i, a[i]);
+      }
+    SYNC ();
+    if ((type = misp_native_call (M, n, a, &r)))
+      {
+        PANIC_AT (type, consts[node]);
+      }
+    RETURN_K (r);
+  }
+  DISPATCH ();
+
+#ifndef MISP_THREADED
+        default:
+          abort ();
+        }
+    }
+#endif
+
+tree:
+  bc->pc = pc;
+  steps += run_tree (M, max_steps - steps);
+  if (LIST_LEN (bc->tree_env) || M->halted)
+    {
+      return steps;
+    }
+  LOAD_FRAME ();
+  RESUME ();
+
+out_of_fuel:
+  SYNC ();
+  bc->pc = pc;
+  return steps;
+
+panicked:
+  SYNC ();
+  bc->pc = pc;
+  M->halted = true;
+  M->panic_code = panic;
+  return steps;
+}
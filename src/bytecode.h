@@ -0,0 +1,184 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#ifndef MISP_BYTECODE_H
+#define MISP_BYTECODE_H
+
+#include "misp.h"
+
+/* Instructions are a word followed by their operands. Values live on the
+   stack of the current frame, exactly where the tree walker keeps the
+   evaluated params of a node. "k" operands count the params a node
+   evaluated, only the first ones are used like in the tree walker. */
+enum
+{
+  BC_PUSH,   /* c: push consts[c] */
+  BC_LOAD,   /* a: push the cell at mem index a */
+  BC_POP,    /* drop the top */
+  BC_PICK,   /* n: push a copy of the cell n below the top */
+  BC_SLIDE,  /* n: drop the n cells below the top */
+  BC_JMP,    /* t: jump to t */
+  BC_JF,     /* t: pop, jump to t when false */
+  BC_SELECT, /* pop r, b, a and push r ? a : b */
+  BC_EVAL,   /* pop a value and evaluate it */
+  BC_TAIL,   /* like EVAL, reusing the frame of the unit for a list */
+  BC_RET,    /* return the top from the current unit */
+  BC_LET,    /* k c: begin a frame for node consts[c] with the top k
+                cells as args */
+  BC_TLET,   /* k c: like LET, in the frame of the unit */
+  BC_LEAVE,  /* k: return the top from a let frame, dropping k binds */
+  BC_MARK,   /* push the arena depth, from the heap end */
+  BC_RELEASE, /* pop r, then the arena depth to go back to, and push r */
+  BC_TREE,   /* c: evaluate node consts[c] with the tree walker */
+  BC_PANIC,  /* type c */
+  BC_NADD,   /* k c, for the numeric ops from NADD to NLSREQ */
+  BC_NSUB,
+  BC_NMUL,
+  BC_NDIV,
+  BC_NREM,
+  BC_NMOD,
+  BC_NAND,
+  BC_NOR,
+  BC_NXOR,
+  BC_NLSR,
+  BC_NGRT,
+  BC_NGRTEQ,
+  BC_NLSREQ,
+  /* Superinstructions for the common shapes, with (get n) and number
+     operands read in place instead of being pushed. The operand a of a
+     jump is 2i for consts[i], or 2i + 1 for a (get n) with n = consts[i]
+     and the get node in consts[i + 1]. */
+  BC_NADDK, /* c d: top op consts[c], consts[d] is the node, for the ops
+               from NADD to NLSREQ */
+  BC_NSUBK,
+  BC_NMULK,
+  BC_NDIVK,
+  BC_NREMK,
+  BC_NMODK,
+  BC_NANDK,
+  BC_NORK,
+  BC_NXORK,
+  BC_NLSRK,
+  BC_NGRTK,
+  BC_NGRTEQK,
+  BC_NLSREQK,
+  BC_JNLSR,   /* a b d t: jump to t unless a op b, for the ops from NLSR to
+                 NLSREQ */
+  BC_JNGRT,
+  BC_JNGRTEQ,
+  BC_JNLSREQ,
+  BC_GETK,    /* n c: push args[n], consts[c] is the get node */
+  BC_SETK,    /* n c: set args[n] to the top */
+  BC_INCK,    /* n c d: args[n] += consts[c] and push it, consts[d] is the
+                 + node and consts[d + 1] the get node */
+  BC_NNOT, /* k c, and the same for the ones below */
+  BC_EQ,
+  BC_EQN,
+  BC_GET,
+  BC_SET,
+  BC_LNEW,
+  BC_LLEN,
+  BC_LGET,
+  BC_LSET,
+  BC_LSUB,
+  BC_LCOPY,
+  BC_LFILL,
+  BC_LCAT,
+  BC_ALLOC,
+  BC_DBUG,
+  BC_HASH,   /* k c o: the hash map op o */
+  BC_TYPED,  /* k c o: the typed array op o */
+  BC_NATIVE, /* k c i: native function i, from MISP_OPC_NATIVE_BASE on */
+  BC_COUNT,
+};
+
+#define BC_NO_PC UINT32_MAX
+
+struct misp_bc
+{
+  uint32_t *code;
+  size_t code_size;
+  size_t code_capacity;
+
+  cell_t *consts;
+  size_t consts_size;
+  size_t consts_capacity;
+
+  /* compiled units, keyed by the list they evaluate */
+  uint64_t *keys;
+  uint32_t *entries;
+  size_t units;
+  size_t units_capacity;
+
+  /* code and consts sizes where each unit starts, in compile order */
+  uint32_t *starts_code;
+  uint32_t *starts_consts;
+  size_t starts_size;
+  size_t starts_capacity;
+
+  /* cells read by the compiler, writes there drop the unit cache */
+  size_t code_lo;
+  size_t code_hi;
+  bool stale;
+  size_t drops; /* times the units were dropped for being stale */
+
+  /* EXECUTION STATE */
+  uint32_t pc;
+  uint32_t *rets; /* return pcs of the units being evaluated */
+  size_t rets_size;
+  size_t rets_capacity;
+  cell_t tree_env; /* frame waiting for the tree walker, if any */
+};
+
+// Entry pc of the unit evaluating the static list node, compiling it on
+// first use.
+uint32_t misp_bc_unit (misp_t *M, cell_t node);
+
+void misp_bc_free (misp_t *M);
+
+// Drops every unit and its code, for an engine with nothing running.
+void misp_bc_clear (misp_t *M);
+
+// Forgets where the engine stopped, for a new root frame.
+void misp_bc_reset (misp_t *M);
+
+// Gives M its own copy of the engine from, compiled units included.
+bool misp_bc_copy (misp_t *M, const struct misp_bc *from);
+
+static inline void
+misp_bc_written (misp_t *M, size_t i)
+{
+  struct misp_bc *bc = M->bc;
+  if (bc && i >= bc->code_lo && i < bc->code_hi)
+    {
+      bc->stale = true;
+    }
+}
+
+// Same for the cells [a, b[.
+static inline void
+misp_bc_written_range (misp_t *M, size_t a, size_t b)
+{
+  struct misp_bc *bc = M->bc;
+  if (bc && a < bc->code_hi && b > bc->code_lo)
+    {
+      bc->stale = true;
+    }
+}
+
+#endif
@@ -0,0 +1,202 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#define _GNU_SOURCE
+#include "bytecode.h"
+#include "defs.h"
+#include "gc.h"
+#include "misp.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* What misp_share keeps: mem in a memfd, and a copy of the VM state whose
+   mem is left NULL. */
+struct misp_snapshot
+{
+  int fd;
+  misp_t vm;
+};
+
+// Gives M the state of from, with its own heap bitmaps and bytecode.
+static bool
+copy_state (misp_t *M, const misp_t *from)
+{
+  *M = *from;
+  M->mem = NULL;
+  M->mem_mapped = false;
+  M->snapshot = NULL;
+  M->bc = NULL;
+  M->trace = NULL;
+  M->par = NULL;
+  if (!misp_heap_copy (M, &from->heap))
+    {
+      return false;
+    }
+  if (from->bc && !misp_bc_copy (M, from->bc))
+    {
+      misp_heap_free (M);
+      return false;
+    }
+  if (M->natives)
+    {
+      M->natives->refs++;
+    }
+  return true;
+}
+
+/* Nothing between the heap top and the arena is ever read before
+   misp_alloc or misp_arena_alloc clears it, so only the mem below the top,
+   [0, *top[, and the mem from the arena on, [*arena, mem_size[, have to be
+   kept. Without a heap, all of it is. */
+static void
+used_ranges (const misp_t *M, size_t *top, size_t *arena)
+{
+  *top = M->heap.top * CELL_SIZE;
+  *arena = M->heap.arena * CELL_SIZE;
+  if (!*top || *top > *arena || *arena > M->mem_size)
+    {
+      *top = *arena = M->mem_size;
+    }
+}
+
+static bool
+is_zero (const uint8_t *p, size_t n)
+{
+  return !p[0] && !memcmp (p, p + 1, n - 1);
+}
+
+// Writes the bytes [a, b[ of mem to fd, leaving zero pages as holes.
+static bool
+write_range (int fd, const uint8_t *mem, size_t a, size_t b)
+{
+  size_t page = sysconf (_SC_PAGESIZE);
+  for (size_t off = a; off < b;)
+    {
+      size_t n = page - off % page;
+      if (n > b - off)
+        {
+          n = b - off;
+        }
+      if (!is_zero (&mem[off], n)
+          && pwrite (fd, &mem[off], n, off) != (ssize_t)n)
+        {
+          return false;
+        }
+      off += n;
+    }
+  return true;
+}
+
+static void
+snapshot_free (struct misp_snapshot *s)
+{
+  if (s)
+    {
+      close (s->fd);
+      misp_deinit (&s->vm);
+      free (s);
+    }
+}
+
+bool
+misp_share (misp_t *M)
+{
+  struct misp_snapshot *s = malloc (sizeof (struct misp_snapshot));
+  if (!s)
+    {
+      return false;
+    }
+  s->fd = memfd_create ("misp", MFD_CLOEXEC);
+  if (s->fd < 0)
+    {
+      free (s);
+      return false;
+    }
+
+  /* the frame cache is copied with the state, mem needs nothing else */
+  size_t top, arena;
+  used_ranges (M, &top, &arena);
+  bool ok = !ftruncate (s->fd, M->mem_size)
+            && write_range (s->fd, M->mem, 0, top)
+            && write_range (s->fd, M->mem, arena, M->mem_size);
+  if (!ok || !copy_state (&s->vm, M))
+    {
+      close (s->fd);
+      free (s);
+      return false;
+    }
+
+  snapshot_free (M->snapshot);
+  M->snapshot = s;
+  return true;
+}
+
+bool
+misp_clone (const misp_t *tmpl, misp_t *out)
+{
+  const struct misp_snapshot *s = tmpl->snapshot;
+  const misp_t *from = s ? &s->vm : tmpl;
+  uint8_t *mem = misp_mem_map (from->mem_limit, 0);
+  if (!mem)
+    {
+      return false;
+    }
+  if (s)
+    {
+      /* the snapshot goes over the start of the mem reserved for the clone,
+         the heap can still grow past it */
+      if (mmap (mem, from->mem_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, s->fd, 0)
+          == MAP_FAILED)
+        {
+          misp_mem_unmap (mem, from->mem_limit);
+          return false;
+        }
+    }
+  else
+    {
+      size_t top, arena;
+      used_ranges (tmpl, &top, &arena);
+      memcpy (mem, tmpl->mem, top);
+      memcpy (mem + arena, tmpl->mem + arena, tmpl->mem_size - arena);
+    }
+  if (!copy_state (out, from))
+    {
+      misp_mem_unmap (mem, from->mem_limit);
+      return false;
+    }
+  out->mem = mem;
+  out->mem_mapped = true;
+  return true;
+}
+
+void
+misp_clone_release (misp_t *M)
+{
+  snapshot_free (M->snapshot);
+  M->snapshot = NULL;
+  if (M->mem_mapped)
+    {
+      misp_mem_unmap (M->mem, M->mem_limit);
+      M->mem = NULL;
+      M->mem_mapped = false;
+    }
+}
@@ -0,0 +1,891 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#include "bytecode.h"
+#include "defs.h"
+#include "misp.h"
+#include "opc.h"
+#include "vm.h"
+#include <memory.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Lists quoted deeper than this are called as units instead of being
+   inlined, which also stops the compiler on cyclic code. */
+#define MAX_INLINE_DEPTH 32
+
+static void *
+grow (void *p, size_t *capacity, size_t size, size_t elem)
+{
+  if (size < *capacity)
+    {
+      return p;
+    }
+  *capacity = *capacity ? *capacity * 2 : 256;
+  p = realloc (p, *capacity * elem);
+  if (!p)
+    {
+      abort ();
+    }
+  return p;
+}
+
+static size_t
+emit (struct misp_bc *bc, uint32_t word)
+{
+  bc->code = grow (bc->code, &bc->code_capacity, bc->code_size,
+                   sizeof (uint32_t));
+  bc->code[bc->code_size] = word;
+  return bc->code_size++;
+}
+
+static uint32_t
+konst (struct misp_bc *bc, cell_t c)
+{
+  bc->consts = grow (bc->consts, &bc->consts_capacity, bc->consts_size,
+                     sizeof (cell_t));
+  bc->consts[bc->consts_size] = c;
+  return bc->consts_size++;
+}
+
+static void
+emit_push (struct misp_bc *bc, cell_t c)
+{
+  emit (bc, BC_PUSH);
+  emit (bc, konst (bc, c));
+}
+
+static void
+read_cell (misp_t *M, size_t a, cell_t *c)
+{
+  struct misp_bc *bc = M->bc;
+  CELL_READ (&M->mem[a * CELL_SIZE], c);
+  if (a < bc->code_lo)
+    {
+      bc->code_lo = a;
+    }
+  if (a >= bc->code_hi)
+    {
+      bc->code_hi = a + 1;
+    }
+}
+
+// Lists outside of the heap never move, so they can be baked in the code.
+static bool
+is_static (misp_t *M, cell_t c)
+{
+  return IS_LIST (c) && LIST_PTR (c) + LIST_LEN (c) <= M->heap.base;
+}
+
+static void compile_node (misp_t *M, cell_t node, int depth, bool tail);
+
+static void
+emit_eval (struct misp_bc *bc, bool tail)
+{
+  emit (bc, tail ? BC_TAIL : BC_EVAL);
+}
+
+// Evaluates the param at a, like the tree walker does before running a node.
+// tail is set when nothing but a return of the unit follows.
+static void
+compile_param (misp_t *M, size_t a, int depth, bool tail)
+{
+  struct misp_bc *bc = M->bc;
+  cell_t c;
+  read_cell (M, a, &c);
+  if (IS_NUM (c))
+    {
+      emit_push (bc, c);
+    }
+  else if (is_static (M, c))
+    {
+      compile_node (M, c, depth + 1, tail);
+    }
+  else
+    {
+      emit (bc, BC_LOAD);
+      emit (bc, a);
+      emit_eval (bc, tail);
+    }
+}
+
+static void
+compile_params (misp_t *M, size_t a, size_t k, int depth)
+{
+  for (size_t i = 0; i < k; i++)
+    {
+      compile_param (M, a + i, depth, false);
+    }
+}
+
+// Params whose value is known without running anything: numbers and quotes.
+static bool
+is_static_param (misp_t *M, size_t a)
+{
+  cell_t c, op;
+  read_cell (M, a, &c);
+  if (IS_NUM (c))
+    {
+      return true;
+    }
+  if (!is_static (M, c) || LIST_LEN (c) < 2)
+    {
+      return false;
+    }
+  read_cell (M, LIST_PTR (c), &op);
+  return IS_NUM (op) && NUM_VAL (op) == MISP_OPC_QUOTE;
+}
+
+// Whether c is a static (get n) node with a number n that fits an operand.
+static bool
+is_get_k (misp_t *M, cell_t c, uint32_t *n)
+{
+  cell_t op, idx;
+  if (!is_static (M, c) || LIST_LEN (c) != 2)
+    {
+      return false;
+    }
+  read_cell (M, LIST_PTR (c), &op);
+  read_cell (M, LIST_PTR (c) + 1, &idx);
+  if (!IS_NUM (op) || NUM_VAL (op) != MISP_OPC_GET || !IS_NUM (idx)
+      || (uint64_t)NUM_VAL (idx) > UINT32_MAX)
+    {
+      return false;
+    }
+  *n = NUM_VAL (idx);
+  return true;
+}
+
+// Operands read in place by the fused jumps: numbers and (get n).
+static bool
+is_leaf (misp_t *M, size_t a)
+{
+  cell_t c;
+  uint32_t n;
+  read_cell (M, a, &c);
+  return IS_NUM (c) || is_get_k (M, c, &n);
+}
+
+static uint32_t
+leaf_operand (misp_t *M, size_t a)
+{
+  struct misp_bc *bc = M->bc;
+  cell_t c;
+  uint32_t n;
+  read_cell (M, a, &c);
+  if (IS_NUM (c))
+    {
+      return konst (bc, c) << 1;
+    }
+  is_get_k (M, c, &n);
+  uint32_t i = konst (bc, NUM (n));
+  konst (bc, c);
+  return i << 1 | 1;
+}
+
+// Evaluates the value of the static param at a, which is what cond, loop
+// and eval do with their params.
+static void
+compile_static_eval (misp_t *M, size_t a, int depth, bool tail)
+{
+  struct misp_bc *bc = M->bc;
+  cell_t c, x;
+  read_cell (M, a, &c);
+  if (IS_NUM (c))
+    {
+      emit_push (bc, c);
+      return;
+    }
+
+  size_t xa = LIST_PTR (c) + 1;
+  read_cell (M, xa, &x);
+  if (IS_NUM (x))
+    {
+      emit_push (bc, x);
+    }
+  else if (is_static (M, x))
+    {
+      compile_node (M, x, depth + 1, tail);
+    }
+  else
+    {
+      emit (bc, BC_LOAD);
+      emit (bc, xa);
+      emit_eval (bc, tail);
+    }
+}
+
+static void
+emit_node_op (struct misp_bc *bc, uint32_t insn, size_t k, cell_t node)
+{
+  emit (bc, insn);
+  emit (bc, k);
+  emit (bc, konst (bc, node));
+}
+
+static void
+emit_tree (struct misp_bc *bc, cell_t node)
+{
+  emit (bc, BC_TREE);
+  emit (bc, konst (bc, node));
+}
+
+static void
+emit_panic (struct misp_bc *bc, misp_panic_type_t type, cell_t node)
+{
+  emit (bc, BC_PANIC);
+  emit (bc, type);
+  emit (bc, konst (bc, node));
+}
+
+static size_t
+emit_jump (struct misp_bc *bc, uint32_t insn)
+{
+  emit (bc, insn);
+  return emit (bc, 0);
+}
+
+// Evaluates the static param at a and jumps when it is false, returns the
+// jump to patch. A comparison of two leaves is a single fused jump.
+static size_t
+compile_branch (misp_t *M, size_t a, int depth)
+{
+  struct misp_bc *bc = M->bc;
+  cell_t c, x, op;
+  read_cell (M, a, &c);
+  if (IS_LIST (c))
+    {
+      read_cell (M, LIST_PTR (c) + 1, &x);
+      if (is_static (M, x) && LIST_LEN (x) == 3)
+        {
+          read_cell (M, LIST_PTR (x), &op);
+          size_t p = LIST_PTR (x) + 1;
+          if (IS_NUM (op) && NUM_VAL (op) >= MISP_OPC_NLSR
+              && NUM_VAL (op) <= MISP_OPC_NLSREQ && is_leaf (M, p)
+              && is_leaf (M, p + 1))
+            {
+              uint32_t ea = leaf_operand (M, p);
+              uint32_t eb = leaf_operand (M, p + 1);
+              emit (bc, BC_JNLSR + (NUM_VAL (op) - MISP_OPC_NLSR));
+              emit (bc, ea);
+              emit (bc, eb);
+              emit (bc, konst (bc, x));
+              return emit (bc, 0);
+            }
+        }
+    }
+  compile_static_eval (M, a, depth, false);
+  return emit_jump (bc, BC_JF);
+}
+
+static void
+patch (struct misp_bc *bc, size_t at)
+{
+  bc->code[at] = bc->code_size;
+}
+
+// (set n x) with a number n, and (set n (+ (get n) c)) as a single BC_INCK.
+static bool
+compile_set_k (misp_t *M, cell_t node, int depth)
+{
+  struct misp_bc *bc = M->bc;
+  size_t p = LIST_PTR (node) + 1;
+  cell_t idx, x, op, get, c;
+  uint32_t n;
+  read_cell (M, p, &idx);
+  read_cell (M, p + 1, &x);
+  if (!IS_NUM (idx) || (uint64_t)NUM_VAL (idx) > UINT32_MAX)
+    {
+      return false;
+    }
+
+  if (is_static (M, x) && LIST_LEN (x) == 3)
+    {
+      read_cell (M, LIST_PTR (x), &op);
+      read_cell (M, LIST_PTR (x) + 1, &get);
+      read_cell (M, LIST_PTR (x) + 2, &c);
+      if (IS_NUM (op)
+          && (NUM_VAL (op) == MISP_OPC_NADD || NUM_VAL (op) == MISP_OPC_NSUB)
+          && is_get_k (M, get, &n) && n == NUM_VAL (idx) && IS_NUM (c))
+        {
+          if (NUM_VAL (op) == MISP_OPC_NSUB)
+            {
+              c = NUM (-NUM_VAL (c));
+            }
+          emit (bc, BC_INCK);
+          emit (bc, n);
+          emit (bc, konst (bc, c));
+          emit (bc, konst (bc, x));
+          konst (bc, get);
+          return true;
+        }
+    }
+
+  compile_param (M, p + 1, depth, false);
+  emit (bc, BC_SETK);
+  emit (bc, NUM_VAL (idx));
+  emit (bc, konst (bc, node));
+  return true;
+}
+
+// Emits the code evaluating node and pushing its result. Nodes the tree
+// walker reads garbage for (missing params) are left to the tree walker.
+static void
+compile_node (misp_t *M, cell_t node, int depth, bool tail)
+{
+  struct misp_bc *bc = M->bc;
+  if (depth > MAX_INLINE_DEPTH)
+    {
+      emit_push (bc, node);
+      emit_eval (bc, tail);
+      return;
+    }
+  if (!LIST_LEN (node))
+    {
+      emit_panic (bc, MISP_PANIC_BAD_NODE, node);
+      return;
+    }
+
+  cell_t op;
+  read_cell (M, LIST_PTR (node), &op);
+  if (!IS_NUM (op))
+    {
+      emit_tree (bc, node);
+      return;
+    }
+
+  uint64_t opc = NUM_VAL (op);
+  size_t k = LIST_LEN (node) - 1;
+  size_t p = LIST_PTR (node) + 1;
+  uint32_t insn;
+  size_t min;
+
+  if (opc >= MISP_OPC_NADD && opc <= MISP_OPC_NLSREQ)
+    {
+      if (k < 2)
+        {
+          emit_tree (bc, node);
+          return;
+        }
+      cell_t b;
+      read_cell (M, p + 1, &b);
+      if (k == 2 && IS_NUM (b))
+        {
+          compile_param (M, p, depth, false);
+          emit (bc, BC_NADDK + (opc - MISP_OPC_NADD));
+          emit (bc, konst (bc, b));
+          emit (bc, konst (bc, node));
+          return;
+        }
+      compile_params (M, p, k, depth);
+      emit_node_op (bc, BC_NADD + (opc - MISP_OPC_NADD), k, node);
+      return;
+    }
+
+  switch (opc)
+    {
+    case MISP_OPC_QUOTE:
+      {
+        cell_t c;
+        if (k < 1)
+          {
+            emit_tree (bc, node);
+            return;
+          }
+        read_cell (M, p, &c);
+        if (IS_LIST (c) && !is_static (M, c))
+          {
+            emit (bc, BC_LOAD);
+            emit (bc, p);
+          }
+        else
+          {
+            emit_push (bc, c);
+          }
+      }
+      return;
+    case MISP_OPC_DO:
+      if (k < 1)
+        {
+          emit_tree (bc, node);
+          return;
+        }
+      compile_params (M, p, k - 1, depth);
+      compile_param (M, p + k - 1, depth, tail);
+      if (k > 1)
+        {
+          emit (bc, BC_SLIDE);
+          emit (bc, k - 1);
+        }
+      return;
+    case MISP_OPC_LET:
+      {
+        cell_t body;
+        if (k < 1)
+          {
+            emit_tree (bc, node);
+            return;
+          }
+        read_cell (M, p + k - 1, &body);
+        if (!is_static (M, body))
+          {
+            emit_tree (bc, node);
+            return;
+          }
+        compile_params (M, p, k - 1, depth);
+        emit (bc, tail ? BC_TLET : BC_LET);
+        emit (bc, k - 1);
+        emit (bc, konst (bc, body));
+        compile_node (M, body, depth + 1, tail);
+        if (tail)
+          {
+            /* the frame holds the binds now, whatever follows is skipped */
+            emit (bc, BC_RET);
+          }
+        else
+          {
+            emit (bc, BC_LEAVE);
+            emit (bc, k - 1);
+          }
+      }
+      return;
+    case MISP_OPC_COND:
+      {
+        if (k != 3)
+          {
+            emit_tree (bc, node);
+            return;
+          }
+        if (is_static_param (M, p) && is_static_param (M, p + 1)
+            && is_static_param (M, p + 2))
+          {
+            size_t to_else = compile_branch (M, p, depth);
+            compile_static_eval (M, p + 1, depth, tail);
+            size_t to_end = emit_jump (bc, BC_JMP);
+            patch (bc, to_else);
+            compile_static_eval (M, p + 2, depth, tail);
+            patch (bc, to_end);
+            return;
+          }
+        compile_params (M, p, 3, depth);
+        emit (bc, BC_PICK);
+        emit (bc, 2);
+        emit (bc, BC_EVAL);
+        emit (bc, BC_SELECT);
+        emit_eval (bc, tail);
+        emit (bc, BC_SLIDE);
+        emit (bc, 1);
+      }
+      return;
+    case MISP_OPC_LOOP:
+      {
+        if (k != 2)
+          {
+            emit_tree (bc, node);
+            return;
+          }
+        bool inline_params = is_static_param (M, p)
+                             && is_static_param (M, p + 1);
+        if (!inline_params)
+          {
+            compile_params (M, p, 2, depth);
+          }
+
+        size_t top = bc->code_size;
+        size_t to_end;
+        if (inline_params)
+          {
+            to_end = compile_branch (M, p, depth);
+          }
+        else
+          {
+            emit (bc, BC_PICK);
+            emit (bc, 1);
+            emit (bc, BC_EVAL);
+            to_end = emit_jump (bc, BC_JF);
+          }
+        if (inline_params)
+          {
+            compile_static_eval (M, p + 1, depth, false);
+          }
+        else
+          {
+            emit (bc, BC_PICK);
+            emit (bc, 0);
+            emit (bc, BC_EVAL);
+          }
+        emit (bc, BC_POP);
+        emit (bc, BC_JMP);
+        emit (bc, top);
+        patch (bc, to_end);
+
+        emit_push (bc, LIST (0, 0));
+        if (!inline_params)
+          {
+            emit (bc, BC_SLIDE);
+            emit (bc, 2);
+          }
+      }
+      return;
+    case MISP_OPC_EVAL:
+      if (k != 1)
+        {
+          emit_panic (bc, MISP_PANIC_BAD_NODE_PARAMS, node);
+          return;
+        }
+      if (is_static_param (M, p))
+        {
+          compile_static_eval (M, p, depth, tail);
+          return;
+        }
+      compile_param (M, p, depth, false);
+      emit_eval (bc, tail);
+      return;
+    case MISP_OPC_PMAP:
+    case MISP_OPC_PREDUCE:
+    case MISP_OPC_VADD:
+    case MISP_OPC_VSUB:
+    case MISP_OPC_VMUL:
+    case MISP_OPC_VSUM:
+    case MISP_OPC_VMIN:
+    case MISP_OPC_VMAX:
+    case MISP_OPC_VDOT:
+      emit_tree (bc, node);
+      return;
+    case MISP_OPC_ARENA:
+      if (k != 1)
+        {
+          emit_tree (bc, node);
+          return;
+        }
+      emit (bc, BC_MARK);
+      compile_param (M, p, depth, false);
+      emit (bc, BC_RELEASE);
+      return;
+    case MISP_OPC_ALLOC:
+      insn = BC_ALLOC, min = 1;
+      break;
+    case MISP_OPC_NNOT:
+      insn = BC_NNOT, min = 1;
+      break;
+    case MISP_OPC_EQ:
+      insn = BC_EQ, min = 2;
+      break;
+    case MISP_OPC_EQN:
+      insn = BC_EQN, min = 2;
+      break;
+    case MISP_OPC_GET:
+      {
+        uint32_t n;
+        if (is_get_k (M, node, &n))
+          {
+            emit (bc, BC_GETK);
+            emit (bc, n);
+            emit (bc, konst (bc, node));
+            return;
+          }
+      }
+      insn = BC_GET, min = 1;
+      break;
+    case MISP_OPC_SET:
+      if (k == 2 && compile_set_k (M, node, depth))
+        {
+          return;
+        }
+      insn = BC_SET, min = 2;
+      break;
+    case MISP_OPC_LNEW:
+      insn = BC_LNEW, min = 0;
+      break;
+    case MISP_OPC_LLEN:
+      insn = BC_LLEN, min = 1;
+      break;
+    case MISP_OPC_LGET:
+      insn = BC_LGET, min = 2;
+      break;
+    case MISP_OPC_LSET:
+      insn = BC_LSET, min = 3;
+      break;
+    case MISP_OPC_LSUB:
+      insn = BC_LSUB, min = 3;
+      break;
+    case MISP_OPC_LCOPY:
+      insn = BC_LCOPY, min = 2;
+      break;
+    case MISP_OPC_LFILL:
+      insn = BC_LFILL, min = 2;
+      break;
+    case MISP_OPC_LCAT:
+      insn = BC_LCAT, min = 0;
+      break;
+    case MISP_OPC_DBUG:
+      insn = BC_DBUG, min = 1;
+      break;
+    case MISP_OPC_HNEW:
+    case MISP_OPC_HGET:
+    case MISP_OPC_HSET:
+    case MISP_OPC_HDEL:
+    case MISP_OPC_HLEN:
+      compile_params (M, p, k, depth);
+      emit_node_op (bc, BC_HASH, k, node);
+      emit (bc, opc);
+      return;
+    case MISP_OPC_TNEW:
+    case MISP_OPC_TGET:
+    case MISP_OPC_TSET:
+    case MISP_OPC_TLEN:
+      compile_params (M, p, k, depth);
+      emit_node_op (bc, BC_TYPED, k, node);
+      emit (bc, opc);
+      return;
+    default:
+      {
+        const struct misp_native *n = misp_native_of (M, opc);
+        if (!n)
+          {
+            emit_panic (bc, MISP_PANIC_INVALID_OPC, node);
+          }
+        else if (k != n->arity)
+          {
+            emit_panic (bc, MISP_PANIC_BAD_NODE_PARAMS, node);
+          }
+        else
+          {
+            compile_params (M, p, k, depth);
+            emit_node_op (bc, BC_NATIVE, k, node);
+            emit (bc, opc - MISP_OPC_NATIVE_BASE);
+          }
+      }
+      return;
+    }
+
+  if (k < min)
+    {
+      emit_tree (bc, node);
+      return;
+    }
+  compile_params (M, p, k, depth);
+  emit_node_op (bc, insn, k, node);
+}
+
+static uint64_t
+unit_key (cell_t node)
+{
+  return ((uint64_t)LIST_PTR (node) << LIST_LEN_BITS) | LIST_LEN (node);
+}
+
+static size_t
+unit_slot (struct misp_bc *bc, uint64_t key)
+{
+  size_t mask = bc->units_capacity - 1;
+  size_t i = (key * 0x9E3779B97F4A7C15) >> 32 & mask;
+  while (bc->keys[i] && bc->keys[i] != key)
+    {
+      i = (i + 1) & mask;
+    }
+  return i;
+}
+
+static void
+units_grow (struct misp_bc *bc)
+{
+  uint64_t *keys = bc->keys;
+  uint32_t *entries = bc->entries;
+  size_t capacity = bc->units_capacity;
+
+  bc->units_capacity = capacity ? capacity * 2 : 64;
+  bc->keys = calloc (bc->units_capacity, sizeof (uint64_t));
+  bc->entries = calloc (bc->units_capacity, sizeof (uint32_t));
+  if (!bc->keys || !bc->entries)
+    {
+      abort ();
+    }
+  for (size_t i = 0; i < capacity; i++)
+    {
+      if (keys[i])
+        {
+          size_t slot = unit_slot (bc, keys[i]);
+          bc->keys[slot] = keys[i];
+          bc->entries[slot] = entries[i];
+        }
+    }
+  free (keys);
+  free (entries);
+}
+
+/* Units already running keep their code until they return. They are the
+   callers on rets, the unit doing a tail call is done with its code. Units
+   are laid out in compile order, so the code and consts of every unit
+   starting past the last return pc are taken back. */
+static void
+drop_units (struct misp_bc *bc)
+{
+  if (bc->units_capacity)
+    {
+      memset (bc->keys, 0, bc->units_capacity * sizeof (uint64_t));
+    }
+  bc->units = 0;
+  bc->code_lo = SIZE_MAX;
+  bc->code_hi = 0;
+  bc->stale = false;
+  bc->drops++;
+
+  uint32_t live = 0;
+  for (size_t i = 0; i < bc->rets_size; i++)
+    {
+      if (bc->rets[i] >= live)
+        {
+          live = bc->rets[i] + 1;
+        }
+    }
+  size_t lo = 0, hi = bc->starts_size;
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (bc->starts_code[mid] < live)
+        {
+          lo = mid + 1;
+        }
+      else
+        {
+          hi = mid;
+        }
+    }
+  if (lo < bc->starts_size)
+    {
+      bc->code_size = bc->starts_code[lo];
+      bc->consts_size = bc->starts_consts[lo];
+      bc->starts_size = lo;
+    }
+}
+
+uint32_t
+misp_bc_unit (misp_t *M, cell_t node)
+{
+  struct misp_bc *bc = M->bc;
+  if (bc->stale)
+    {
+      drop_units (bc);
+    }
+  if (2 * (bc->units + 1) > bc->units_capacity)
+    {
+      units_grow (bc);
+    }
+
+  uint64_t key = unit_key (node);
+  size_t slot = unit_slot (bc, key);
+  if (bc->keys[slot])
+    {
+      return bc->entries[slot];
+    }
+
+  size_t capacity = bc->starts_capacity;
+  bc->starts_code = grow (bc->starts_code, &capacity, bc->starts_size,
+                          sizeof (uint32_t));
+  bc->starts_consts = grow (bc->starts_consts, &bc->starts_capacity,
+                            bc->starts_size, sizeof (uint32_t));
+  bc->starts_code[bc->starts_size] = bc->code_size;
+  bc->starts_consts[bc->starts_size] = bc->consts_size;
+  bc->starts_size++;
+
+  uint32_t entry = bc->code_size;
+  compile_node (M, node, 0, true);
+  emit (bc, BC_RET);
+
+  bc->keys[slot] = key;
+  bc->entries[slot] = entry;
+  bc->units++;
+  return entry;
+}
+
+void
+misp_bc_clear (misp_t *M)
+{
+  struct misp_bc *bc = M->bc;
+  if (bc->units_capacity)
+    {
+      memset (bc->keys, 0, bc->units_capacity * sizeof (uint64_t));
+    }
+  bc->units = 0;
+  bc->code_size = 0;
+  bc->consts_size = 0;
+  bc->starts_size = 0;
+  bc->code_lo = SIZE_MAX;
+  bc->code_hi = 0;
+  bc->stale = false;
+  bc->drops = 0;
+}
+
+static void *
+dup (const void *p, size_t size)
+{
+  void *q = malloc (size ? size : 1);
+  if (q && size)
+    {
+      memcpy (q, p, size);
+    }
+  return q;
+}
+
+bool
+misp_bc_copy (misp_t *M, const struct misp_bc *from)
+{
+  struct misp_bc *bc = dup (from, sizeof (struct misp_bc));
+  if (!bc)
+    {
+      return false;
+    }
+  bc->code = dup (from->code, from->code_capacity * sizeof (uint32_t));
+  bc->consts = dup (from->consts, from->consts_capacity * sizeof (cell_t));
+  bc->keys = dup (from->keys, from->units_capacity * sizeof (uint64_t));
+  bc->entries = dup (from->entries, from->units_capacity * sizeof (uint32_t));
+  bc->rets = dup (from->rets, from->rets_capacity * sizeof (uint32_t));
+  bc->starts_code
+      = dup (from->starts_code, from->starts_capacity * sizeof (uint32_t));
+  bc->starts_consts
+      = dup (from->starts_consts, from->starts_capacity * sizeof (uint32_t));
+  M->bc = bc;
+  if (!bc->code || !bc->consts || !bc->keys || !bc->entries || !bc->rets
+      || !bc->starts_code || !bc->starts_consts)
+    {
+      misp_bc_free (M);
+      return false;
+    }
+  return true;
+}
+
+void
+misp_bc_free (misp_t *M)
+{
+  struct misp_bc *bc = M->bc;
+  if (!bc)
+    {
+      return;
+    }
+  free (bc->code);
+  free (bc->consts);
+  free (bc->keys);
+  free (bc->entries);
+  free (bc->rets);
+  free (bc->starts_code);
+  free (bc->starts_consts);
+  free (bc);
+  M->bc = NULL;
+}
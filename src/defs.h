@@ -20,27 +20,88 @@
 #define MISP_DEFS_H
 
 #include "misp.h"
+#include <assert.h>
 
 #define TYPE_NUM 0
 #define TYPE_LIST 1
 
+/* Lists keep a pointer to their first cell and a length in the data of a
+   cell. Wide lists give the pointer 40 bits, for a mem beyond 4G cells, and
+   leave 24 bits to the length (23 with tagged cells): a list is then at
+   most 2^24-1 cells long (2^23-1), longer allocs run out of memory. */
+
+#ifdef MISP_WIDE_LISTS
+#define LIST_PTR_BITS 40
+#else
+#define LIST_PTR_BITS 32
+#endif
+
+#define LIST_MAX_PTR (((uint64_t)1 << LIST_PTR_BITS) - 1)
+
+/* mem stops short of the last few pointers, typed arrays are tagged with
+   empty lists pointing there */
+#define LIST_MAX_MEM (LIST_MAX_PTR - 4)
+
+/* Longer lengths would be cut silently by LIST, callers check them */
+#define LIST_CHECK_LEN(len)                                                   \
+  (assert ((uint64_t)(len) <= LIST_MAX_LEN), (uint64_t)(len))
+
+#ifdef MISP_CELL_TAGGED
+
+/* 8 byte words, type in the low bit. NUMs are 63 bit, LISTs keep the
+   pointer in the high bits and the length above the tag. */
+
+#define CELL(data, type) ((cell_t){ ((uint64_t)(data) << 1) | ((type) & 0x1) })
+#define CELL_TYPE(c) ((c).w & 0x1)
+
+#define IS_LIST(c) (CELL_TYPE (c) == TYPE_LIST)
+#define IS_NUM(c) (CELL_TYPE (c) == TYPE_NUM)
+
+#define LIST_LEN_BITS (63 - LIST_PTR_BITS)
+#define LIST_MAX_LEN (((uint64_t)1 << LIST_LEN_BITS) - 1)
+
+#define LIST(len, p)                                                          \
+  ((cell_t){ ((uint64_t)(p) << (64 - LIST_PTR_BITS))                          \
+             | ((LIST_CHECK_LEN (len) & LIST_MAX_LEN) << 1) | TYPE_LIST })
+
+#define LIST_LEN(c) (uint64_t) (((c).w >> 1) & LIST_MAX_LEN)
+#define LIST_PTR(c) (uint64_t) ((c).w >> (64 - LIST_PTR_BITS))
+
+#define NUM_VAL(c) ((int64_t)(c).w >> 1)
+#define NUM(c) CELL ((uint64_t)(c), TYPE_NUM)
+
+#define CELL_SIZE 8
+
+#else
+
 #define CELL(data, type) ((cell_t){ data, type & 0x1 })
 #define CELL_TYPE(c) ((c).mt & 0x1)
 
 #define IS_LIST(c) (CELL_TYPE (c) == TYPE_LIST)
 #define IS_NUM(c) (CELL_TYPE (c) == TYPE_NUM)
 
-#define LIST(len, p) CELL (((uint64_t)(p) << 32) | (uint64_t)(len), TYPE_LIST)
+#define LIST_LEN_BITS (64 - LIST_PTR_BITS)
+#define LIST_MAX_LEN (((uint64_t)1 << LIST_LEN_BITS) - 1)
+
+#define LIST(len, p)                                                          \
+  CELL (((uint64_t)(p) << LIST_LEN_BITS)                                      \
+            | (LIST_CHECK_LEN (len) & LIST_MAX_LEN),                          \
+        TYPE_LIST)
 
-#define LIST_LEN(c) (uint64_t) ((c).dt & 0xFFFFFFFF)
-#define LIST_PTR(c) (uint64_t) (((c).dt >> 32) & 0xFFFFFFFF)
+#define LIST_LEN(c) (uint64_t) ((c).dt & LIST_MAX_LEN)
+#define LIST_PTR(c) (uint64_t) ((c).dt >> LIST_LEN_BITS)
 
 #define NUM_VAL(c) (int64_t) (c.dt)
 #define NUM(c) CELL ((uint64_t)(c), TYPE_NUM)
 
-#define LIST_NULL LIST (0, 0)
 #define CELL_SIZE 9
 
+#endif
+
+#define IS_TRUE(c) ((IS_NUM (c) && NUM_VAL (c)) || LIST_LEN (c))
+
+#define LIST_NULL LIST (0, 0)
+
 #define CELL_WRITE(b, c)                                                      \
   {                                                                           \
     memcpy (b, &c, CELL_SIZE);                                                \
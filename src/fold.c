@@ -0,0 +1,287 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#include "defs.h"
+#include "misp.h"
+#include "opc.h"
+#include "parser.h"
+#include "vm.h"
+#include <stdint.h>
+
+/* The pass recurses, code nested deeper than this is left as it is */
+#define MAX_FOLD_DEPTH 4096
+
+struct fold
+{
+  uint8_t *mem;
+  size_t cells; /* of code */
+  size_t folded;
+};
+
+static inline void
+get (struct fold *F, size_t i, cell_t *c)
+{
+  CELL_READ (&F->mem[i * CELL_SIZE], c);
+}
+
+static inline void
+put (struct fold *F, size_t i, cell_t c)
+{
+  CELL_WRITE (&F->mem[i * CELL_SIZE], c);
+}
+
+// Whether c is a node of the code with a number for its op.
+static bool
+is_node (struct fold *F, cell_t c, uint64_t *opc)
+{
+  cell_t op;
+  if (!IS_LIST (c) || !LIST_LEN (c) || LIST_PTR (c) + LIST_LEN (c) > F->cells)
+    {
+      return false;
+    }
+  get (F, LIST_PTR (c), &op);
+  *opc = NUM_VAL (op);
+  return IS_NUM (op);
+}
+
+// The value of the param c when it is known without running anything: a
+// number, or what a quote gives.
+static bool
+constant (struct fold *F, cell_t c, cell_t *v)
+{
+  uint64_t opc;
+  if (IS_NUM (c))
+    {
+      *v = c;
+      return true;
+    }
+  if (is_node (F, c, &opc) && opc == MISP_OPC_QUOTE && LIST_LEN (c) >= 2)
+    {
+      get (F, LIST_PTR (c) + 1, v);
+      return true;
+    }
+  return false;
+}
+
+static bool
+constant_num (struct fold *F, size_t a, cell_t *v)
+{
+  cell_t c;
+  get (F, a, &c);
+  return constant (F, c, v) && IS_NUM (*v);
+}
+
+// The nodes the walker steps through to evaluate c, a quote counts as one.
+static size_t
+count_nodes (struct fold *F, cell_t c, int depth)
+{
+  uint64_t opc;
+  size_t n = 1;
+  if (depth > MAX_FOLD_DEPTH || !is_node (F, c, &opc))
+    {
+      return 0;
+    }
+  if (opc == MISP_OPC_QUOTE)
+    {
+      return 1;
+    }
+  for (size_t i = 1; i < LIST_LEN (c); i++)
+    {
+      cell_t p;
+      get (F, LIST_PTR (c) + i, &p);
+      n += count_nodes (F, p, depth + 1);
+    }
+  return n;
+}
+
+// The cell that can stand for node, whose params are folded already.
+static bool
+fold_value (struct fold *F, cell_t node, uint64_t opc, cell_t *v)
+{
+  size_t p = LIST_PTR (node) + 1, k = LIST_LEN (node) - 1;
+  cell_t a, b, c;
+
+  if (opc >= MISP_OPC_NADD && opc <= MISP_OPC_NLSREQ)
+    {
+      if (k != 2 || !constant_num (F, p, &a) || !constant_num (F, p + 1, &b))
+        {
+          return false;
+        }
+      /* a division that traps is left to trap when it runs */
+      if ((opc == MISP_OPC_NDIV || opc == MISP_OPC_NREM
+           || opc == MISP_OPC_NMOD)
+          && (!NUM_VAL (b) || (NUM_VAL (a) == INT64_MIN && NUM_VAL (b) == -1)))
+        {
+          return false;
+        }
+      *v = NUM (misp_numop (opc, NUM_VAL (a), NUM_VAL (b)));
+      return true;
+    }
+
+  switch (opc)
+    {
+    case MISP_OPC_NNOT:
+      if (k != 1 || !constant_num (F, p, &a))
+        {
+          return false;
+        }
+      *v = NUM (~NUM_VAL (a));
+      return true;
+    case MISP_OPC_EQ:
+    case MISP_OPC_EQN:
+      {
+        bool eq;
+        get (F, p, &c);
+        if (k != 2 || !constant (F, c, &a))
+          {
+            return false;
+          }
+        get (F, p + 1, &c);
+        if (!constant (F, c, &b) || CELL_TYPE (a) != CELL_TYPE (b))
+          {
+            return false;
+          }
+        eq = IS_LIST (a) ? LIST_LEN (a) == LIST_LEN (b)
+                               && LIST_PTR (a) == LIST_PTR (b)
+                         : NUM_VAL (a) == NUM_VAL (b);
+        *v = NUM (opc == MISP_OPC_EQ ? eq : !eq);
+        return true;
+      }
+    case MISP_OPC_LLEN:
+      get (F, p, &c);
+      if (k != 1 || !constant (F, c, &a) || !IS_LIST (a))
+        {
+          return false;
+        }
+      *v = NUM (LIST_LEN (a));
+      return true;
+    case MISP_OPC_COND:
+      {
+        cell_t then, other;
+        if (k != 3)
+          {
+            return false;
+          }
+        get (F, p, &c);
+        if (!constant (F, c, &a) || !IS_NUM (a))
+          {
+            return false;
+          }
+        get (F, p + 1, &c);
+        if (!constant (F, c, &then))
+          {
+            return false;
+          }
+        get (F, p + 2, &c);
+        if (!constant (F, c, &other))
+          {
+            return false;
+          }
+        /* the branch is run in place of the cond */
+        *v = IS_TRUE (a) ? then : other;
+        return true;
+      }
+    }
+  return false;
+}
+
+static bool fold (struct fold *F, cell_t *c, bool node_only, int depth);
+
+static void
+fold_at (struct fold *F, size_t a, bool node_only, int depth)
+{
+  cell_t c;
+  get (F, a, &c);
+  if (fold (F, &c, node_only, depth))
+    {
+      put (F, a, c);
+    }
+}
+
+// Folds the code quoted by the param at a, for the ops that run it.
+static void
+fold_quoted (struct fold *F, size_t a, int depth)
+{
+  cell_t c;
+  uint64_t opc;
+  get (F, a, &c);
+  if (is_node (F, c, &opc) && opc == MISP_OPC_QUOTE && LIST_LEN (c) >= 2)
+    {
+      fold_at (F, LIST_PTR (c) + 1, false, depth + 1);
+    }
+}
+
+// Folds the params of the node c and then c itself. A node_only c is run
+// as a node, e.g. the body of a let, so it is only replaced by another one.
+// True when c was replaced.
+static bool
+fold (struct fold *F, cell_t *c, bool node_only, int depth)
+{
+  uint64_t opc;
+  cell_t v;
+  if (depth > MAX_FOLD_DEPTH || !is_node (F, *c, &opc))
+    {
+      return false;
+    }
+  size_t p = LIST_PTR (*c) + 1, k = LIST_LEN (*c) - 1;
+
+  switch (opc)
+    {
+    case MISP_OPC_QUOTE:
+      return false;
+    case MISP_OPC_LET:
+      /* the body is run as it is, not evaluated */
+      for (size_t i = 0; i < k; i++)
+        {
+          fold_at (F, p + i, i == k - 1, depth + 1);
+        }
+      return false;
+    case MISP_OPC_COND:
+    case MISP_OPC_LOOP:
+    case MISP_OPC_EVAL:
+      for (size_t i = 0; i < k; i++)
+        {
+          fold_at (F, p + i, false, depth + 1);
+          fold_quoted (F, p + i, depth);
+        }
+      break;
+    default:
+      for (size_t i = 0; i < k; i++)
+        {
+          fold_at (F, p + i, false, depth + 1);
+        }
+      break;
+    }
+
+  if (!fold_value (F, *c, opc, &v) || (node_only && !IS_LIST (v)))
+    {
+      return false;
+    }
+  /* the code a cond keeps is quoted, so it is not counted */
+  F->folded += count_nodes (F, *c, depth);
+  *c = v;
+  return true;
+}
+
+size_t
+misp_fold (uint8_t *mem, size_t code_size, cell_t *root)
+{
+  struct fold F = { mem, code_size / CELL_SIZE, 0 };
+  fold (&F, root, true, 0);
+  return F.folded;
+}
@@ -0,0 +1,886 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#include "gc.h"
+#include "bytecode.h"
+#include "defs.h"
+#include "misp.h"
+#include "vm.h"
+#include <memory.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Heap objects are laid out back to back from heap.base to heap.top, each
+   one being a header cell followed by its cells. The header holds
+   NUM (len) while the program runs and LIST (len, forward) while a
+   collection is relocating objects. Programs only ever see lists pointing
+   past a header. */
+
+#define BIT_WORD(i) ((i) / 64)
+#define BIT_MASK(i) ((uint64_t)1 << ((i) % 64))
+
+static inline bool
+bit_get (const uint64_t *bits, size_t i)
+{
+  return bits[BIT_WORD (i)] & BIT_MASK (i);
+}
+
+static inline void
+bit_set (uint64_t *bits, size_t i)
+{
+  bits[BIT_WORD (i)] |= BIT_MASK (i);
+}
+
+static inline void
+bit_clear (uint64_t *bits, size_t i)
+{
+  bits[BIT_WORD (i)] &= ~BIT_MASK (i);
+}
+
+static inline size_t
+bitmap_words (const misp_heap_t *H)
+{
+  return BIT_WORD (H->end - H->base) + 1;
+}
+
+static inline void
+heap_read (misp_t *M, size_t i, cell_t *c)
+{
+  CELL_READ (&M->mem[i * CELL_SIZE], c);
+}
+
+static inline void
+heap_write (misp_t *M, size_t i, cell_t c)
+{
+  CELL_WRITE (&M->mem[i * CELL_SIZE], c);
+}
+
+/* Headers are NUM (len), or LIST (len, to) while compacting */
+static inline size_t
+header_len (cell_t h)
+{
+  return IS_LIST (h) ? LIST_LEN (h) : (size_t)NUM_VAL (h);
+}
+
+bool
+misp_heap_init (misp_t *M, size_t base, size_t end)
+{
+  misp_heap_t *H = &M->heap;
+  memset (H, 0, sizeof (*H));
+  H->base = base;
+  H->top = base;
+  H->end = end;
+  H->arena = end;
+  H->threshold = MISP_GC_MIN_THRESHOLD;
+
+  H->starts = calloc (bitmap_words (H), sizeof (uint64_t));
+  H->marks = calloc (bitmap_words (H), sizeof (uint64_t));
+  return H->starts && H->marks;
+}
+
+void
+misp_heap_free (misp_t *M)
+{
+  misp_heap_t *H = &M->heap;
+  free (H->starts);
+  free (H->marks);
+  free (H->gray);
+  free (H->free);
+  H->starts = H->marks = NULL;
+  H->gray = NULL;
+  H->free = NULL;
+}
+
+bool
+misp_heap_copy (misp_t *M, const misp_heap_t *from)
+{
+  misp_heap_t *H = &M->heap;
+  size_t words = bitmap_words (from);
+
+  *H = *from;
+  H->starts = malloc (words * sizeof (uint64_t));
+  H->marks = malloc (words * sizeof (uint64_t));
+  H->gray = malloc ((from->gray_capacity + 1) * sizeof (size_t));
+  H->free = malloc ((from->free_capacity + 1) * sizeof (misp_block_t));
+  if (!H->starts || !H->marks || !H->gray || !H->free)
+    {
+      misp_heap_free (M);
+      return false;
+    }
+
+  memcpy (H->starts, from->starts, words * sizeof (uint64_t));
+  memcpy (H->marks, from->marks, words * sizeof (uint64_t));
+  if (from->gray_size)
+    {
+      memcpy (H->gray, from->gray, from->gray_size * sizeof (size_t));
+    }
+  if (from->free_size)
+    {
+      memcpy (H->free, from->free, from->free_size * sizeof (misp_block_t));
+    }
+  return true;
+}
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+record_pause (misp_heap_t *H, uint64_t ns)
+{
+  int bucket = ns ? 63 - __builtin_clzll (ns) : 0;
+  if (bucket >= MISP_GC_PAUSE_BUCKETS)
+    {
+      bucket = MISP_GC_PAUSE_BUCKETS - 1;
+    }
+  H->pauses[bucket]++;
+  if (ns > H->max_pause)
+    {
+      H->max_pause = ns;
+    }
+}
+
+// Header of the object holding the list pointer p, or 0 when p does not
+// point into (or right past) a live object.
+static size_t
+find_object (misp_t *M, size_t p)
+{
+  misp_heap_t *H = &M->heap;
+  if (p <= H->base || p > H->top)
+    {
+      return 0;
+    }
+
+  size_t i = p - 1 - H->base;
+  size_t w = BIT_WORD (i);
+  uint64_t bits = H->starts[w] & (~(uint64_t)0 >> (63 - i % 64));
+  while (!bits)
+    {
+      if (!w)
+        {
+          return 0;
+        }
+      bits = H->starts[--w];
+    }
+  size_t hdr = H->base + w * 64 + (63 - __builtin_clzll (bits));
+
+  cell_t h;
+  heap_read (M, hdr, &h);
+  if (p > hdr + 1 + header_len (h))
+    {
+      return 0;
+    }
+  return hdr;
+}
+
+static bool
+in_heap (misp_heap_t *H, cell_t c)
+{
+  return IS_LIST (c) && LIST_PTR (c) >= H->base && LIST_PTR (c) <= H->top;
+}
+
+static void
+push_gray (misp_heap_t *H, size_t i)
+{
+  if (H->gray_size == H->gray_capacity)
+    {
+      size_t capacity = H->gray_capacity ? H->gray_capacity * 2 : 256;
+      size_t *gray = realloc (H->gray, capacity * sizeof (size_t));
+      if (!gray)
+        {
+          abort ();
+        }
+      H->gray = gray;
+      H->gray_capacity = capacity;
+    }
+  H->gray[H->gray_size++] = i;
+}
+
+static void
+mark_object (misp_t *M, size_t hdr)
+{
+  misp_heap_t *H = &M->heap;
+  if (bit_get (H->marks, hdr - H->base))
+    {
+      return;
+    }
+  bit_set (H->marks, hdr - H->base);
+  push_gray (H, hdr);
+}
+
+static void
+mark_cell (misp_t *M, cell_t c)
+{
+  if (!in_heap (&M->heap, c) || !LIST_LEN (c))
+    {
+      return;
+    }
+  size_t hdr = find_object (M, LIST_PTR (c));
+  if (hdr)
+    {
+      mark_object (M, hdr);
+    }
+}
+
+static void
+mark_range (misp_t *M, size_t from, size_t to)
+{
+  for (size_t i = from; i < to; i++)
+    {
+      cell_t c;
+      heap_read (M, i, &c);
+      mark_cell (M, c);
+    }
+}
+
+static cell_t
+relocate (misp_t *M, cell_t c)
+{
+  if (!in_heap (&M->heap, c))
+    {
+      return c;
+    }
+
+  size_t hdr = find_object (M, LIST_PTR (c));
+  if (!hdr || !bit_get (M->heap.marks, hdr - M->heap.base))
+    {
+      return LIST_NULL;
+    }
+  cell_t h;
+  heap_read (M, hdr, &h);
+  return LIST (LIST_LEN (c), LIST_PTR (h) + 1 + (LIST_PTR (c) - (hdr + 1)));
+}
+
+static void
+relocate_range (misp_t *M, size_t from, size_t to)
+{
+  for (size_t i = from; i < to; i++)
+    {
+      cell_t c;
+      heap_read (M, i, &c);
+      if (IS_LIST (c))
+        {
+          heap_write (M, i, relocate (M, c));
+        }
+    }
+}
+
+typedef void (*range_fn) (misp_t *M, size_t from, size_t to);
+
+// Visits the live part of each frame on the env chain.
+static void
+visit_frames (misp_t *M, range_fn fn)
+{
+  cell_t env = M->env;
+  while (LIST_LEN (env))
+    {
+      cell_t stack;
+      size_t f = LIST_PTR (env);
+      fn (M, f + 1, f + 3); // node, args
+      fn (M, f + 4, f + 5); // trap
+      heap_read (M, f + 3, &stack);
+      // let binds reusing the frame sit below the stack
+      fn (M, f + FRAME_HEADER, LIST_PTR (stack) + LIST_LEN (stack));
+      heap_read (M, f, &env);
+    }
+}
+
+// Visits every root cell: everything below the heap apart from the frame
+// region, the arena, then the frame chain.
+static void
+visit_roots (misp_t *M, range_fn fn)
+{
+  size_t fa = LIST_PTR (M->frames);
+  size_t fb = fa + LIST_LEN (M->frames);
+
+  fn (M, 0, fa);
+  fn (M, fb, M->heap.base);
+  fn (M, M->heap.arena, M->heap.end);
+  visit_frames (M, fn);
+}
+
+/* A collection visits the live cells and all the root cells. Let the heap
+   grow by as many cells as the larger of the two before collecting again,
+   so that the collection cost stays proportional to the allocation volume
+   however large the root half of mem is. Incremental cycles start earlier,
+   see trigger. */
+static void
+set_threshold (misp_t *M)
+{
+  misp_heap_t *H = &M->heap;
+  size_t roots = LIST_PTR (M->frames) + (H->base - LIST_PTR (M->frames)
+                                         - LIST_LEN (M->frames))
+                 + (H->end - H->arena);
+  H->threshold = H->live + (H->live > roots ? H->live : roots);
+  if (H->threshold < MISP_GC_MIN_THRESHOLD)
+    {
+      H->threshold = MISP_GC_MIN_THRESHOLD;
+    }
+}
+
+// Heap usage from which misp_alloc collects. An incremental cycle starts
+// by half of the room below the arena at the latest, so that its marking is
+// over before the heap runs out and make_room stops the world.
+static size_t
+trigger (misp_heap_t *H)
+{
+  size_t half = (H->arena - H->base) / 2;
+  return H->incremental && half < H->threshold ? half : H->threshold;
+}
+
+static void
+mark (misp_t *M)
+{
+  misp_heap_t *H = &M->heap;
+  memset (H->marks, 0, bitmap_words (H) * sizeof (uint64_t));
+
+  visit_roots (M, mark_range);
+  mark_cell (M, M->panic_code.node);
+
+  while (H->gray_size)
+    {
+      size_t hdr = H->gray[--H->gray_size];
+      cell_t h;
+      heap_read (M, hdr, &h);
+      mark_range (M, hdr + 1, hdr + 1 + header_len (h));
+    }
+}
+
+static size_t
+compute_forwarding (misp_t *M)
+{
+  misp_heap_t *H = &M->heap;
+  size_t to = H->base;
+  for (size_t i = H->base; i < H->top;)
+    {
+      cell_t h;
+      heap_read (M, i, &h);
+      size_t len = header_len (h);
+      if (bit_get (H->marks, i - H->base))
+        {
+          heap_write (M, i, LIST (len, to));
+          to += 1 + len;
+        }
+      i += 1 + len;
+    }
+  return to;
+}
+
+static void
+update_pointers (misp_t *M)
+{
+  misp_heap_t *H = &M->heap;
+  visit_roots (M, relocate_range);
+
+  M->panic_code.node = relocate (M, M->panic_code.node);
+
+  for (size_t i = H->base; i < H->top;)
+    {
+      cell_t h;
+      heap_read (M, i, &h);
+      if (bit_get (H->marks, i - H->base))
+        {
+          relocate_range (M, i + 1, i + 1 + header_len (h));
+        }
+      i += 1 + header_len (h);
+    }
+}
+
+static void
+slide (misp_t *M)
+{
+  misp_heap_t *H = &M->heap;
+  memset (H->starts, 0, bitmap_words (H) * sizeof (uint64_t));
+
+  for (size_t i = H->base; i < H->top;)
+    {
+      cell_t h;
+      heap_read (M, i, &h);
+      size_t len = header_len (h);
+      if (bit_get (H->marks, i - H->base))
+        {
+          size_t to = LIST_PTR (h);
+          memmove (&M->mem[(to + 1) * CELL_SIZE],
+                   &M->mem[(i + 1) * CELL_SIZE], len * CELL_SIZE);
+          heap_write (M, to, NUM (len));
+          bit_set (H->starts, to - H->base);
+        }
+      i += 1 + len;
+    }
+}
+
+void
+misp_gc (misp_t *M)
+{
+  misp_heap_t *H = &M->heap;
+  if (!H->starts)
+    {
+      return;
+    }
+  uint64_t start = now_ns ();
+
+  /* an unfinished incremental cycle is simply dropped, the full mark
+     recomputes everything and the slide reclaims the free blocks */
+  H->phase = MISP_GC_IDLE;
+  H->gray_size = 0;
+  H->scan = H->scan_end = 0;
+  H->free_size = 0;
+  H->free_cells = 0;
+
+  misp_env_flush (M);
+  mark (M);
+  size_t top = compute_forwarding (M);
+  update_pointers (M);
+  slide (M);
+  misp_env_load (M);
+
+  H->top = top;
+  H->live = top - H->base;
+  H->collections++;
+
+  set_threshold (M);
+
+  record_pause (H, now_ns () - start);
+}
+
+/* INCREMENTAL MODE */
+
+void
+misp_gc_incremental (misp_t *M, size_t interval, size_t budget)
+{
+  misp_heap_t *H = &M->heap;
+  if (!interval)
+    {
+      if (H->phase)
+        {
+          misp_gc (M);
+        }
+      H->incremental = false;
+      return;
+    }
+  H->incremental = true;
+  H->interval = interval;
+  H->budget = budget ? budget : 1;
+  H->countdown = interval;
+}
+
+static void
+cycle_begin (misp_t *M)
+{
+  misp_heap_t *H = &M->heap;
+  uint64_t start = now_ns ();
+
+  memset (H->marks, 0, bitmap_words (H) * sizeof (uint64_t));
+  H->phase = MISP_GC_MARK;
+  H->cursor = 0;
+  H->scan = H->scan_end = 0;
+  H->countdown = H->interval;
+
+  /* Frames get popped and arenas released without being overwritten, so
+     they are scanned right away. Every other root is protected by the write
+     barrier and scanned incrementally. */
+  misp_env_flush (M);
+  visit_frames (M, mark_range);
+  mark_range (M, H->arena, H->end);
+  mark_cell (M, M->panic_code.node);
+
+  record_pause (H, now_ns () - start);
+}
+
+static void
+mark_old (misp_t *M, cell_t old)
+{
+  if (M->heap.starts)
+    {
+      mark_cell (M, old);
+    }
+  else if (IS_LIST (old) && LIST_LEN (old))
+    {
+      /* a worker of pmap, the list waits in its mark stack for
+         misp_gc_join */
+      push_gray (&M->heap, LIST_PTR (old));
+    }
+}
+
+void
+misp_gc_barrier (misp_t *M, size_t i)
+{
+  cell_t old;
+  heap_read (M, i, &old);
+  mark_old (M, old);
+}
+
+void
+misp_gc_join (misp_t *M, misp_t *W)
+{
+  misp_heap_t *H = &W->heap;
+  for (size_t j = 0; j < H->gray_size; j++)
+    {
+      mark_old (M, LIST (1, H->gray[j]));
+    }
+  H->gray_size = 0;
+}
+
+static void
+add_free (misp_t *M, size_t start, size_t size)
+{
+  misp_heap_t *H = &M->heap;
+  H->free_cells += size;
+
+  if (H->free_size)
+    {
+      misp_block_t *last = &H->free[H->free_size - 1];
+      if (last->start + last->size == start)
+        {
+          last->size += size;
+          heap_write (M, last->start, NUM (last->size - 1));
+          return;
+        }
+    }
+
+  if (H->free_size == H->free_capacity)
+    {
+      size_t capacity = H->free_capacity ? H->free_capacity * 2 : 64;
+      misp_block_t *free = realloc (H->free, capacity * sizeof (*free));
+      if (!free)
+        {
+          abort ();
+        }
+      H->free = free;
+      H->free_capacity = capacity;
+    }
+  H->free[H->free_size++] = (misp_block_t){ start, size };
+}
+
+static void
+sweep_end (misp_t *M)
+{
+  misp_heap_t *H = &M->heap;
+
+  // give a trailing free block back to the bump allocator
+  if (H->free_size)
+    {
+      misp_block_t *last = &H->free[H->free_size - 1];
+      if (last->start + last->size == H->top)
+        {
+          H->top = last->start;
+          H->free_cells -= last->size;
+          H->free_size--;
+        }
+    }
+
+  H->phase = MISP_GC_IDLE;
+  H->live = H->top - H->base - H->free_cells;
+  H->collections++;
+  set_threshold (M);
+}
+
+void
+misp_gc_step (misp_t *M)
+{
+  misp_heap_t *H = &M->heap;
+  uint64_t start = now_ns ();
+  size_t fa = LIST_PTR (M->frames);
+  size_t fb = fa + LIST_LEN (M->frames);
+
+  if (!H->starts)
+    {
+      return; // a worker of pmap, its VM does the collecting
+    }
+  H->countdown = H->interval;
+  for (size_t work = 0; work < H->budget && H->phase; work++)
+    {
+      if (H->phase == MISP_GC_MARK)
+        {
+          cell_t c;
+          if (H->scan < H->scan_end)
+            {
+              heap_read (M, H->scan++, &c);
+              mark_cell (M, c);
+            }
+          else if (H->gray_size)
+            {
+              size_t hdr = H->gray[--H->gray_size];
+              heap_read (M, hdr, &c);
+              H->scan = hdr + 1;
+              H->scan_end = hdr + 1 + header_len (c);
+            }
+          else if (H->cursor < H->base)
+            {
+              if (H->cursor == fa)
+                {
+                  H->cursor = fb;
+                }
+              heap_read (M, H->cursor++, &c);
+              mark_cell (M, c);
+            }
+          else
+            {
+              H->phase = MISP_GC_SWEEP;
+              H->cursor = H->base;
+              H->free_size = 0;
+              H->free_cells = 0;
+            }
+        }
+      else if (H->cursor < H->top)
+        {
+          cell_t h;
+          size_t hdr = H->cursor;
+          heap_read (M, hdr, &h);
+          H->cursor += 1 + header_len (h);
+
+          if (bit_get (H->marks, hdr - H->base))
+            {
+              bit_clear (H->marks, hdr - H->base);
+            }
+          else
+            {
+              bit_clear (H->starts, hdr - H->base);
+              add_free (M, hdr, 1 + header_len (h));
+            }
+        }
+      else
+        {
+          sweep_end (M);
+        }
+    }
+
+  record_pause (H, now_ns () - start);
+}
+
+/* GROWTH */
+
+// Moves the lists of [from, to[ pointing into the arena up by d cells.
+static void
+shift_arena_range (misp_t *M, size_t from, size_t to, size_t d)
+{
+  misp_heap_t *H = &M->heap;
+  for (size_t i = from; i < to; i++)
+    {
+      cell_t c;
+      heap_read (M, i, &c);
+      if (IS_LIST (c) && LIST_PTR (c) >= H->arena && LIST_PTR (c) <= H->end)
+        {
+          heap_write (M, i, LIST (LIST_LEN (c), LIST_PTR (c) + d));
+          misp_bc_written (M, i);
+        }
+    }
+}
+
+// Doubles the heap, or grows it by need cells if that is more, into the
+// mem mapped after it, up to mem_limit. The arena moves up to the new end,
+// right after a full collection so that everything below the heap top is
+// a cell to look at. with-arena keeps its marks as depths below the end,
+// they stay right.
+static bool
+heap_grow (misp_t *M, size_t need)
+{
+  misp_heap_t *H = &M->heap;
+  size_t limit = M->mem_limit / CELL_SIZE;
+  if (limit > LIST_MAX_MEM)
+    {
+      limit = LIST_MAX_MEM;
+    }
+  size_t size = H->end - H->base;
+  size_t end = H->end + (size > need ? size : need);
+  if (end > limit)
+    {
+      end = limit;
+    }
+  if (end <= H->end || H->top + need > H->arena + (end - H->end))
+    {
+      return false;
+    }
+
+  size_t words = BIT_WORD (end - H->base) + 1, old = bitmap_words (H);
+  uint64_t *starts = realloc (H->starts, words * sizeof (uint64_t));
+  if (!starts)
+    {
+      return false;
+    }
+  H->starts = starts;
+  uint64_t *marks = realloc (H->marks, words * sizeof (uint64_t));
+  if (!marks)
+    {
+      return false;
+    }
+  H->marks = marks;
+  memset (starts + old, 0, (words - old) * sizeof (uint64_t));
+  memset (marks + old, 0, (words - old) * sizeof (uint64_t));
+
+  size_t d = end - H->end;
+  if (H->arena < H->end)
+    {
+      misp_env_flush (M);
+      shift_arena_range (M, 0, H->top, d);
+      shift_arena_range (M, H->arena, H->end, d);
+      cell_t n = M->panic_code.node;
+      if (IS_LIST (n) && LIST_PTR (n) >= H->arena && LIST_PTR (n) <= H->end)
+        {
+          M->panic_code.node = LIST (LIST_LEN (n), LIST_PTR (n) + d);
+        }
+      memmove (&M->mem[(H->arena + d) * CELL_SIZE],
+               &M->mem[H->arena * CELL_SIZE],
+               (H->end - H->arena) * CELL_SIZE);
+      misp_env_load (M);
+    }
+  H->arena += d;
+  H->end = end;
+  M->mem_size = end * CELL_SIZE;
+  H->growths++;
+  return true;
+}
+
+// Collects when need cells do not fit below the arena, then grows the heap
+// if they still do not fit or if it stays more than half full, rather than
+// collecting again soon.
+static void
+make_room (misp_t *M, size_t need)
+{
+  misp_heap_t *H = &M->heap;
+  misp_gc (M);
+  if (H->top + need > H->arena
+      || (H->top + need - H->base) * 2 > H->arena - H->base)
+    {
+      heap_grow (M, need);
+    }
+}
+
+// First fit in the free list, or 0.
+static size_t
+take_free (misp_t *M, size_t need)
+{
+  misp_heap_t *H = &M->heap;
+  for (size_t i = 0; i < H->free_size; i++)
+    {
+      misp_block_t *b = &H->free[i];
+      if (b->size < need)
+        {
+          continue;
+        }
+      size_t hdr = b->start;
+      b->start += need;
+      b->size -= need;
+      H->free_cells -= need;
+      if (b->size)
+        {
+          heap_write (M, b->start, NUM (b->size - 1));
+        }
+      else
+        {
+          memmove (b, b + 1, (H->free_size - i - 1) * sizeof (*b));
+          H->free_size--;
+        }
+      return hdr;
+    }
+  return 0;
+}
+
+bool
+misp_alloc (misp_t *M, size_t len, cell_t *list)
+{
+  misp_heap_t *H = &M->heap;
+  size_t need = 1 + len;
+  size_t used = H->top - H->base - H->free_cells;
+
+  if (!H->starts)
+    {
+      return false; // no heap, like in the workers of pmap
+    }
+  if (len > LIST_MAX_LEN)
+    {
+      return false;
+    }
+
+  if (used + need > trigger (H))
+    {
+      if (!H->incremental)
+        {
+          misp_gc (M);
+        }
+      else if (!H->phase)
+        {
+          /* still more than half full after the last cycle, grow now
+             rather than run out in the middle of the next one */
+          if (2 * H->live > H->arena - H->base)
+            {
+              heap_grow (M, need);
+            }
+          cycle_begin (M);
+        }
+    }
+
+  size_t hdr = take_free (M, need);
+  if (!hdr)
+    {
+      if (H->top + need > H->arena)
+        {
+          make_room (M, need);
+        }
+      if (H->top + need > H->arena)
+        {
+          return false;
+        }
+      hdr = H->top;
+      H->top += need;
+    }
+
+  heap_write (M, hdr, NUM (len));
+  bit_set (H->starts, hdr - H->base);
+  memset (&M->mem[(hdr + 1) * CELL_SIZE], 0, len * CELL_SIZE);
+
+  /* allocate black while the collector could still free the object */
+  if (H->phase == MISP_GC_MARK
+      || (H->phase == MISP_GC_SWEEP && hdr >= H->cursor))
+    {
+      bit_set (H->marks, hdr - H->base);
+    }
+
+  *list = LIST (len, hdr + 1);
+  return true;
+}
+
+bool
+misp_arena_alloc (misp_t *M, size_t len, cell_t *list)
+{
+  misp_heap_t *H = &M->heap;
+  if (!H->starts || len > LIST_MAX_LEN)
+    {
+      return false;
+    }
+  if (H->arena - H->top < len)
+    {
+      make_room (M, len);
+    }
+  if (H->arena - H->top < len)
+    {
+      return false;
+    }
+
+  H->arena -= len;
+  memset (&M->mem[H->arena * CELL_SIZE], 0, len * CELL_SIZE);
+  *list = LIST (len, H->arena);
+  return true;
+}
@@ -0,0 +1,60 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#ifndef MISP_GC_H
+#define MISP_GC_H
+
+#include "misp.h"
+
+/* Minimum heap usage before the first collection is triggered. */
+#define MISP_GC_MIN_THRESHOLD 4096
+
+#define MISP_GC_DEFAULT_INTERVAL 64
+#define MISP_GC_DEFAULT_BUDGET 1024
+
+bool misp_heap_init (misp_t *M, size_t base, size_t end);
+
+void misp_heap_free (misp_t *M);
+
+// Makes the heap of M a copy of from, with its own bitmaps and stacks.
+bool misp_heap_copy (misp_t *M, const misp_heap_t *from);
+
+// Allocates a zeroed list of len cells in the heap, collecting first if the
+// heap usage crossed its threshold. Any list held outside of mem (locals in
+// misp_execute) is stale afterwards and must be reloaded from the env.
+bool misp_alloc (misp_t *M, size_t len, cell_t *list);
+
+// Takes a zeroed list of len cells from the arena, which grows down from
+// the end of the heap and is a root of the collector. Cells are only given
+// back by moving heap.arena up again, as with-arena does. Collects first
+// when the arena would run into the heap, then grows the heap if mem_limit
+// allows it, which moves the arena up to the new end.
+bool misp_arena_alloc (misp_t *M, size_t len, cell_t *list);
+
+// Does one slice of incremental collection work.
+void misp_gc_step (misp_t *M);
+
+// Snapshot-at-the-beginning write barrier, called while marking before the
+// cell i is overwritten.
+void misp_gc_barrier (misp_t *M, size_t i);
+
+// Marks the lists kept by the barrier of W, a worker of pmap with no heap,
+// while M was marking.
+void misp_gc_join (misp_t *M, misp_t *W);
+
+#endif
@@ -0,0 +1,476 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#include "bytecode.h"
+#include "defs.h"
+#include "gc.h"
+#include "misp.h"
+#include "opc.h"
+#include "vm.h"
+
+/* Hash maps from numbers to cells, each op in a single step:
+
+     (hnew)               a new empty map
+     (hget map key [def]) the value bound to key, or def, or () without it
+     (hset map key value) binds key to value and returns value
+     (hdel map key)       unbinds key, returns 1 if it was bound and 0 if not
+     (hlen map)           the number of keys bound
+
+   Keys are numbers: lists are equal by identity and move with the
+   collector, so they could not be hashed. A map is a list of four cells in
+   the heap: the number of keys, the table, the table being migrated out of
+   while the map grows, and how far that migration went. A table is a list
+   too:
+
+     cap, used, cap / 8 control cells, cap keys, cap values
+
+   A control cell holds the control bytes of a group of 8 slots as a
+   number: CTRL_EMPTY, CTRL_DELETED, or CTRL_FULL and 6 bits of the hash of
+   the key. A probe reads a group at once and finds the bytes matching the
+   hash with a few word ops, only the keys of those slots are compared.
+   Groups are probed in triangular order, which visits each of them once
+   as their count is a power of two.
+
+   Tables are at most 7/8 used. Past that the map switches to a table of
+   twice the size, or of the same size when deleted slots make most of the
+   use, and each hset or hdel then migrates a few slots of the old table.
+   No single op pays for the whole rehash; until it is done, lookups try
+   the new table, then the old one. A key is always in one of them only. */
+
+#define MAP_COUNT 0
+#define MAP_TABLE 1
+#define MAP_OLD 2
+#define MAP_CURSOR 3
+#define MAP_SIZE 4
+
+#define TABLE_CAP 0
+#define TABLE_USED 1
+#define TABLE_CTRL 2
+
+#define GROUP 8
+#define MIN_CAP 8
+#define MIGRATE_SLOTS 16
+
+#define CTRL_EMPTY 0x00
+#define CTRL_DELETED 0x01
+#define CTRL_FULL 0x40
+
+/* Control bytes stay below 0x80, so a group fits in a number of either
+   cell encoding. The mask drops the sign extension of tagged cells. */
+#define CTRL_MASK 0x7F7F7F7F7F7F7F7FULL
+#define LSB 0x0101010101010101ULL
+#define MSB 0x8080808080808080ULL
+
+#define NONE SIZE_MAX
+
+struct table
+{
+  size_t t;    /* cell of the table */
+  size_t cap;  /* slots */
+  size_t keys; /* cell of the first key, the values follow them */
+};
+
+static inline cell_t
+at (misp_t *M, size_t i)
+{
+  cell_t c;
+  CELL_READ (&M->mem[i * CELL_SIZE], &c);
+  return c;
+}
+
+// Writes c to the cell i, which may hold a list.
+static inline void
+put (misp_t *M, size_t i, cell_t c)
+{
+  if (M->heap.phase == MISP_GC_MARK)
+    {
+      misp_gc_barrier (M, i);
+    }
+  CELL_WRITE (&M->mem[i * CELL_SIZE], c);
+  misp_bc_written (M, i);
+}
+
+// Writes the number n to the cell i, which holds a number.
+static inline void
+put_num (misp_t *M, size_t i, int64_t n)
+{
+  cell_t c = NUM (n);
+  CELL_WRITE (&M->mem[i * CELL_SIZE], c);
+}
+
+static inline uint64_t
+hash_num (int64_t n)
+{
+  uint64_t h = n;
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+  return h ^ (h >> 31);
+}
+
+static inline uint8_t
+hash_tag (uint64_t h)
+{
+  return CTRL_FULL | h >> 58;
+}
+
+// The high bit of each byte of group equal to b. A byte above a match may
+// be set as well: only the lowest one is sure, the others are checked.
+static inline uint64_t
+match_byte (uint64_t group, uint8_t b)
+{
+  uint64_t x = group ^ (LSB * b);
+  return (x - LSB) & ~x & MSB;
+}
+
+static inline size_t
+table_len (size_t cap)
+{
+  return TABLE_CTRL + cap / GROUP + 2 * cap;
+}
+
+// Reads the table c, false when it is not one, as after a setl on the map.
+static bool
+table_of (misp_t *M, cell_t c, struct table *T)
+{
+  if (!IS_LIST (c) || LIST_LEN (c) < TABLE_CTRL)
+    {
+      return false;
+    }
+  cell_t cap = at (M, LIST_PTR (c) + TABLE_CAP);
+  if (!IS_NUM (cap) || NUM_VAL (cap) < MIN_CAP
+      || NUM_VAL (cap) & (NUM_VAL (cap) - 1)
+      || LIST_LEN (c) != table_len (NUM_VAL (cap)))
+    {
+      return false;
+    }
+  T->t = LIST_PTR (c);
+  T->cap = NUM_VAL (cap);
+  T->keys = T->t + TABLE_CTRL + T->cap / GROUP;
+  return true;
+}
+
+static inline uint64_t
+group_at (misp_t *M, const struct table *T, size_t g)
+{
+  return (uint64_t)NUM_VAL (at (M, T->t + TABLE_CTRL + g)) & CTRL_MASK;
+}
+
+static inline uint8_t
+ctrl_at (misp_t *M, const struct table *T, size_t s)
+{
+  return group_at (M, T, s / GROUP) >> (s % GROUP * 8);
+}
+
+static void
+set_ctrl (misp_t *M, const struct table *T, size_t s, uint8_t b)
+{
+  size_t shift = s % GROUP * 8;
+  uint64_t g = group_at (M, T, s / GROUP);
+  g = (g & ~((uint64_t)0xFF << shift)) | (uint64_t)b << shift;
+  put_num (M, T->t + TABLE_CTRL + s / GROUP, g);
+}
+
+// Slot of key in T, or NONE.
+static size_t
+find (misp_t *M, const struct table *T, int64_t key, uint64_t h)
+{
+  size_t groups = T->cap / GROUP, g = h & (groups - 1);
+  uint8_t tag = hash_tag (h);
+  for (size_t i = 0; i < groups; g = (g + ++i) & (groups - 1))
+    {
+      uint64_t group = group_at (M, T, g);
+      for (uint64_t m = match_byte (group, tag); m; m &= m - 1)
+        {
+          size_t b = __builtin_ctzll (m) / 8, s = g * GROUP + b;
+          cell_t k = at (M, T->keys + s);
+          if ((uint8_t)(group >> b * 8) == tag && NUM_VAL (k) == key)
+            {
+              return s;
+            }
+        }
+      if (match_byte (group, CTRL_EMPTY))
+        {
+          return NONE;
+        }
+    }
+  return NONE;
+}
+
+// First empty or deleted slot on the probe sequence of h, or NONE.
+static size_t
+free_slot (misp_t *M, const struct table *T, uint64_t h)
+{
+  size_t groups = T->cap / GROUP, g = h & (groups - 1);
+  for (size_t i = 0; i < groups; g = (g + ++i) & (groups - 1))
+    {
+      uint64_t group = group_at (M, T, g);
+      uint64_t m = match_byte (group, CTRL_EMPTY)
+                   | match_byte (group, CTRL_DELETED);
+      if (m)
+        {
+          return g * GROUP + __builtin_ctzll (m) / 8;
+        }
+    }
+  return NONE;
+}
+
+// Binds key to value in T, where key is not. False when T is full.
+static bool
+insert (misp_t *M, const struct table *T, cell_t key, cell_t value,
+        uint64_t h)
+{
+  size_t s = free_slot (M, T, h);
+  if (s == NONE)
+    {
+      return false;
+    }
+  if (ctrl_at (M, T, s) == CTRL_EMPTY)
+    {
+      put_num (M, T->t + TABLE_USED, NUM_VAL (at (M, T->t + TABLE_USED)) + 1);
+    }
+  set_ctrl (M, T, s, hash_tag (h));
+  put_num (M, T->keys + s, NUM_VAL (key));
+  put (M, T->keys + T->cap + s, value);
+  return true;
+}
+
+static void
+erase (misp_t *M, const struct table *T, size_t s)
+{
+  set_ctrl (M, T, s, CTRL_DELETED);
+  put (M, T->keys + T->cap + s, NUM (0));
+}
+
+// Moves up to n slots of the old table of the map at m to its table.
+static bool
+migrate (misp_t *M, size_t m, size_t n)
+{
+  struct table T, O;
+  cell_t old = at (M, m + MAP_OLD);
+  if (!LIST_LEN (old))
+    {
+      return true;
+    }
+  if (!table_of (M, at (M, m + MAP_TABLE), &T) || !table_of (M, old, &O))
+    {
+      return false;
+    }
+
+  size_t s = NUM_VAL (at (M, m + MAP_CURSOR));
+  size_t end = s < O.cap && O.cap - s > n ? s + n : O.cap;
+  for (; s < end; s++)
+    {
+      if (ctrl_at (M, &O, s) & CTRL_FULL)
+        {
+          cell_t key = at (M, O.keys + s);
+          if (!insert (M, &T, key, at (M, O.keys + O.cap + s),
+                       hash_num (NUM_VAL (key))))
+            {
+              return false;
+            }
+        }
+    }
+  if (end == O.cap)
+    {
+      put (M, m + MAP_OLD, LIST_NULL);
+      end = 0;
+    }
+  put_num (M, m + MAP_CURSOR, end);
+  return true;
+}
+
+// Switches the map in the cell map to a new table, once the old one is
+// migrated. Reads the map again, it may have moved.
+static misp_panic_type_t
+grow (misp_t *M, size_t map)
+{
+  struct table T;
+  size_t m = LIST_PTR (at (M, map)), cap = MIN_CAP;
+  if (!migrate (M, m, SIZE_MAX))
+    {
+      return MISP_PANIC_TYPE_ERROR;
+    }
+  cell_t table = at (M, m + MAP_TABLE);
+  if (LIST_LEN (table))
+    {
+      if (!table_of (M, table, &T))
+        {
+          return MISP_PANIC_TYPE_ERROR;
+        }
+      size_t count = NUM_VAL (at (M, m + MAP_COUNT)) + 1;
+      cap = count * 2 >= T.cap ? T.cap * 2 : T.cap;
+    }
+
+  cell_t fresh;
+  if (table_len (cap) > LIST_MAX_LEN
+      || !misp_alloc (M, table_len (cap), &fresh))
+    {
+      return MISP_PANIC_OUT_OF_MEMORY;
+    }
+  m = LIST_PTR (at (M, map));
+  put_num (M, LIST_PTR (fresh) + TABLE_CAP, cap);
+  put (M, m + MAP_OLD, at (M, m + MAP_TABLE));
+  put (M, m + MAP_TABLE, fresh);
+  put_num (M, m + MAP_CURSOR, 0);
+  return MISP_PANIC_NO;
+}
+
+// Finds key in the table, then in the old table of the map at m. Leaves
+// the table it is in in T, and returns its slot or NONE.
+static size_t
+lookup (misp_t *M, size_t m, int64_t key, uint64_t h, struct table *T)
+{
+  cell_t tables[2] = { at (M, m + MAP_TABLE), at (M, m + MAP_OLD) };
+  for (int i = 0; i < 2; i++)
+    {
+      if (table_of (M, tables[i], T))
+        {
+          size_t s = find (M, T, key, h);
+          if (s != NONE)
+            {
+              return s;
+            }
+        }
+    }
+  return NONE;
+}
+
+static misp_panic_type_t
+hset (misp_t *M, size_t args, cell_t *ret)
+{
+  cell_t key = at (M, args + 1);
+  uint64_t h = hash_num (NUM_VAL (key));
+  size_t m = LIST_PTR (at (M, args));
+  struct table T;
+  if (!migrate (M, m, MIGRATE_SLOTS))
+    {
+      return MISP_PANIC_TYPE_ERROR;
+    }
+
+  *ret = at (M, args + 2);
+  size_t s = lookup (M, m, NUM_VAL (key), h, &T);
+  if (s != NONE && T.t == LIST_PTR (at (M, m + MAP_TABLE)))
+    {
+      put (M, T.keys + T.cap + s, *ret);
+      return MISP_PANIC_NO;
+    }
+  bool bound = s != NONE;
+  if (bound)
+    {
+      erase (M, &T, s); // from the old table, it goes to the new one
+    }
+
+  if (!table_of (M, at (M, m + MAP_TABLE), &T)
+      || (size_t)(NUM_VAL (at (M, T.t + TABLE_USED)) + 1) * 8 > T.cap * 7)
+    {
+      misp_panic_type_t type = grow (M, args);
+      if (type)
+        {
+          return type;
+        }
+      m = LIST_PTR (at (M, args));
+      *ret = at (M, args + 2);
+      table_of (M, at (M, m + MAP_TABLE), &T);
+    }
+  if (!insert (M, &T, key, *ret, h))
+    {
+      return MISP_PANIC_TYPE_ERROR;
+    }
+  if (!bound)
+    {
+      put_num (M, m + MAP_COUNT, NUM_VAL (at (M, m + MAP_COUNT)) + 1);
+    }
+  return MISP_PANIC_NO;
+}
+
+misp_panic_type_t
+misp_hash_op (misp_t *M, uint64_t opc, size_t args, size_t k, cell_t *ret)
+{
+  static const size_t params[] = {
+    [MISP_OPC_HNEW - MISP_OPC_HNEW] = 0, [MISP_OPC_HGET - MISP_OPC_HNEW] = 2,
+    [MISP_OPC_HSET - MISP_OPC_HNEW] = 3, [MISP_OPC_HDEL - MISP_OPC_HNEW] = 2,
+    [MISP_OPC_HLEN - MISP_OPC_HNEW] = 1,
+  };
+  if (k < params[opc - MISP_OPC_HNEW])
+    {
+      return MISP_PANIC_BAD_NODE_PARAMS;
+    }
+  if (opc == MISP_OPC_HNEW)
+    {
+      if (!misp_alloc (M, MAP_SIZE, ret))
+        {
+          return MISP_PANIC_OUT_OF_MEMORY;
+        }
+      put (M, LIST_PTR (*ret) + MAP_TABLE, LIST_NULL);
+      put (M, LIST_PTR (*ret) + MAP_OLD, LIST_NULL);
+      return MISP_PANIC_NO;
+    }
+
+  cell_t map = at (M, args), key = at (M, args + 1);
+  if (!IS_LIST (map) || LIST_LEN (map) != MAP_SIZE
+      || !IS_NUM (at (M, LIST_PTR (map) + MAP_COUNT))
+      || (opc != MISP_OPC_HLEN && !IS_NUM (key)))
+    {
+      return MISP_PANIC_TYPE_ERROR;
+    }
+  size_t m = LIST_PTR (map), s;
+  struct table T;
+  switch (opc)
+    {
+    case MISP_OPC_HGET:
+      s = lookup (M, m, NUM_VAL (key), hash_num (NUM_VAL (key)), &T);
+      *ret = s != NONE ? at (M, T.keys + T.cap + s)
+             : k > 2   ? at (M, args + 2)
+                       : LIST_NULL;
+      return MISP_PANIC_NO;
+    case MISP_OPC_HSET:
+      return hset (M, args, ret);
+    case MISP_OPC_HDEL:
+      if (!migrate (M, m, MIGRATE_SLOTS))
+        {
+          return MISP_PANIC_TYPE_ERROR;
+        }
+      s = lookup (M, m, NUM_VAL (key), hash_num (NUM_VAL (key)), &T);
+      if (s != NONE)
+        {
+          erase (M, &T, s);
+          put_num (M, m + MAP_COUNT, NUM_VAL (at (M, m + MAP_COUNT)) - 1);
+        }
+      *ret = NUM (s != NONE);
+      return MISP_PANIC_NO;
+    default:
+      *ret = at (M, m + MAP_COUNT);
+      return MISP_PANIC_NO;
+    }
+}
+
+void
+misp_hash_step (misp_t *M, cell_t node, uint64_t opc)
+{
+  cell_t stack, ret;
+  misp_env_stack (M, &stack);
+  misp_panic_type_t type
+      = misp_hash_op (M, opc, LIST_PTR (stack), LIST_LEN (stack), &ret);
+  if (type)
+    {
+      M->halted = true;
+      M->panic_code = (misp_panic_t){ type, node };
+      return;
+    }
+  misp_env_ret (M, ret);
+}
@@ -0,0 +1,126 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#include "image.h"
+#include "defs.h"
+#include "misp.h"
+#include "vm.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool
+misp_image_is (const void *s, size_t len)
+{
+  return len >= sizeof (misp_image_header_t)
+         && !memcmp (s, MISP_IMAGE_MAGIC, sizeof (MISP_IMAGE_MAGIC));
+}
+
+misp_image_error_t
+misp_image_write (const char *path, const uint8_t *mem, size_t code_size,
+                  cell_t init)
+{
+  uint8_t page[MISP_IMAGE_HEADER_SIZE] = { 0 };
+  misp_image_header_t h = { 0 };
+  memcpy (h.magic, MISP_IMAGE_MAGIC, sizeof (MISP_IMAGE_MAGIC));
+  h.version = MISP_IMAGE_VERSION;
+  h.cell_size = CELL_SIZE;
+  h.list_ptr_bits = LIST_PTR_BITS;
+  h.code_size = code_size;
+  CELL_WRITE (h.init, init);
+  memcpy (page, &h, sizeof (h));
+
+  FILE *f = fopen (path, "wb");
+  if (!f)
+    {
+      return MISP_IMAGE_IO;
+    }
+  bool ok = fwrite (page, sizeof (page), 1, f) == 1
+            && (!code_size || fwrite (mem, code_size, 1, f) == 1);
+  if (fclose (f))
+    {
+      ok = false;
+    }
+  return ok ? MISP_IMAGE_OK : MISP_IMAGE_IO;
+}
+
+misp_image_error_t
+misp_image_load (int fd, size_t memory, int flags, uint8_t **mem,
+                 size_t *mem_size, size_t *mem_limit, size_t *code_size,
+                 cell_t *init)
+{
+  misp_image_header_t h;
+  struct stat st;
+  if (pread (fd, &h, sizeof (h), 0) != sizeof (h) || fstat (fd, &st))
+    {
+      return MISP_IMAGE_IO;
+    }
+  if (!misp_image_is (&h, sizeof (h)))
+    {
+      return MISP_IMAGE_NOT_AN_IMAGE;
+    }
+  if (h.version != MISP_IMAGE_VERSION || h.cell_size != CELL_SIZE
+      || h.list_ptr_bits != LIST_PTR_BITS)
+    {
+      return MISP_IMAGE_BAD_VERSION;
+    }
+  if ((uint64_t)st.st_size < MISP_IMAGE_HEADER_SIZE + h.code_size)
+    {
+      return MISP_IMAGE_IO;
+    }
+
+  size_t page = sysconf (_SC_PAGESIZE);
+  size_t code = (h.code_size + page - 1) / page * page;
+  *mem_size = h.code_size + memory * CELL_SIZE;
+  *mem_size = (*mem_size + MISP_CACHE_LINE - 1) / MISP_CACHE_LINE
+              * MISP_CACHE_LINE;
+  if (*mem_limit < *mem_size)
+    {
+      *mem_limit = *mem_size;
+    }
+  if (*mem_limit < code)
+    {
+      *mem_limit = code;
+    }
+  *mem = misp_mem_map (*mem_limit, flags);
+  if (!*mem)
+    {
+      return MISP_IMAGE_OUT_OF_MEMORY;
+    }
+
+  /* The code is mapped over the start of mem: pages are read on the first
+     touch and copied on the first write. The tail of the last page is past
+     the end of the file, so it reads as zeros like the rest of mem. */
+  if (h.code_size
+      && (MISP_IMAGE_HEADER_SIZE % page
+          || mmap (*mem, h.code_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_FIXED, fd, MISP_IMAGE_HEADER_SIZE)
+                 == MAP_FAILED)
+      && pread (fd, *mem, h.code_size, MISP_IMAGE_HEADER_SIZE)
+             != (ssize_t)h.code_size)
+    {
+      misp_mem_unmap (*mem, *mem_limit);
+      return MISP_IMAGE_IO;
+    }
+
+  *code_size = h.code_size;
+  CELL_READ (h.init, init);
+  return MISP_IMAGE_OK;
+}
@@ -0,0 +1,66 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#ifndef MISP_IMAGE_H
+#define MISP_IMAGE_H
+
+#include "misp.h"
+
+/* An image is a header page followed by the cells of the parsed code, as
+   they are at the start of mem. It is only loaded by the build that wrote
+   it: the version and the cell encoding have to match. */
+
+#define MISP_IMAGE_MAGIC "MISPIMG"
+#define MISP_IMAGE_VERSION 2
+#define MISP_IMAGE_HEADER_SIZE 4096
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t cell_size;
+  uint64_t code_size; /* bytes of cells following the header */
+  uint8_t init[16];   /* the root cell, CELL_SIZE bytes */
+  uint32_t list_ptr_bits;
+} misp_image_header_t;
+
+typedef enum
+{
+  MISP_IMAGE_OK = 0,
+  MISP_IMAGE_IO,
+  MISP_IMAGE_NOT_AN_IMAGE,
+  MISP_IMAGE_BAD_VERSION,
+  MISP_IMAGE_OUT_OF_MEMORY,
+} misp_image_error_t;
+
+// Whether the len bytes at s start like an image.
+bool misp_image_is (const void *s, size_t len);
+
+misp_image_error_t misp_image_write (const char *path, const uint8_t *mem,
+                                     size_t code_size, cell_t init);
+
+// Maps the image open as fd copy-on-write at the start of a new mem, with
+// memory zeroed cells after the code. mem_limit is raised to the bytes
+// mapped for mem if it asked for less, mem is released with
+// misp_mem_unmap (mem, mem_limit). flags are the ones of misp_mem_map.
+misp_image_error_t misp_image_load (int fd, size_t memory, int flags,
+                                    uint8_t **mem, size_t *mem_size,
+                                    size_t *mem_limit, size_t *code_size,
+                                    cell_t *init);
+
+#endif
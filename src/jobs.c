@@ -0,0 +1,205 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#include "misp.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/* A Chase-Lev deque of job indices. Only its worker pushes, at the bottom;
+   everybody takes from the top, the worker included, so that the jobs of a
+   worker are run round robin. A deque never holds more than every job, so
+   it does not need to grow. */
+struct deque
+{
+  _Alignas (64) atomic_size_t top;
+  _Alignas (64) atomic_size_t bottom;
+  size_t mask;
+  atomic_size_t *items;
+};
+
+#define NO_JOB SIZE_MAX
+
+struct runner
+{
+  misp_job_t *jobs;
+  struct deque *deques;
+  size_t threads;
+  uint64_t slice;
+  atomic_size_t remaining; /* jobs not halted yet */
+};
+
+struct worker
+{
+  struct runner *R;
+  size_t id;
+};
+
+static void
+deque_push (struct deque *d, size_t job)
+{
+  size_t b = atomic_load_explicit (&d->bottom, memory_order_relaxed);
+  atomic_store_explicit (&d->items[b & d->mask], job, memory_order_relaxed);
+  atomic_store_explicit (&d->bottom, b + 1, memory_order_release);
+}
+
+static size_t
+deque_steal (struct deque *d)
+{
+  size_t t = atomic_load_explicit (&d->top, memory_order_acquire);
+  atomic_thread_fence (memory_order_seq_cst);
+  size_t b = atomic_load_explicit (&d->bottom, memory_order_acquire);
+  if (t >= b)
+    {
+      return NO_JOB;
+    }
+  size_t job
+      = atomic_load_explicit (&d->items[t & d->mask], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit (
+          &d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+    {
+      return NO_JOB; // lost the race, the caller looks again
+    }
+  return job;
+}
+
+static size_t
+find_job (struct runner *R, size_t id)
+{
+  size_t job = deque_steal (&R->deques[id]);
+  for (size_t i = 1; job == NO_JOB && i < R->threads; i++)
+    {
+      job = deque_steal (&R->deques[(id + i) % R->threads]);
+    }
+  return job;
+}
+
+static void *
+work (void *arg)
+{
+  struct worker *W = arg;
+  struct runner *R = W->R;
+
+  while (atomic_load_explicit (&R->remaining, memory_order_acquire))
+    {
+      size_t job = find_job (R, W->id);
+      if (job == NO_JOB)
+        {
+          sched_yield ();
+          continue;
+        }
+
+      misp_job_t *J = &R->jobs[job];
+      J->steps += misp_run (J->vm, R->slice);
+      J->slices++;
+      if (J->vm->halted)
+        {
+          atomic_fetch_sub_explicit (&R->remaining, 1, memory_order_release);
+        }
+      else
+        {
+          deque_push (&R->deques[W->id], job);
+        }
+    }
+  return NULL;
+}
+
+static void
+run_alone (misp_job_t *jobs, size_t count, uint64_t slice)
+{
+  for (size_t i = 0; i < count; i++)
+    {
+      while (!jobs[i].vm->halted)
+        {
+          jobs[i].steps += misp_run (jobs[i].vm, slice);
+          jobs[i].slices++;
+        }
+    }
+}
+
+void
+misp_jobs_run (misp_job_t *jobs, size_t count, size_t threads,
+               uint64_t slice)
+{
+  struct runner R = { jobs, NULL, threads, slice ? slice : 1, count };
+  size_t capacity = 1;
+  while (capacity < count)
+    {
+      capacity *= 2;
+    }
+  if (threads > count)
+    {
+      R.threads = threads = count;
+    }
+
+  struct deque *deques = threads > 1 ? aligned_alloc (
+                             64, threads * sizeof (struct deque))
+                                     : NULL;
+  atomic_size_t *items
+      = deques ? malloc (threads * capacity * sizeof (atomic_size_t)) : NULL;
+  pthread_t *tids = items ? malloc (threads * sizeof (pthread_t)) : NULL;
+  struct worker *workers
+      = tids ? malloc (threads * sizeof (struct worker)) : NULL;
+  if (!workers)
+    {
+      /* nothing to share, or no memory to share it with */
+      free (deques);
+      free (items);
+      free (tids);
+      run_alone (jobs, count, R.slice);
+      return;
+    }
+
+  R.deques = deques;
+  for (size_t i = 0; i < threads; i++)
+    {
+      atomic_init (&deques[i].top, 0);
+      atomic_init (&deques[i].bottom, 0);
+      deques[i].mask = capacity - 1;
+      deques[i].items = &items[i * capacity];
+      workers[i] = (struct worker){ &R, i };
+    }
+  for (size_t i = 0; i < count; i++)
+    {
+      if (jobs[i].vm->halted)
+        {
+          atomic_fetch_sub (&R.remaining, 1);
+          continue;
+        }
+      deque_push (&deques[i % threads], i);
+    }
+
+  /* the calling thread is worker 0, the others only speed things up */
+  size_t started = 1;
+  while (started < threads
+         && !pthread_create (&tids[started], NULL, work, &workers[started]))
+    {
+      started++;
+    }
+  work (&workers[0]);
+  for (size_t i = 1; i < started; i++)
+    {
+      pthread_join (tids[i], NULL);
+    }
+
+  free (workers);
+  free (tids);
+  free (items);
+  free (deques);
+}
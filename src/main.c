@@ -0,0 +1,553 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#include "misp.h"
+#include "bytecode.h"
+#include "defs.h"
+#include "gc.h"
+#include "image.h"
+#include "parser.h"
+#include "profile.h"
+#include "trace.h"
+#include "vm.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Cells the heap may grow to by default, see -M. Only the pages used are
+   backed. */
+#define MISP_DEFAULT_MAX_MEMORY ((size_t)1 << 28)
+
+static void
+print_gc_stats (misp_t *M)
+{
+  misp_heap_t *H = &M->heap;
+  fprintf (stderr, "GC: %zu collections, %zu live cells, max pause %lu ns\n",
+           H->collections, H->live, H->max_pause);
+  if (H->growths)
+    {
+      fprintf (stderr, "  heap grew %zu times, to %zu cells\n", H->growths,
+               H->end - H->base);
+    }
+  for (int i = 0; i < MISP_GC_PAUSE_BUCKETS; i++)
+    {
+      if (H->pauses[i])
+        {
+          fprintf (stderr, "  [%lu, %lu[ ns: %lu\n", (uint64_t)1 << i,
+                   (uint64_t)2 << i, H->pauses[i]);
+        }
+    }
+}
+
+// Writes the folded stacks of P to path and the hot spots to stderr.
+static void
+write_profile (const misp_profile_t *P, const char *path)
+{
+  FILE *f = fopen (path, "w");
+  if (!f || misp_profile_write (P, f))
+    {
+      fprintf (stderr, "Cannot write %s\n", path);
+    }
+  if (f)
+    {
+      fclose (f);
+    }
+  misp_profile_report (P, stderr, 10);
+}
+
+// Loads the program at path, an image or source code, at the start of a
+// new mem with memory free cells after it, mapped with flags up to
+// max_memory cells for the heap to grow into. mem_limit gets the bytes
+// mapped. Source code is folded if fold.
+static int
+load_program (const char *path, size_t memory, size_t max_memory, int flags,
+              bool fold, uint8_t **mem, size_t *mem_size, size_t *mem_limit,
+              size_t *code_size, cell_t *init)
+{
+  FILE *input_file = strcmp ("-", path) ? fopen (path, "rb") : stdin;
+  if (!input_file)
+    {
+      fprintf (stderr, "Cannot find file %s\n", path);
+      return -1;
+    }
+
+  /* Regular files are mapped, anything else is read in chunks */
+  struct stat st;
+  const char *input = NULL;
+  size_t input_size = 0;
+  if (!fstat (fileno (input_file), &st) && S_ISREG (st.st_mode)
+      && st.st_size > 0)
+    {
+      input_size = st.st_size;
+      input = mmap (NULL, input_size, PROT_READ, MAP_PRIVATE,
+                    fileno (input_file), 0);
+      if (input == MAP_FAILED)
+        {
+          input = NULL;
+          input_size = 0;
+        }
+      else
+        {
+          madvise ((void *)input, input_size, MADV_SEQUENTIAL);
+        }
+    }
+
+  if (input && misp_image_is (input, input_size))
+    {
+      munmap ((void *)input, input_size);
+      *mem_limit = max_memory * CELL_SIZE;
+      misp_image_error_t err
+          = misp_image_load (fileno (input_file), memory, flags, mem,
+                             mem_size, mem_limit, code_size, init);
+      fclose (input_file);
+      if (err == MISP_IMAGE_BAD_VERSION)
+        {
+          fprintf (stderr, "%s was compiled by another build of MISP\n",
+                   path);
+          return -1;
+        }
+      if (err)
+        {
+          fprintf (stderr, "Cannot load image %s\n", path);
+          return -1;
+        }
+      printf ("Loaded successfully\n");
+      return 0;
+    }
+
+  /* The code is parsed straight into mem, which has room for a cell per
+     char of input on top of the requested memory. Pages are only backed
+     once touched. */
+  size_t cells = input_size + memory;
+  if (cells > LIST_MAX_MEM)
+    {
+      cells = LIST_MAX_MEM;
+    }
+  *mem_size = cells * CELL_SIZE;
+  *mem_size = (*mem_size + MISP_CACHE_LINE - 1) / MISP_CACHE_LINE
+              * MISP_CACHE_LINE;
+  *mem_limit = max_memory * CELL_SIZE;
+  if (*mem_limit < *mem_size)
+    {
+      *mem_limit = *mem_size;
+    }
+  *mem = misp_mem_map (*mem_limit, flags);
+  if (!*mem)
+    {
+      fprintf (stderr, "Cannot allocate %zu bytes\n", *mem_size);
+      return -1;
+    }
+
+  misp_parser_error_type_t err
+      = input ? misp_parse_mem (input, input_size, *mem, *mem_size,
+                                code_size, init)
+              : misp_parse_stream (input_file, *mem, *mem_size, code_size,
+                                   init);
+  if (input)
+    {
+      munmap ((void *)input, input_size);
+    }
+  if (input_file != stdin)
+    {
+      fclose (input_file);
+    }
+  if (err == MISP_PARSER_OUT_OF_MEMORY)
+    {
+      fprintf (stderr, "Not enough memory to parse %s, see -m\n", path);
+      return -1;
+    }
+  if (err)
+    {
+      fprintf (stderr, "Cannot parse %s\n", path);
+      return -1;
+    }
+
+  /* give back the pages the code did not use, like for an image, they
+     stay mapped for the heap to grow into */
+  size_t size = *code_size + memory * CELL_SIZE;
+  size = (size + MISP_CACHE_LINE - 1) / MISP_CACHE_LINE * MISP_CACHE_LINE;
+  size_t page = sysconf (_SC_PAGESIZE);
+  size_t used = (size + page - 1) / page * page;
+  if (used < *mem_size)
+    {
+      madvise (*mem + used, *mem_size - used, MADV_DONTNEED);
+      *mem_size = size;
+    }
+  printf ("Parsed successfully\n");
+  if (fold)
+    {
+      printf ("Folded %zu nodes\n", misp_fold (*mem, *code_size, init));
+    }
+  return 0;
+}
+
+// Runs every input as a job of its own, over threads threads.
+static int
+run_jobs (const char **inputs, int count, size_t threads, uint64_t slice,
+          size_t memory, size_t max_memory, int flags, bool fold,
+          bool bytecode, bool incremental, bool gc_stats)
+{
+  misp_t *vms = calloc (count, sizeof (misp_t));
+  misp_job_t *jobs = calloc (count, sizeof (misp_job_t));
+  uint8_t **mems = calloc (count, sizeof (uint8_t *));
+  size_t *mem_limits = calloc (count, sizeof (size_t));
+  if (!vms || !jobs || !mems || !mem_limits)
+    {
+      fprintf (stderr, "Cannot allocate %d jobs\n", count);
+      return -1;
+    }
+
+  int err = 0, loaded = 0;
+  for (; loaded < count; loaded++)
+    {
+      size_t mem_size, code_size;
+      cell_t init;
+      if (load_program (inputs[loaded], memory, max_memory, flags, fold,
+                        &mems[loaded], &mem_size, &mem_limits[loaded],
+                        &code_size, &init))
+        {
+          err = -1;
+          break;
+        }
+      misp_init (&vms[loaded], mems[loaded], mem_size, init);
+      misp_mem_limit (&vms[loaded], mem_limits[loaded]);
+      if (incremental)
+        {
+          misp_gc_incremental (&vms[loaded], MISP_GC_DEFAULT_INTERVAL,
+                               MISP_GC_DEFAULT_BUDGET);
+        }
+      if (bytecode && !misp_bc_init (&vms[loaded]))
+        {
+          fprintf (stderr, "Cannot allocate the bytecode engine\n");
+          misp_deinit (&vms[loaded]);
+          misp_mem_unmap (mems[loaded], mem_limits[loaded]);
+          err = -1;
+          break;
+        }
+      jobs[loaded].vm = &vms[loaded];
+    }
+
+  if (!err)
+    {
+      misp_jobs_run (jobs, count, threads, slice);
+    }
+
+  for (int i = 0; i < loaded; i++)
+    {
+      if (!err)
+        {
+          printf ("%s: ", inputs[i]);
+          if (vms[i].panic_code.type)
+            {
+              printf ("PANIC: %d\n", vms[i].panic_code.type);
+            }
+          else
+            {
+              misp_debug (&vms[i], vms[i].result);
+              printf ("\n");
+            }
+          if (gc_stats)
+            {
+              print_gc_stats (&vms[i]);
+            }
+        }
+      misp_deinit (&vms[i]);
+      misp_mem_unmap (mems[i], mem_limits[i]);
+    }
+  free (mem_limits);
+  free (mems);
+  free (jobs);
+  free (vms);
+  return err;
+}
+
+int
+main (int argc, const char *argv[])
+
+{
+  bool debug = false;
+  bool bytecode = false;
+  bool incremental = false;
+  bool gc_stats = false;
+  bool compile = false;
+  bool fold = false;
+  bool decode = false;
+  const char *profile_path = NULL;
+  const char *trace_path = NULL;
+  size_t memory = 1 << 16;
+  size_t max_memory = MISP_DEFAULT_MAX_MEMORY;
+  int mem_flags = 0;
+  size_t threads = 0;
+  uint64_t slice = MISP_JOB_DEFAULT_SLICE;
+  if (argc < 2)
+    {
+      printf ("MISP [-v] [-d] [-b] [-i] [-s] [-O] [-m cells] [-M cells] "
+              "[-H] [-p stacks] [-T trace] input\n"
+              "MISP [-b] [-i] [-s] [-O] [-m cells] [-M cells] [-H] "
+              "-j threads [-t steps] "
+              "input...\n"
+              "MISP [-O] [-m cells] compile input output\n"
+              "MISP [-O] [-m cells] trace input trace\n");
+      return 0;
+    }
+  const char **inputs = malloc (argc * sizeof (const char *));
+  int input_count = 0;
+  for (int i = 1; i < argc; i++)
+    {
+      if (!strcmp ("compile", argv[i]) && i + 2 < argc)
+        {
+          compile = true;
+          continue;
+        }
+      if (!strcmp ("trace", argv[i]) && i + 2 < argc)
+        {
+          decode = true;
+          continue;
+        }
+      if (!strcmp ("-d", argv[i]) || !strcmp ("--debug", argv[i]))
+        {
+          debug = true;
+        }
+      else if ((!strcmp ("-m", argv[i]) || !strcmp ("--memory", argv[i]))
+               && i + 2 < argc)
+        {
+          memory = strtoul (argv[++i], NULL, 0);
+        }
+      else if ((!strcmp ("-M", argv[i]) || !strcmp ("--max-memory", argv[i]))
+               && i + 2 < argc)
+        {
+          max_memory = strtoul (argv[++i], NULL, 0);
+        }
+      else if (!strcmp ("-H", argv[i]) || !strcmp ("--huge-pages", argv[i]))
+        {
+          mem_flags |= MISP_MEM_HUGE;
+        }
+      else if (!strcmp ("-b", argv[i]) || !strcmp ("--bytecode", argv[i]))
+        {
+          bytecode = true;
+        }
+      else if (!strcmp ("-i", argv[i]) || !strcmp ("--incremental", argv[i]))
+        {
+          incremental = true;
+        }
+      else if (!strcmp ("-s", argv[i]) || !strcmp ("--gc-stats", argv[i]))
+        {
+          gc_stats = true;
+        }
+      else if (!strcmp ("-O", argv[i]) || !strcmp ("--fold", argv[i]))
+        {
+          fold = true;
+        }
+      else if ((!strcmp ("-p", argv[i]) || !strcmp ("--profile", argv[i]))
+               && i + 2 < argc)
+        {
+          profile_path = argv[++i];
+        }
+      else if ((!strcmp ("-T", argv[i]) || !strcmp ("--trace", argv[i]))
+               && i + 2 < argc)
+        {
+          trace_path = argv[++i];
+        }
+      else if ((!strcmp ("-j", argv[i]) || !strcmp ("--jobs", argv[i]))
+               && i + 2 < argc)
+        {
+          threads = strtoul (argv[++i], NULL, 0);
+        }
+      else if ((!strcmp ("-t", argv[i]) || !strcmp ("--slice", argv[i]))
+               && i + 2 < argc)
+        {
+          slice = strtoull (argv[++i], NULL, 0);
+        }
+      else if (!strcmp ("-v", argv[i]) || !strcmp ("--version", argv[i]))
+        {
+          printf ("MISP %s\n", MISP_VERSION);
+          printf ("Copyright (C) 2023\n"
+                  "License GPLv3+: GNU GPL version 3 or later "
+                  "<https://gnu.org/licenses/gpl.html>\n"
+                  "This is free software: you are free to change and "
+                  "redistribute it.\n"
+                  "There is NO WARRANTY, to the extent permitted by law.\n");
+
+          return 0;
+        }
+      else if (argv[i][0] != '-' || !argv[i][1])
+        {
+          inputs[input_count++] = argv[i];
+        }
+    }
+
+  if (threads && !compile && !decode)
+    {
+      int err = run_jobs (inputs, input_count, threads, slice, memory,
+                          max_memory, mem_flags, fold, bytecode, incremental,
+                          gc_stats);
+      free (inputs);
+      return err;
+    }
+  free (inputs);
+
+  uint8_t *mem;
+  size_t mem_size, mem_limit, code_size;
+  cell_t init;
+  if (compile)
+    {
+      /* misp compile input output */
+      const char *output_path = argv[argc - 1];
+      if (load_program (argv[argc - 2], memory, 0, 0, fold, &mem, &mem_size,
+                        &mem_limit, &code_size, &init))
+        {
+          return -1;
+        }
+      if (misp_image_write (output_path, mem, code_size, init))
+        {
+          fprintf (stderr, "Cannot write %s\n", output_path);
+          return -1;
+        }
+      misp_mem_unmap (mem, mem_limit);
+      return 0;
+    }
+
+  if (decode)
+    {
+      /* misp trace input trace, prints the steps recorded with -T */
+      const char *path = argv[argc - 1];
+      FILE *f = fopen (path, "rb");
+      if (!f)
+        {
+          fprintf (stderr, "Cannot find file %s\n", path);
+          return -1;
+        }
+      if (load_program (argv[argc - 2], memory, 0, 0, fold, &mem, &mem_size,
+                        &mem_limit, &code_size, &init))
+        {
+          fclose (f);
+          return -1;
+        }
+      misp_t M;
+      misp_init (&M, mem, mem_size, init);
+      int err = misp_trace_decode (&M, f, code_size / CELL_SIZE);
+      if (err)
+        {
+          fprintf (stderr, "%s is not a trace of this build\n", path);
+        }
+      fclose (f);
+      misp_deinit (&M);
+      misp_mem_unmap (mem, mem_limit);
+      return err;
+    }
+
+  if (load_program (argv[argc - 1], memory, max_memory, mem_flags, fold,
+                    &mem, &mem_size, &mem_limit, &code_size, &init))
+    {
+      return -1;
+    }
+
+  misp_t M;
+  misp_init (&M, mem, mem_size, init);
+  misp_mem_limit (&M, mem_limit);
+  if (incremental)
+    {
+      misp_gc_incremental (&M, MISP_GC_DEFAULT_INTERVAL,
+                           MISP_GC_DEFAULT_BUDGET);
+    }
+
+  /* traces are taken by the tree walker */
+  FILE *trace_file = NULL;
+  if (trace_path
+      && (!(trace_file = fopen (trace_path, "wb"))
+          || !(M.trace = misp_trace_new (MISP_TRACE_DEFAULT_CAPACITY,
+                                         trace_file))))
+    {
+      fprintf (stderr, "Cannot write %s\n", trace_path);
+      return -1;
+    }
+
+  if (bytecode && !debug && !trace_path && !misp_bc_init (&M))
+    {
+      fprintf (stderr, "Cannot allocate the bytecode engine\n");
+      return -1;
+    }
+
+  if (debug)
+    {
+      misp_debug_env (&M);
+      while (!M.halted)
+        {
+          char i;
+          scanf ("%c", &i);
+          system ("clear");
+          misp_execute (&M);
+          misp_debug_env (&M);
+        }
+    }
+  misp_profile_t *profile = NULL;
+  if (profile_path
+      && !(profile = misp_profile_new (MISP_PROFILE_DEFAULT_INTERVAL)))
+    {
+      fprintf (stderr, "Cannot allocate the profile\n");
+      return -1;
+    }
+  while (!M.halted)
+    {
+      if (profile)
+        {
+          misp_profile_run (&M, profile, UINT64_MAX);
+        }
+      else
+        {
+          misp_run (&M, UINT64_MAX);
+        }
+    }
+  if (M.panic_code.type)
+    {
+      printf ("PANIC: %d\n", M.panic_code.type);
+      misp_debug_env (&M);
+      if (M.trace)
+        {
+          printf ("LAST STEPS:\n");
+          misp_trace_print_last (&M, M.trace, 16, code_size / CELL_SIZE);
+        }
+    }
+  if (gc_stats)
+    {
+      print_gc_stats (&M);
+    }
+  if (M.trace)
+    {
+      if (misp_trace_flush (M.trace))
+        {
+          fprintf (stderr, "Cannot write %s\n", trace_path);
+        }
+      misp_trace_free (M.trace);
+      fclose (trace_file);
+    }
+  if (profile)
+    {
+      write_profile (profile, profile_path);
+      misp_profile_free (profile);
+    }
+  misp_deinit (&M);
+  misp_mem_unmap (mem, mem_limit);
+
+  return 0;
+}
@@ -0,0 +1,90 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#define _GNU_SOURCE
+#include "misp.h"
+#include <stdint.h>
+#include <sys/mman.h>
+
+/* Mappings are aligned and sized to huge pages of 2M, which lets the
+   kernel back them with transparent huge pages. */
+#define HUGE_PAGE ((size_t)2 << 20)
+
+static size_t
+round_huge (size_t n)
+{
+  return (n + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+}
+
+uint8_t *
+misp_mem_map (size_t limit, int flags)
+{
+  size_t size = round_huge (limit ? limit : 1);
+  uint8_t *mem;
+
+#ifdef MAP_HUGETLB
+  /* Without MAP_NORESERVE the pages are reserved from the pool up front, a
+     fault never finds it empty */
+  if (flags & MISP_MEM_HUGE)
+    {
+      mem = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (mem != MAP_FAILED)
+        {
+          return mem;
+        }
+    }
+#endif
+
+  /* a huge page more is mapped, then trimmed to an aligned start */
+  uint8_t *map = mmap (NULL, size + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map == MAP_FAILED)
+    {
+      return NULL;
+    }
+  mem = (uint8_t *)round_huge ((uintptr_t)map);
+  if (mem > map)
+    {
+      munmap (map, mem - map);
+    }
+  if (map + HUGE_PAGE > mem)
+    {
+      munmap (mem + size, map + HUGE_PAGE - mem);
+    }
+
+#ifdef MADV_HUGEPAGE
+  if (flags & MISP_MEM_HUGE)
+    {
+      madvise (mem, size, MADV_HUGEPAGE);
+    }
+#endif
+  return mem;
+}
+
+void
+misp_mem_unmap (uint8_t *mem, size_t limit)
+{
+  munmap (mem, round_huge (limit ? limit : 1));
+}
+
+void
+misp_mem_limit (misp_t *M, size_t limit)
+{
+  M->mem_limit = limit > M->mem_size ? limit : M->mem_size;
+}
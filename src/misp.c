@@ -17,9 +17,12 @@
 /*************************************************************************/
 
 #include "misp.h"
+#include "bytecode.h"
 #include "defs.h"
+#include "gc.h"
 #include "opc.h"
-#include "parser.h"
+#include "trace.h"
+#include "vm.h"
 #include <assert.h>
 #include <memory.h>
 #include <stdbool.h>
@@ -28,131 +31,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#define CELL_SIZE 9 /* uint64_t + uint8_t (NO PADDING)*/
-
-void
-misp_list_get (misp_t *M, cell_t list, cell_t *cell, size_t i)
-{
-  CELL_READ (&M->mem[(LIST_PTR (list) + i) * CELL_SIZE], cell);
-}
-
-void
-misp_list_set (misp_t *M, cell_t list, cell_t cell, size_t i)
-{
-  CELL_WRITE (&M->mem[(LIST_PTR (list) + i) * CELL_SIZE], cell);
-}
-
-// [a, b[
-void
-misp_list_sub (misp_t *M, cell_t list, cell_t *sub, size_t a, size_t b)
-{
-  *sub = LIST ((b - a), (LIST_PTR (list) + a));
-}
-
-void
-misp_env_parent (misp_t *M, cell_t *parent)
-{
-  misp_list_get (M, M->env, parent, 0);
-}
-
-void
-misp_env_node (misp_t *M, cell_t *node)
-{
-  misp_list_get (M, M->env, node, 1);
-}
-
-void
-misp_env_args (misp_t *M, cell_t *args)
-{
-  misp_list_get (M, M->env, args, 2);
-}
-
-void
-misp_env_trap (misp_t *M, cell_t *trap)
-{
-  misp_list_get (M, M->env, trap, 4);
-}
-
-void
-misp_env_stack (misp_t *M, cell_t *stack)
-{
-  misp_list_get (M, M->env, stack, 3);
-}
-
-void
-misp_env_push (misp_t *M, cell_t cell)
-{
-  cell_t stack;
-  misp_env_stack (M, &stack);
-
-  stack
-      = LIST (LIST_LEN (stack) + 1, LIST_PTR (stack)); // TODO: check overflow
-
-  misp_list_set (M, stack, cell, LIST_LEN (stack) - 1);
-  misp_list_set (M, M->env, stack, 3);
-}
-
-void
-misp_env_pop (misp_t *M, size_t amount)
-{
-  cell_t stack;
-  misp_env_stack (M, &stack);
-
-  stack = LIST (LIST_LEN (stack) - amount,
-                LIST_PTR (stack)); // TODO: check underflow?
-  misp_list_set (M, M->env, stack, 3);
-}
-
-void
-misp_env_get (misp_t *M, cell_t *cell, size_t i)
-{
-  cell_t stack;
-  misp_env_stack (M, &stack);
-  misp_list_get (M, stack, cell, i);
-}
-
-void
-misp_env_top (misp_t *M, cell_t *top)
-{
-  cell_t stack;
-  misp_env_stack (M, &stack);
-  misp_list_sub (M, M->env, top, 5 + LIST_LEN (stack), LIST_LEN (M->env));
-}
-
-void
-misp_env_begin (misp_t *M, cell_t node, cell_t args, cell_t trap)
-{
-  cell_t newenv;
-  misp_env_top (M, &newenv);
-  misp_list_set (M, newenv, M->env, 0); // parent
-  misp_list_set (M, newenv, node, 1);   // node
-  misp_list_set (M, newenv, args, 2);   // args
-
-  cell_t stack;
-  misp_list_sub (M, newenv, &stack, 5, 5);
-
-  misp_list_set (M, newenv, stack, 3); // stack
-  misp_list_set (M, newenv, trap, 4);  // trap
-
-  M->env = newenv;
-}
-
-void
-misp_env_ret (misp_t *M, cell_t ret)
-{
-  cell_t parent;
-  misp_env_parent (M, &parent); // jump to parent
-  M->env = parent;
-  if (!LIST_LEN (M->env))
-    {
-      M->halted = true;
-      return;
-    }
-  misp_env_push (M, ret);
-}
-
-void misp_debug (misp_t *M, cell_t c);
-
 #define check_is_num(M, node, c)                                              \
   {                                                                           \
     if (!IS_NUM (c))                                                          \
@@ -206,6 +84,19 @@ void misp_debug (misp_t *M, cell_t c);
       return;                                                                 \
     }
 
+// Evaluates c in place of the current node, the frame is reused.
+#define tail_eval(M, c)                                                       \
+  if (IS_LIST (c))                                                            \
+    {                                                                         \
+      misp_env_tail (M, c);                                                   \
+      return;                                                                 \
+    }                                                                         \
+  else                                                                        \
+    {                                                                         \
+      misp_env_ret (M, c);                                                    \
+      return;                                                                 \
+    }
+
 #define eval_params(M, params, stack)                                         \
   if (LIST_LEN (stack) < LIST_LEN (params))                                   \
     {                                                                         \
@@ -214,7 +105,6 @@ void misp_debug (misp_t *M, cell_t c);
       eval (M, param);                                                        \
     }
 
-#define IS_TRUE(c) ((IS_NUM (c) && NUM_VAL (c)) || LIST_LEN (c))
 #define PANIC(code, node)                                                     \
   (misp_panic_t) { code, node }
 
@@ -223,19 +113,63 @@ misp_init (misp_t *M, uint8_t *mem, size_t mem_size, cell_t init)
 {
   M->mem = mem;
   M->mem_size = mem_size;
+  M->mem_limit = mem_size;
 
   M->halted = false;
   M->trapped = false;
+  M->bc = NULL;
+  M->trace = NULL;
+  M->natives = NULL;
+  M->par = NULL;
+  M->mem_mapped = false;
+  M->snapshot = NULL;
   M->panic_code = PANIC (MISP_PANIC_NO, LIST_NULL);
+  M->result = LIST_NULL;
+
+  /* The frames start at 200, or right after the code when it is longer */
+  size_t frames = 200;
+  if (IS_LIST (init) && LIST_PTR (init) + LIST_LEN (init) > frames)
+    {
+      frames = LIST_PTR (init) + LIST_LEN (init);
+    }
+  M->frames = LIST (MISP_FRAMES_SIZE, frames);
+
+  /* The upper half of the memory left after the code and the frames is the
+     collected heap, the lower half stays addressable through the root args */
+  size_t cells = mem_size / CELL_SIZE;
+  size_t low = frames + MISP_FRAMES_SIZE;
+  if (low > cells)
+    {
+      low = cells;
+    }
+  size_t heap_base = low + (cells - low) / 2;
+  /* with wide lists, the root args list may not reach that far, the heap
+     gets the rest */
+  if (heap_base > LIST_MAX_LEN && low <= LIST_MAX_LEN)
+    {
+      heap_base = LIST_MAX_LEN;
+    }
+  if (!misp_heap_init (M, heap_base, cells))
+    {
+      M->halted = true;
+      M->panic_code = PANIC (MISP_PANIC_OUT_OF_MEMORY, LIST_NULL);
+    }
 
-  M->env = LIST (400, 200);
+  misp_env_root (M, init, misp_root_args (M));
+}
 
-  misp_env_begin (M, init, LIST (mem_size / CELL_SIZE, 0), LIST_NULL);
-  misp_list_set (M, M->env, LIST_NULL, 0);
+void
+misp_deinit (misp_t *M)
+{
+  misp_par_release (M);
+  misp_bc_free (M);
+  misp_heap_free (M);
+  misp_clone_release (M);
+  misp_natives_release (M);
 }
 
-static int64_t
-do_numop (uint64_t op, int64_t a, int64_t b)
+int64_t
+misp_numop (uint64_t op, int64_t a, int64_t b)
 {
   switch (op)
     {
@@ -269,14 +203,10 @@ do_numop (uint64_t op, int64_t a, int64_t b)
   return 0;
 }
 
-void
-misp_execute (misp_t *M)
+// One step of the tree walker, M must not be halted.
+static inline void
+step (misp_t *M)
 {
-  if (M->halted)
-    {
-      return;
-    }
-
   cell_t node, stack;
   misp_env_node (M, &node);
   misp_env_stack (M, &stack);
@@ -306,7 +236,7 @@ misp_execute (misp_t *M)
           check_is_num (M, node, a);
           check_is_num (M, node, b);
 
-          ret = NUM (do_numop (opc, NUM_VAL (a), NUM_VAL (b)));
+          ret = NUM (misp_numop (opc, NUM_VAL (a), NUM_VAL (b)));
 
           misp_env_ret (M, ret);
           return;
@@ -325,6 +255,12 @@ misp_execute (misp_t *M)
         case MISP_OPC_DO:
           {
             cell_t ret;
+            if (LIST_LEN (params)
+                && LIST_LEN (stack) == LIST_LEN (params) - 1)
+              {
+                misp_list_get (M, params, &ret, LIST_LEN (stack));
+                tail_eval (M, ret);
+              }
             eval_params (M, params, stack);
             misp_env_get (M, &ret, LIST_LEN (stack) - 1);
             misp_env_ret (M, ret);
@@ -332,20 +268,12 @@ misp_execute (misp_t *M)
           break;
         case MISP_OPC_LET:
           {
-            cell_t ret, binds, body;
+            cell_t binds, body;
             misp_list_sub (M, params, &binds, 0, LIST_LEN (params) - 1);
             eval_params (M, binds, stack);
 
-            if (LIST_LEN (binds) == LIST_LEN (stack))
-              {
-                misp_list_get (M, params, &body, LIST_LEN (params) - 1);
-                misp_env_begin (M, body, stack, LIST_NULL);
-              }
-            else
-              {
-                misp_env_get (M, &ret, LIST_LEN (stack) - 1);
-                misp_env_ret (M, ret);
-              }
+            misp_list_get (M, params, &body, LIST_LEN (params) - 1);
+            misp_env_rebind (M, body, LIST_LEN (stack));
           }
           break;
         case MISP_OPC_GET:
@@ -375,6 +303,7 @@ misp_execute (misp_t *M)
             check_is_in_bounds (M, node, args, idx);
 
             misp_list_set (M, args, cell, NUM_VAL (idx));
+            misp_bc_written (M, LIST_PTR (args) + NUM_VAL (idx));
 
             misp_env_ret (M, cell);
           }
@@ -389,12 +318,12 @@ misp_execute (misp_t *M)
 
             ret = NUM (~NUM_VAL (cell));
 
-            misp_env_ret (M, cell);
+            misp_env_ret (M, ret);
           }
           break;
         case MISP_OPC_COND:
           {
-            cell_t ret, condbd, cond;
+            cell_t condbd, cond;
             eval_params (M, params, stack);
             misp_env_get (M, &condbd, 0);
 
@@ -417,13 +346,7 @@ misp_execute (misp_t *M)
                     {
                       misp_env_get (M, &bd, 2);
                     }
-                  eval (M, bd);
-                }
-                break;
-              case 2:
-                {
-                  misp_env_get (M, &ret, 4);
-                  misp_env_ret (M, ret);
+                  tail_eval (M, bd);
                 }
                 break;
               }
@@ -471,12 +394,89 @@ misp_execute (misp_t *M)
             eval_params (M, params, stack);
             misp_env_get (M, &cell, 0);
 
+            flockfile (stdout);
             misp_debug (M, cell);
             printf ("\n");
+            funlockfile (stdout);
 
             misp_env_ret (M, cell);
           }
           break;
+        case MISP_OPC_LNEW:
+          {
+            cell_t ret, cell;
+
+            eval_params (M, params, stack);
+
+            if (!misp_alloc (M, LIST_LEN (stack), &ret))
+              {
+                M->halted = true;
+                M->panic_code
+                    = (misp_panic_t){ MISP_PANIC_OUT_OF_MEMORY, node };
+                return;
+              }
+
+            // the collection may have moved the stack contents
+            misp_env_stack (M, &stack);
+            for (size_t i = 0; i < LIST_LEN (stack); i++)
+              {
+                misp_list_get (M, stack, &cell, i);
+                misp_list_set (M, ret, cell, i);
+              }
+
+            misp_env_ret (M, ret);
+          }
+          break;
+        case MISP_OPC_ALLOC:
+          {
+            cell_t ret, len;
+
+            check_param_count (M, params, < 1);
+            eval_params (M, params, stack);
+            misp_env_get (M, &len, 0);
+
+            check_is_num (M, node, len);
+
+            if (!misp_arena_alloc (M, NUM_VAL (len), &ret))
+              {
+                M->halted = true;
+                M->panic_code
+                    = (misp_panic_t){ MISP_PANIC_OUT_OF_MEMORY, node };
+                return;
+              }
+
+            misp_env_ret (M, ret);
+          }
+          break;
+        case MISP_OPC_ARENA: // everything alloc'd by the body is released
+          {
+            cell_t mark, ret, body;
+            check_param_count (M, params, != 1);
+
+            switch (LIST_LEN (stack))
+              {
+              case 0:
+                {
+                  misp_env_push (M, NUM (M->heap.end - M->heap.arena));
+                }
+                break;
+              case 1:
+                {
+                  misp_list_get (M, params, &body, 0);
+                  eval (M, body);
+                }
+                break;
+              case 2:
+                {
+                  misp_env_get (M, &mark, 0);
+                  misp_env_get (M, &ret, 1);
+                  M->heap.arena = M->heap.end - NUM_VAL (mark);
+                  misp_env_ret (M, ret);
+                }
+                break;
+              }
+          }
+          break;
         case MISP_OPC_LLEN:
           {
             cell_t ret, list;
@@ -497,12 +497,14 @@ misp_execute (misp_t *M)
 
             eval_params (M, params, stack);
             misp_env_get (M, &list, 0);
+            misp_env_get (M, &a, 1);
+            misp_env_get (M, &b, 2);
 
             check_is_list (M, node, list);
             check_is_num (M, node, a);
             check_is_num (M, node, b);
             check_is_in_bounds (M, node, list, a);
-            if (NUM_VAL (b) > LIST_LEN (list))
+            if (NUM_VAL (b) > LIST_LEN (list) || NUM_VAL (b) < NUM_VAL (a))
               {
                 M->halted = true;
                 M->panic_code
@@ -535,7 +537,7 @@ misp_execute (misp_t *M)
           break;
         case MISP_OPC_LSET:
           {
-            cell_t ret, list, idx, cell;
+            cell_t list, idx, cell;
 
             eval_params (M, params, stack);
 
@@ -548,6 +550,132 @@ misp_execute (misp_t *M)
             check_is_in_bounds (M, node, list, idx);
 
             misp_list_set (M, list, cell, NUM_VAL (idx));
+            misp_bc_written (M, LIST_PTR (list) + NUM_VAL (idx));
+
+            misp_env_ret (M, cell);
+          }
+          break;
+        case MISP_OPC_LCOPY:
+          {
+            cell_t dst, src;
+            struct misp_typed t;
+
+            check_param_count (M, params, < 2);
+            eval_params (M, params, stack);
+
+            misp_env_get (M, &dst, 0);
+            misp_env_get (M, &src, 1);
+
+            check_is_list (M, node, dst);
+            check_is_list (M, node, src);
+            if (misp_typed_of (M, dst, &t) || misp_typed_of (M, src, &t))
+              {
+                misp_panic_type_t type = misp_typed_copy (M, dst, src);
+                misp_bc_written_range (M, LIST_PTR (dst),
+                                       LIST_PTR (dst) + LIST_LEN (dst));
+                if (type)
+                  {
+                    M->halted = true;
+                    M->panic_code = (misp_panic_t){ type, node };
+                    return;
+                  }
+                misp_env_ret (M, dst);
+                break;
+              }
+            if (LIST_LEN (src) > LIST_LEN (dst))
+              {
+                M->halted = true;
+                M->panic_code
+                    = (misp_panic_t){ MISP_PANIC_OUT_OF_BOUNDS, node };
+                return;
+              }
+
+            misp_list_copy (M, dst, src);
+            misp_bc_written_range (M, LIST_PTR (dst),
+                                   LIST_PTR (dst) + LIST_LEN (src));
+
+            misp_env_ret (M, dst);
+          }
+          break;
+        case MISP_OPC_LFILL:
+          {
+            cell_t list, cell;
+            struct misp_typed t;
+
+            check_param_count (M, params, < 2);
+            eval_params (M, params, stack);
+
+            misp_env_get (M, &list, 0);
+            misp_env_get (M, &cell, 1);
+
+            check_is_list (M, node, list);
+
+            if (!misp_typed_of (M, list, &t))
+              {
+                misp_list_fill (M, list, cell);
+              }
+            else if (misp_typed_fill (M, &t, cell))
+              {
+                M->halted = true;
+                M->panic_code
+                    = (misp_panic_t){ MISP_PANIC_TYPE_ERROR, node };
+                return;
+              }
+            misp_bc_written_range (M, LIST_PTR (list),
+                                   LIST_PTR (list) + LIST_LEN (list));
+
+            misp_env_ret (M, list);
+          }
+          break;
+        case MISP_OPC_LCAT:
+          {
+            cell_t ret, list;
+            struct misp_typed t;
+            size_t len = 0;
+            bool typed = false;
+
+            eval_params (M, params, stack);
+
+            for (size_t i = 0; i < LIST_LEN (stack); i++)
+              {
+                misp_env_get (M, &list, i);
+                check_is_list (M, node, list);
+                typed = typed || misp_typed_of (M, list, &t);
+                len += LIST_LEN (list);
+              }
+
+            if (typed)
+              {
+                misp_panic_type_t type = misp_typed_cat (
+                    M, LIST_PTR (stack), LIST_LEN (stack), &ret);
+                if (type)
+                  {
+                    M->halted = true;
+                    M->panic_code = (misp_panic_t){ type, node };
+                    return;
+                  }
+                misp_env_ret (M, ret);
+                break;
+              }
+
+            if (len > LIST_MAX_LEN || !misp_alloc (M, len, &ret))
+              {
+                M->halted = true;
+                M->panic_code
+                    = (misp_panic_t){ MISP_PANIC_OUT_OF_MEMORY, node };
+                return;
+              }
+
+            // the collection may have moved the lists
+            len = 0;
+            for (size_t i = 0; i < LIST_LEN (stack); i++)
+              {
+                cell_t dst;
+                misp_env_get (M, &list, i);
+                misp_list_sub (M, ret, &dst, len, len + LIST_LEN (list));
+                misp_list_copy (M, dst, list);
+                len += LIST_LEN (list);
+              }
 
             misp_env_ret (M, ret);
           }
@@ -594,31 +722,78 @@ misp_execute (misp_t *M)
             else
               {
                 check_is_num (M, node, b);
-                ret = NUM (!(NUM_VAL (a) != NUM_VAL (b)));
+                ret = NUM (NUM_VAL (a) != NUM_VAL (b));
               }
 
             misp_env_ret (M, ret);
           }
           break;
+        case MISP_OPC_PMAP:
+        case MISP_OPC_PREDUCE:
+          {
+            eval_params (M, params, stack);
+            misp_par_step (M, node, opc);
+          }
+          break;
+        case MISP_OPC_VADD:
+        case MISP_OPC_VSUB:
+        case MISP_OPC_VMUL:
+        case MISP_OPC_VSUM:
+        case MISP_OPC_VMIN:
+        case MISP_OPC_VMAX:
+        case MISP_OPC_VDOT:
+          {
+            eval_params (M, params, stack);
+            misp_vec_step (M, node, opc);
+          }
+          break;
+        case MISP_OPC_HNEW:
+        case MISP_OPC_HGET:
+        case MISP_OPC_HSET:
+        case MISP_OPC_HDEL:
+        case MISP_OPC_HLEN:
+          {
+            eval_params (M, params, stack);
+            misp_hash_step (M, node, opc);
+          }
+          break;
+        case MISP_OPC_TNEW:
+        case MISP_OPC_TGET:
+        case MISP_OPC_TSET:
+        case MISP_OPC_TLEN:
+          {
+            eval_params (M, params, stack);
+            misp_typed_step (M, node, opc);
+          }
+          break;
         case MISP_OPC_EVAL:
           {
-            cell_t ret, cell;
-            check_param_count (M, params, == 1);
+            cell_t cell;
+            check_param_count (M, params, != 1);
             eval_params (M, params, stack);
             misp_env_get (M, &cell, 0);
-            if (LIST_LEN (stack) == 1)
-              {
-                eval (M, cell);
-              }
-            else
-              {
-                misp_env_get (M, &ret, 1);
-                misp_env_ret (M, ret);
-              }
+            tail_eval (M, cell);
           }
           break;
         default:
           {
+            const struct misp_native *n = misp_native_of (M, opc);
+            if (n)
+              {
+                cell_t args[MISP_NATIVE_MAX_ARITY], ret;
+                misp_panic_type_t type;
+                check_param_count (M, params, != n->arity);
+                eval_params (M, params, stack);
+                misp_native_args (M, args, n->arity);
+                if ((type = misp_native_call (M, n, args, &ret)))
+                  {
+                    M->halted = true;
+                    M->panic_code = (misp_panic_t){ type, node };
+                    return;
+                  }
+                misp_env_ret (M, ret);
+                return;
+              }
 
             M->halted = true;
             M->panic_code = (misp_panic_t){ MISP_PANIC_INVALID_OPC, node };
@@ -629,10 +804,64 @@ misp_execute (misp_t *M)
     }
 }
 
+// Same as tree_run, recording every step in M->trace.
+static uint64_t
+traced_run (misp_t *M, uint64_t max_steps)
+{
+  uint64_t steps = 0;
+  while (steps < max_steps && !M->halted)
+    {
+      if (M->heap.phase && !--M->heap.countdown)
+        {
+          misp_gc_step (M);
+        }
+      misp_trace_step (M);
+      step (M);
+      steps++;
+    }
+  return steps;
+}
+
+static uint64_t
+tree_run (misp_t *M, uint64_t max_steps)
+{
+  uint64_t steps = 0;
+  if (M->trace)
+    {
+      return traced_run (M, max_steps);
+    }
+  while (steps < max_steps && !M->halted)
+    {
+      if (M->heap.phase && !--M->heap.countdown)
+        {
+          misp_gc_step (M);
+        }
+      step (M);
+      steps++;
+    }
+  return steps;
+}
+
+void
+misp_execute (misp_t *M)
+{
+  tree_run (M, 1);
+}
+
+uint64_t
+misp_run (misp_t *M, uint64_t max_steps)
+{
+  if (M->bc)
+    {
+      return misp_bc_run (M, max_steps);
+    }
+  return tree_run (M, max_steps);
+}
+
 void
 misp_debug (misp_t *M, cell_t c)
 {
-  static int depth = 0;
+  static _Thread_local int depth = 0;
   depth++;
   bool shorthand = depth >= 3;
 
@@ -689,93 +918,3 @@ misp_debug_env (misp_t *M)
   misp_debug (M, stack);
   printf ("\n");
 }
-
-int
-main (int argc, const char *argv[])
-
-{
-  bool debug = false;
-  if (argc < 2)
-    {
-      printf ("MISP [-v] [-d] input\n");
-      return 0;
-    }
-  for (int i = 1; i < argc; i++)
-    {
-      if (!strcmp ("-d", argv[i]) || !strcmp ("--debug", argv[i]))
-        {
-          debug = true;
-        }
-      else if (!strcmp ("-v", argv[i]) || !strcmp ("--version", argv[i]))
-        {
-          printf ("MISP %s\n", MISP_VERSION);
-          printf ("Copyright (C) 2023\n"
-                  "License GPLv3+: GNU GPL version 3 or later "
-                  "<https://gnu.org/licenses/gpl.html>\n"
-                  "This is free software: you are free to change and "
-                  "redistribute it.\n"
-                  "There is NO WARRANTY, to the extent permitted by law.\n");
-
-          return 0;
-        }
-    }
-
-  const char *input_path = argv[argc - 1];
-
-  FILE *input_file = fopen (input_path, "rb");
-  if (!input_file)
-    {
-      fprintf (stderr, "Cannot find file %s\n", input_path);
-      return -1;
-    }
-  fseek (input_file, 0, SEEK_END);
-  size_t input_size = ftell (input_file);
-  fseek (input_file, 0, SEEK_SET);
-
-  char *input = malloc (input_size);
-  fread (input, input_size, 1, input_file);
-  fclose (input_file);
-
-  cell_t init;
-  uint8_t *code;
-  size_t code_size;
-  misp_parse_string (input, &code, &code_size, &init);
-  printf ("Parsed successfully\n");
-
-  misp_t M;
-  size_t mem_size = code_size + 1024 * 9;
-  uint8_t *mem = calloc (mem_size, sizeof (uint8_t));
-
-  memcpy (mem, code, code_size);
-  misp_init (&M, mem, mem_size, init);
-  cell_t thing;
-  misp_list_get (&M, M.env, &thing, 3);
-
-  if (debug)
-    {
-      misp_debug_env (&M);
-    }
-  while (!M.halted)
-    {
-      char i;
-      if (debug)
-        {
-          scanf ("%c", &i);
-          system ("clear");
-        }
-      misp_execute (&M);
-      if (debug)
-        {
-          misp_debug_env (&M);
-        }
-    }
-  if (M.panic_code.type)
-    {
-      printf ("PANIC: %d\n", M.panic_code.type);
-      misp_debug_env (&M);
-    }
-  free (input);
-  free (code);
-
-  return 0;
-}
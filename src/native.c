@@ -0,0 +1,190 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#include "bytecode.h"
+#include "defs.h"
+#include "gc.h"
+#include "misp.h"
+#include "vm.h"
+#include <stdlib.h>
+
+misp_native_error_t
+misp_register (misp_t *M, uint64_t opc, const char *signature,
+               misp_native_fn_t fn, void *data)
+{
+  struct misp_native n = { fn, data, 0, { 0 } };
+
+  if (opc < MISP_OPC_NATIVE_BASE
+      || opc - MISP_OPC_NATIVE_BASE >= MISP_NATIVES_MAX)
+    {
+      return MISP_NATIVE_BAD_OPC;
+    }
+  if (misp_native_of (M, opc))
+    {
+      return MISP_NATIVE_TAKEN;
+    }
+  if (!fn)
+    {
+      return MISP_NATIVE_BAD_SIGNATURE;
+    }
+  for (; signature[n.arity]; n.arity++)
+    {
+      if (n.arity == MISP_NATIVE_MAX_ARITY)
+        {
+          return MISP_NATIVE_BAD_SIGNATURE;
+        }
+      switch (signature[n.arity])
+        {
+        case 'n':
+          n.types[n.arity] = TYPE_NUM;
+          break;
+        case 'l':
+          n.types[n.arity] = TYPE_LIST;
+          break;
+        case 'a':
+          n.types[n.arity] = NATIVE_ANY;
+          break;
+        default:
+          return MISP_NATIVE_BAD_SIGNATURE;
+        }
+    }
+
+  if (!M->natives)
+    {
+      M->natives = calloc (1, sizeof (struct misp_natives));
+      if (!M->natives)
+        {
+          return MISP_NATIVE_OUT_OF_MEMORY;
+        }
+      M->natives->refs = 1;
+    }
+  M->natives->fns[opc - MISP_OPC_NATIVE_BASE] = n;
+  return MISP_NATIVE_OK;
+}
+
+misp_panic_type_t
+misp_native_call (misp_t *M, const struct misp_native *n, const cell_t *args,
+                  cell_t *ret)
+{
+  for (size_t i = 0; i < n->arity; i++)
+    {
+      if (n->types[i] != NATIVE_ANY && CELL_TYPE (args[i]) != n->types[i])
+        {
+          return MISP_PANIC_TYPE_ERROR;
+        }
+    }
+  *ret = LIST_NULL;
+  return n->fn (M, args, ret, n->data);
+}
+
+void
+misp_natives_release (misp_t *M)
+{
+  if (M->natives && !--M->natives->refs)
+    {
+      free (M->natives);
+    }
+  M->natives = NULL;
+}
+
+void
+misp_native_args (misp_t *M, cell_t *args, size_t n)
+{
+  cell_t stack = M->frame.stack;
+  for (size_t i = 0; i < n; i++)
+    {
+      misp_list_get (M, stack, &args[i], LIST_LEN (stack) - n + i);
+    }
+}
+
+cell_t
+misp_num (int64_t n)
+{
+  return NUM (n);
+}
+
+int64_t
+misp_num_val (cell_t c)
+{
+  return NUM_VAL (c);
+}
+
+bool
+misp_is_num (cell_t c)
+{
+  return IS_NUM (c);
+}
+
+bool
+misp_is_list (cell_t c)
+{
+  return IS_LIST (c);
+}
+
+size_t
+misp_list_len (cell_t list)
+{
+  return LIST_LEN (list);
+}
+
+cell_t
+misp_list_at (misp_t *M, cell_t list, size_t i)
+{
+  cell_t c;
+  misp_list_get (M, list, &c, i);
+  return c;
+}
+
+void
+misp_list_put (misp_t *M, cell_t list, size_t i, cell_t c)
+{
+  misp_list_set (M, list, c, i);
+  misp_bc_written (M, LIST_PTR (list) + i);
+}
+
+bool
+misp_list_new (misp_t *M, size_t len, cell_t *list)
+{
+  return misp_alloc (M, len, list);
+}
+
+cell_t
+misp_root_args (misp_t *M)
+{
+  size_t len = M->heap.base;
+  return LIST (len < LIST_MAX_LEN ? len : LIST_MAX_LEN, 0);
+}
+
+bool
+misp_call (misp_t *M, cell_t node, cell_t args, cell_t *ret)
+{
+  M->halted = false;
+  M->panic_code = (misp_panic_t){ MISP_PANIC_NO, LIST_NULL };
+  M->result = LIST_NULL;
+  if (M->bc)
+    {
+      misp_bc_reset (M);
+    }
+  misp_env_root (M, node, args);
+  while (!M->halted)
+    {
+      misp_run (M, UINT64_MAX);
+    }
+  *ret = M->result;
+  return !M->panic_code.type;
+}
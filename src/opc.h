@@ -48,11 +48,40 @@
 
 #define MISP_OPC_NNOT 35
 
+#define MISP_OPC_LNEW 70
 #define MISP_OPC_LLEN 71
 #define MISP_OPC_LGET 72
 #define MISP_OPC_LSET 73
 #define MISP_OPC_LSUB 74
 #define MISP_OPC_LINT 75
+#define MISP_OPC_LCOPY 76
+#define MISP_OPC_LFILL 77
+#define MISP_OPC_LCAT 78
+
+#define MISP_OPC_PMAP 80
+#define MISP_OPC_PREDUCE 81
+
+#define MISP_OPC_ALLOC 84
+#define MISP_OPC_ARENA 85
+
+#define MISP_OPC_VADD 90
+#define MISP_OPC_VSUB 91
+#define MISP_OPC_VMUL 92
+#define MISP_OPC_VSUM 93
+#define MISP_OPC_VMIN 94
+#define MISP_OPC_VMAX 95
+#define MISP_OPC_VDOT 96
+
+#define MISP_OPC_HNEW 100
+#define MISP_OPC_HGET 101
+#define MISP_OPC_HSET 102
+#define MISP_OPC_HDEL 103
+#define MISP_OPC_HLEN 104
+
+#define MISP_OPC_TNEW 110
+#define MISP_OPC_TGET 111
+#define MISP_OPC_TSET 112
+#define MISP_OPC_TLEN 113
 
 #define MISP_OPC_DBUG 67
 
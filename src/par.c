@@ -0,0 +1,514 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#include "bytecode.h"
+#include "defs.h"
+#include "gc.h"
+#include "misp.h"
+#include "opc.h"
+#include "vm.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* (pmap list body) evaluates body for every element of list, with the
+   element as its only arg, and writes the value back in its place.
+   (preduce list init body) folds list with body, whose args are the value
+   so far and the next element, starting from init.
+
+   The list is cut in chunks of MISP_PAR_CHUNK elements, taken in order by
+   worker threads, which are started on the first call and kept waiting for
+   the next one until M is released. Each worker is a VM of its own over the
+   same mem, with no heap and its own frame region, on the bytecode engine
+   when M is: bodies can read and write anything but cannot allocate. While
+   M is marking, the barrier of a worker keeps the lists it overwrites for M
+   to mark after the join. preduce folds every chunk from its first element,
+   then folds init and the value of each chunk in order, so the result does
+   not depend on the number of threads. It is the value of a left fold as
+   long as body is associative. Either runs to the end within a single
+   step. */
+
+#define MISP_PAR_CHUNK 1024
+
+/* A worker region holds the two args of preduce, then the frames */
+#define REGION_SIZE (2 + MISP_FRAMES_SIZE)
+
+struct par
+{
+  uint64_t opc;
+  cell_t list;
+  cell_t body;
+  size_t chunks;
+  atomic_size_t next; /* next chunk to take */
+  atomic_bool stop;   /* a chunk panicked, take no more */
+  cell_t *values;     /* value of each chunk for preduce */
+  misp_panic_t *panics;
+};
+
+struct worker
+{
+  struct par *P;
+  struct misp_par *pool;
+  size_t id;
+  misp_t W;
+  struct misp_bc *bc; /* engine of W, kept from call to call */
+  cell_t args;
+};
+
+struct misp_par
+{
+  pthread_mutex_t lock;
+  pthread_cond_t wake; /* a call was posted, or the pool is closing */
+  pthread_cond_t done; /* the helpers of the call are all done */
+  uint64_t calls;      /* calls posted so far */
+  size_t threads;      /* workers of the current call */
+  size_t busy;         /* helpers still in the current call */
+  bool closing;
+  size_t helpers;          /* threads started, next to the calling one */
+  pthread_t *tids;
+  size_t size;             /* workers, one per cpu */
+  struct worker workers[]; /* workers[0] is the calling thread */
+};
+
+static size_t
+cpus (void)
+{
+  static atomic_size_t n;
+  size_t c = atomic_load_explicit (&n, memory_order_relaxed);
+  if (!c)
+    {
+      long online = sysconf (_SC_NPROCESSORS_ONLN);
+      c = online > 0 ? online : 1;
+      atomic_store_explicit (&n, c, memory_order_relaxed);
+    }
+  return c;
+}
+
+static void
+worker_init (struct worker *w, struct par *P, misp_t *M, size_t region,
+             size_t size)
+{
+  /* the mark stack is kept from call to call, for the barrier */
+  misp_heap_t heap = { 0 };
+  heap.gray = w->W.heap.gray;
+  heap.gray_capacity = w->W.heap.gray_capacity;
+  heap.base = M->heap.base; // for the compiler, code is below it
+  if (M->heap.phase == MISP_GC_MARK)
+    {
+      heap.phase = MISP_GC_MARK;
+    }
+
+  w->P = P;
+  w->W = (misp_t){ 0 };
+  w->W.mem = M->mem;
+  w->W.mem_size = M->mem_size;
+  w->W.frames = LIST (size - 2, region + 2);
+  w->W.heap = heap;
+  w->W.result = LIST_NULL;
+  w->W.natives = M->natives;
+  w->args = LIST (2, region);
+  if (M->bc && !w->bc && misp_bc_init (&w->W))
+    {
+      w->bc = w->W.bc;
+    }
+  if (M->bc && w->bc)
+    {
+      w->W.bc = w->bc;
+      misp_bc_clear (&w->W);
+      /* writes to the code of M make the worker stale too */
+      w->bc->code_lo = M->bc->code_lo;
+      w->bc->code_hi = M->bc->code_hi;
+    }
+}
+
+static void
+worker_free (struct worker *w)
+{
+  w->W.bc = w->bc;
+  misp_bc_free (&w->W);
+  free (w->W.heap.gray);
+}
+
+// Evaluates body with args in the worker VM, false when it panicked.
+static bool
+apply (misp_t *W, cell_t body, cell_t args, cell_t *ret)
+{
+  if (!IS_LIST (body))
+    {
+      *ret = body;
+      return true;
+    }
+  W->halted = false;
+  W->panic_code = (misp_panic_t){ MISP_PANIC_NO, LIST_NULL };
+  if (W->bc)
+    {
+      misp_bc_reset (W);
+    }
+  misp_env_root (W, body, args);
+  while (!W->halted)
+    {
+      misp_run (W, UINT64_MAX);
+    }
+  *ret = W->result;
+  return !W->panic_code.type;
+}
+
+static bool
+fold (struct worker *w, cell_t acc, cell_t x, cell_t *ret)
+{
+  misp_list_set (&w->W, w->args, acc, 0);
+  misp_list_set (&w->W, w->args, x, 1);
+  return apply (&w->W, w->P->body, w->args, ret);
+}
+
+static void
+run_chunk (struct worker *w, size_t c)
+{
+  struct par *P = w->P;
+  misp_t *W = &w->W;
+  size_t a = c * MISP_PAR_CHUNK;
+  size_t b = a + MISP_PAR_CHUNK;
+  if (b > LIST_LEN (P->list))
+    {
+      b = LIST_LEN (P->list);
+    }
+
+  bool ok = true;
+  if (P->opc == MISP_OPC_PMAP)
+    {
+      for (size_t i = a; ok && i < b; i++)
+        {
+          cell_t ret;
+          ok = apply (W, P->body, LIST (1, LIST_PTR (P->list) + i), &ret);
+          if (ok)
+            {
+              misp_list_set (W, P->list, ret, i);
+              misp_bc_written (W, LIST_PTR (P->list) + i);
+            }
+        }
+    }
+  else
+    {
+      cell_t acc, x;
+      misp_list_get (W, P->list, &acc, a);
+      for (size_t i = a + 1; ok && i < b; i++)
+        {
+          misp_list_get (W, P->list, &x, i);
+          ok = fold (w, acc, x, &acc);
+        }
+      P->values[c] = acc;
+    }
+
+  P->panics[c] = W->panic_code;
+  if (!ok)
+    {
+      atomic_store_explicit (&P->stop, true, memory_order_relaxed);
+    }
+}
+
+static void *
+work (void *arg)
+{
+  struct worker *w = arg;
+  struct par *P = w->P;
+  while (!atomic_load_explicit (&P->stop, memory_order_relaxed))
+    {
+      size_t c = atomic_fetch_add_explicit (&P->next, 1,
+                                            memory_order_relaxed);
+      if (c >= P->chunks)
+        {
+          break;
+        }
+      run_chunk (w, c);
+    }
+  return NULL;
+}
+
+/* Chunks are taken in order and a chunk is always finished, so every chunk
+   before the first one that panicked ran to the end: the panic reported
+   is the one a sequential run would have hit. */
+static bool
+first_panic (struct par *P, misp_panic_t *panic)
+{
+  for (size_t c = 0; c < P->chunks; c++)
+    {
+      if (P->panics[c].type)
+        {
+          *panic = P->panics[c];
+          return true;
+        }
+    }
+  return false;
+}
+
+static void *
+helper (void *arg)
+{
+  struct worker *w = arg;
+  struct misp_par *pool = w->pool;
+  uint64_t seen = 0;
+
+  pthread_mutex_lock (&pool->lock);
+  for (;;)
+    {
+      while (pool->calls == seen && !pool->closing)
+        {
+          pthread_cond_wait (&pool->wake, &pool->lock);
+        }
+      if (pool->closing)
+        {
+          break;
+        }
+      seen = pool->calls;
+      if (w->id >= pool->threads)
+        {
+          continue; // not needed for this call
+        }
+      pthread_mutex_unlock (&pool->lock);
+      work (w);
+      pthread_mutex_lock (&pool->lock);
+      if (!--pool->busy)
+        {
+          pthread_cond_signal (&pool->done);
+        }
+    }
+  pthread_mutex_unlock (&pool->lock);
+  return NULL;
+}
+
+// The pool of M, started on first use, NULL when out of memory.
+static struct misp_par *
+pool_get (misp_t *M)
+{
+  if (M->par)
+    {
+      return M->par;
+    }
+  size_t n = cpus ();
+  struct misp_par *pool
+      = calloc (1, sizeof (struct misp_par) + n * sizeof (struct worker));
+  pthread_t *tids = malloc (n * sizeof (pthread_t));
+  if (!pool || !tids)
+    {
+      free (pool);
+      free (tids);
+      return NULL;
+    }
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_cond_init (&pool->wake, NULL);
+  pthread_cond_init (&pool->done, NULL);
+  pool->tids = tids;
+  pool->size = n;
+  for (size_t i = 0; i < n; i++)
+    {
+      pool->workers[i].pool = pool;
+      pool->workers[i].id = i;
+    }
+
+  /* the helpers only speed things up, there may be fewer than cpus */
+  while (pool->helpers + 1 < n
+         && !pthread_create (&tids[pool->helpers + 1], NULL, helper,
+                             &pool->workers[pool->helpers + 1]))
+    {
+      pool->helpers++;
+    }
+  M->par = pool;
+  return pool;
+}
+
+// Runs the chunks of the call on its first threads workers.
+static void
+pool_run (struct misp_par *pool, size_t threads)
+{
+  if (threads > 1)
+    {
+      pthread_mutex_lock (&pool->lock);
+      pool->threads = threads;
+      pool->busy = threads - 1;
+      pool->calls++;
+      pthread_cond_broadcast (&pool->wake);
+      pthread_mutex_unlock (&pool->lock);
+    }
+
+  work (&pool->workers[0]);
+
+  if (threads > 1)
+    {
+      pthread_mutex_lock (&pool->lock);
+      while (pool->busy)
+        {
+          pthread_cond_wait (&pool->done, &pool->lock);
+        }
+      pthread_mutex_unlock (&pool->lock);
+    }
+}
+
+void
+misp_par_release (misp_t *M)
+{
+  struct misp_par *pool = M->par;
+  if (!pool)
+    {
+      return;
+    }
+  pthread_mutex_lock (&pool->lock);
+  pool->closing = true;
+  pthread_cond_broadcast (&pool->wake);
+  pthread_mutex_unlock (&pool->lock);
+  for (size_t i = 1; i <= pool->helpers; i++)
+    {
+      pthread_join (pool->tids[i], NULL);
+    }
+
+  for (size_t i = 0; i < pool->size; i++)
+    {
+      worker_free (&pool->workers[i]);
+    }
+  pthread_cond_destroy (&pool->done);
+  pthread_cond_destroy (&pool->wake);
+  pthread_mutex_destroy (&pool->lock);
+  free (pool->tids);
+  free (pool);
+  M->par = NULL;
+}
+
+void
+misp_par_step (misp_t *M, cell_t node, uint64_t opc)
+{
+  cell_t stack, list, init, body;
+  size_t params = opc == MISP_OPC_PMAP ? 2 : 3;
+  misp_env_stack (M, &stack);
+  if (LIST_LEN (stack) < params)
+    {
+      M->halted = true;
+      M->panic_code = (misp_panic_t){ MISP_PANIC_BAD_NODE_PARAMS, node };
+      return;
+    }
+
+  size_t len;
+  misp_env_get (M, &list, 0);
+  if (!IS_LIST (list))
+    {
+      M->halted = true;
+      M->panic_code = (misp_panic_t){ MISP_PANIC_TYPE_ERROR, node };
+      return;
+    }
+  len = LIST_LEN (list);
+  size_t chunks = (len + MISP_PAR_CHUNK - 1) / MISP_PAR_CHUNK;
+
+  /* A worker of pmap has no heap to take regions from and runs alone, on
+     a worker of its own */
+  struct worker alone = { 0 };
+  struct misp_par *pool = M->heap.starts ? pool_get (M) : NULL;
+  struct worker *workers = pool ? pool->workers : &alone;
+  size_t threads = 1;
+  if (pool)
+    {
+      threads = 1 + pool->helpers < chunks ? 1 + pool->helpers : chunks;
+    }
+
+  /* The regions of the workers come from the heap, or for a single one
+     from the free part of the frame region, which is all a worker has. */
+  cell_t regions;
+  if (threads > 1 && !misp_alloc (M, threads * REGION_SIZE, &regions))
+    {
+      threads = 1;
+    }
+  if (threads <= 1)
+    {
+      threads = 1;
+      if (!misp_env_top (M, &regions) || LIST_LEN (regions) <= 2)
+        {
+          M->halted = true;
+          M->panic_code
+              = (misp_panic_t){ MISP_PANIC_STACK_OVERFLOW, node };
+          return;
+        }
+    }
+  // the collection may have moved the params
+  misp_env_get (M, &list, 0);
+  misp_env_get (M, &init, 1);
+  misp_env_get (M, &body, params - 1);
+
+  struct par P = { opc, list, body, chunks };
+  atomic_init (&P.next, 0);
+  atomic_init (&P.stop, false);
+  P.values = malloc ((chunks + 1) * sizeof (cell_t));
+  P.panics = calloc (chunks + 1, sizeof (misp_panic_t));
+  if (!P.values || !P.panics)
+    {
+      free (P.values);
+      free (P.panics);
+      M->halted = true;
+      M->panic_code = (misp_panic_t){ MISP_PANIC_OUT_OF_MEMORY, node };
+      return;
+    }
+  for (size_t i = 0; i < threads; i++)
+    {
+      size_t size = threads > 1 ? REGION_SIZE : LIST_LEN (regions);
+      worker_init (&workers[i], &P, M, LIST_PTR (regions) + i * REGION_SIZE,
+                   size);
+    }
+
+  if (pool)
+    {
+      pool_run (pool, threads);
+    }
+  else
+    {
+      work (&alone);
+    }
+
+  misp_panic_t panic;
+  cell_t ret = list;
+  bool ok = !first_panic (&P, &panic);
+  if (ok && opc == MISP_OPC_PREDUCE)
+    {
+      ret = init;
+      for (size_t c = 0; ok && c < chunks; c++)
+        {
+          ok = fold (&workers[0], ret, P.values[c], &ret);
+        }
+      panic = workers[0].W.panic_code;
+    }
+
+  for (size_t i = 0; i < threads; i++)
+    {
+      struct worker *w = &workers[i];
+      misp_gc_join (M, &w->W);
+      if (M->bc && (!w->W.bc || w->bc->stale || w->bc->drops))
+        {
+          M->bc->stale = true;
+        }
+    }
+  if (!pool)
+    {
+      worker_free (&alone);
+    }
+  free (P.panics);
+  free (P.values);
+
+  if (!ok)
+    {
+      M->halted = true;
+      M->panic_code = panic;
+      return;
+    }
+  misp_env_ret (M, ret);
+}
@@ -25,160 +25,397 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct buf
+struct kw
 {
-  uint8_t *p;
-  size_t size;
-  size_t capacity;
+  const char *name;
+  uint64_t code;
 };
 
-static bool
-insert (struct buf *buf, cell_t c)
+/* Keywords by first char, the longest first when one is a prefix of
+   another so "<=" is not read as "<" and "=" */
+#define KWS(...)                                                              \
+  (const struct kw[])                                                         \
+  {                                                                           \
+    __VA_ARGS__, { NULL, 0 }                                                  \
+  }
+
+static const struct kw *const kws[128] = {
+  ['+'] = KWS ({ "+", MISP_OPC_NADD }),
+  ['-'] = KWS ({ "-", MISP_OPC_NSUB }),
+  ['/'] = KWS ({ "/", MISP_OPC_NDIV }),
+  ['*'] = KWS ({ "*", MISP_OPC_NMUL }),
+  ['%'] = KWS ({ "%", MISP_OPC_NMOD }),
+  ['#'] = KWS ({ "#", MISP_OPC_LLEN }),
+  ['='] = KWS ({ "=", MISP_OPC_EQ }),
+  ['>'] = KWS ({ ">=", MISP_OPC_NGRTEQ }, { ">", MISP_OPC_NGRT }),
+  ['<'] = KWS ({ "<=", MISP_OPC_NLSREQ }, { "<", MISP_OPC_NLSR }),
+  ['a'] = KWS ({ "alloc", MISP_OPC_ALLOC }, { "and", MISP_OPC_NAND }),
+  ['c'] = KWS ({ "cond", MISP_OPC_COND }),
+  ['d'] = KWS ({ "debug", MISP_OPC_DBUG }, { "do", MISP_OPC_DO }),
+  ['e'] = KWS ({ "eval", MISP_OPC_EVAL }),
+  ['g'] = KWS ({ "getl", MISP_OPC_LGET }, { "get", MISP_OPC_GET }),
+  ['h'] = KWS ({ "hnew", MISP_OPC_HNEW }, { "hget", MISP_OPC_HGET },
+               { "hset", MISP_OPC_HSET }, { "hdel", MISP_OPC_HDEL },
+               { "hlen", MISP_OPC_HLEN }),
+  ['i'] = KWS ({ "intersect", MISP_OPC_LINT }),
+  ['l'] = KWS ({ "lconcat", MISP_OPC_LCAT }, { "lcopy", MISP_OPC_LCOPY },
+               { "lfill", MISP_OPC_LFILL }, { "list", MISP_OPC_LNEW },
+               { "loop", MISP_OPC_LOOP }, { "let", MISP_OPC_LET }),
+  ['n'] = KWS ({ "not", MISP_OPC_NNOT }),
+  ['o'] = KWS ({ "or", MISP_OPC_NOR }),
+  ['p'] = KWS ({ "preduce", MISP_OPC_PREDUCE }, { "pmap", MISP_OPC_PMAP }),
+  ['q'] = KWS ({ "quote", MISP_OPC_QUOTE }),
+  ['r'] = KWS ({ "remainder", MISP_OPC_NREM }),
+  ['s'] = KWS ({ "sublist", MISP_OPC_LSUB }, { "setl", MISP_OPC_LSET },
+               { "set", MISP_OPC_SET }),
+  ['t'] = KWS ({ "tnew", MISP_OPC_TNEW }, { "tget", MISP_OPC_TGET },
+               { "tset", MISP_OPC_TSET }, { "tlen", MISP_OPC_TLEN }),
+  ['v'] = KWS ({ "vadd", MISP_OPC_VADD }, { "vsub", MISP_OPC_VSUB },
+               { "vmul", MISP_OPC_VMUL }, { "vsum", MISP_OPC_VSUM },
+               { "vmin", MISP_OPC_VMIN }, { "vmax", MISP_OPC_VMAX },
+               { "vdot", MISP_OPC_VDOT }),
+  ['w'] = KWS ({ "with-arena", MISP_OPC_ARENA }),
+  ['x'] = KWS ({ "xor", MISP_OPC_NXOR }),
+};
+
+const char *
+misp_opc_name (uint64_t opc)
 {
-  if (buf->size == buf->capacity)
+  for (int i = 0; i < 128; i++)
     {
-      buf->capacity = buf->capacity * 2;
-      buf->p = realloc (buf->p, CELL_SIZE * buf->capacity);
-      if (!buf->p)
+      for (const struct kw *kw = kws[i]; kw && kw->name; kw++)
         {
-          return false;
+          if (kw->code == opc)
+            {
+              return kw->name;
+            }
         }
     }
-
-  CELL_WRITE (&buf->p[buf->size * CELL_SIZE], c);
-  buf->size++;
-  return true;
+  return NULL;
 }
 
-struct kw
+#define NUMERAL(n) (n >= '0' && n <= '9')
+
+/* Input seen through the window [p, end[, refilled from stream if set */
+struct src
 {
-  const char *name;
-  uint64_t code;
+  const char *p;
+  const char *end;
+  FILE *stream;
+  char *buf;
 };
 
-static struct kw kws[] = { { "+", MISP_OPC_NADD },
-                           { "-", MISP_OPC_NSUB },
-                           { "/", MISP_OPC_NDIV },
-                           { "*", MISP_OPC_NMUL },
-                           { "%", MISP_OPC_NMOD },
-                           { "#", MISP_OPC_LLEN },
-                           { "remainder", MISP_OPC_NREM },
-                           { "sublist", MISP_OPC_LSUB },
-                           { "getl", MISP_OPC_LGET },
-                           { "setl", MISP_OPC_LSET },
-                           { "intersect", MISP_OPC_LINT },
-                           { "debug", MISP_OPC_DBUG },
-                           { "set", MISP_OPC_SET },
-                           { "get", MISP_OPC_GET },
-                           { "cond", MISP_OPC_COND },
-                           { "loop", MISP_OPC_LOOP },
-                           { "eval", MISP_OPC_EVAL },
-                           { "quote", MISP_OPC_QUOTE },
-                           { "do", MISP_OPC_DO },
-                           /* { "trap", MISP_OPC_TRAP }, */
-                           /* { "climb", MISP_OPC_CLIMB }, */
-                           { "=", MISP_OPC_EQ },
-                           { ">", MISP_OPC_NGRT },
-                           { "<", MISP_OPC_NLSR },
-                           { "<=", MISP_OPC_NLSREQ },
-                           { ">=", MISP_OPC_NGRTEQ },
-                           { "and", MISP_OPC_NAND },
-                           { "xor", MISP_OPC_NXOR },
-                           { "or", MISP_OPC_NOR },
-                           { "not", MISP_OPC_NNOT },
-                           { "let", MISP_OPC_LET },
-                           { NULL, 0 } };
+#define CHUNK_SIZE (1 << 16)
 
-#define NUMERAL(n) (n >= '0' && n <= '9')
+static void
+refill (struct src *src)
+{
+  size_t left = src->end - src->p;
+  memmove (src->buf, src->p, left);
+  size_t n = fread (src->buf + left, 1, CHUNK_SIZE - left, src->stream);
+  src->p = src->buf;
+  src->end = src->buf + left + n;
+  if (!n)
+    {
+      src->stream = NULL;
+    }
+}
 
-cell_t
-parse_num (const char **s)
+// The char i after p, EOF past the end of the input.
+static inline int
+peek (struct src *src, size_t i)
 {
-  return NUM (strtol (*s, s, 0));
+  if (src->p + i >= src->end && src->stream)
+    {
+      refill (src);
+    }
+  return src->p + i < src->end ? (unsigned char)src->p[i] : EOF;
 }
 
-cell_t
-parse_keyword (const char **s)
+static int
+skip_space (struct src *src)
 {
-  for (struct kw *kw = &kws[0]; kw->name; kw++)
+  int c;
+  while (isspace (c = peek (src, 0)))
     {
-      size_t kwlen = strlen (kw->name);
-      if (strncmp (kw->name, *s, kwlen) == 0)
-        {
-          *s += kwlen;
-          return NUM (kw->code);
-        }
+      src->p++;
     }
-  return NUM (66);
+  return c;
 }
 
-cell_t
-parse_list (const char **s, struct buf *buf)
+/* Cells are written from the start of mem, the elements of the lists still
+   open are kept on a stack growing down from the end. */
+struct out
 {
-  struct buf params;
-  params.capacity = 8;
-  params.size = 0;
-  params.p = calloc (params.capacity, CELL_SIZE);
+  uint8_t *mem;
+  size_t lo;
+  size_t hi;
+  size_t floor; /* lowest hi so far */
+};
 
-  while (**s)
+static bool
+push (struct out *out, cell_t c)
+{
+  if (out->lo == out->hi)
     {
-      if (**s == ')')
+      return false;
+    }
+  out->hi--;
+  if (out->hi < out->floor)
+    {
+      out->floor = out->hi;
+    }
+  CELL_WRITE (&out->mem[out->hi * CELL_SIZE], c);
+  return true;
+}
+
+// Moves the cells pushed since mark to the code, as a list.
+static bool
+pop_list (struct out *out, size_t mark, cell_t *list)
+{
+  size_t n = mark - out->hi;
+  if (out->lo + n > out->hi)
+    {
+      return false;
+    }
+  for (size_t i = 0; i < n; i++)
+    {
+      memcpy (&out->mem[(out->lo + i) * CELL_SIZE],
+              &out->mem[(mark - 1 - i) * CELL_SIZE], CELL_SIZE);
+    }
+  *list = LIST (n, out->lo);
+  out->lo += n;
+  out->hi = mark;
+  return true;
+}
+
+// Same as strtol with base 0.
+static cell_t
+read_num (struct src *src)
+{
+  bool neg = false;
+  uint64_t v = 0;
+  int base = 10;
+  int c = peek (src, 0);
+
+  if (c == '+' || c == '-')
+    {
+      neg = c == '-';
+      src->p++;
+    }
+  if (peek (src, 0) == '0' && tolower (peek (src, 1)) == 'x'
+      && isxdigit (peek (src, 2)))
+    {
+      base = 16;
+      src->p += 2;
+    }
+  else if (peek (src, 0) == '0')
+    {
+      base = 8;
+    }
+
+  for (;;)
+    {
+      int d;
+      c = peek (src, 0);
+      if (NUMERAL (c))
         {
-          (*s)++;
-          break;
+          d = c - '0';
         }
-      else if (**s == '(')
+      else if (isxdigit (c))
         {
-          (*s)++;
-          insert (&params, parse_list (s, buf));
+          d = tolower (c) - 'a' + 10;
         }
-      else if (isspace (**s))
+      else
         {
-          (*s)++;
-          continue;
+          break;
         }
-      else if (NUMERAL (**s)
-               || ((**s == '+' || **s == '-') && NUMERAL ((*s)[1])))
+      if (d >= base)
         {
-          insert (&params, parse_num (s));
+          break;
         }
-      else
+      v = v * base + d;
+      src->p++;
+    }
+  return NUM (neg ? -v : v);
+}
+
+static bool
+read_keyword (struct src *src, cell_t *c)
+{
+  int first = peek (src, 0);
+  if (first < 0 || first >= 128 || !kws[first])
+    {
+      return false;
+    }
+
+  for (const struct kw *kw = kws[first]; kw->name; kw++)
+    {
+      size_t i = 1;
+      while (kw->name[i] && peek (src, i) == (unsigned char)kw->name[i])
         {
-          insert (&params, parse_keyword (s));
+          i++;
+        }
+      if (!kw->name[i])
+        {
+          src->p += i;
+          *c = NUM (kw->code);
+          return true;
         }
     }
-  cell_t list = LIST (params.size, buf->size);
-  memcpy (&buf->p[buf->size * CELL_SIZE], params.p, params.size * CELL_SIZE);
-  buf->size += params.size;
-  free (params.p);
-  return list;
+  return false;
 }
 
-misp_parser_error_type_t
-misp_parse_string (const char *s, uint8_t *tree[], size_t *tree_size,
-                   cell_t *root)
+/* The lists are read without recursion: opening one saves the mark of the
+   enclosing list on the stack, under its elements. */
+static misp_parser_error_type_t
+parse (struct src *src, uint8_t *mem, size_t mem_size, size_t *code_size,
+       cell_t *root)
 {
-  struct buf buf;
-  buf.capacity = 4096;
-  buf.size = 0;
-  buf.p = calloc (buf.capacity, CELL_SIZE);
+  size_t cells = mem_size / CELL_SIZE;
+  struct out out = { mem, 0, cells, cells };
+  misp_parser_error_type_t err = MISP_PARSER_ERROR_OK;
+  size_t mark = cells, depth = 0;
+  int ch;
+
+  while ((ch = skip_space (src)) != EOF)
+    {
+      cell_t c;
+      if (ch == '(')
+        {
+          src->p++;
+          if (!push (&out, NUM (mark)))
+            {
+              err = MISP_PARSER_OUT_OF_MEMORY;
+              break;
+            }
+          mark = out.hi;
+          depth++;
+          continue;
+        }
+      else if (ch == ')')
+        {
+          cell_t saved;
+          src->p++;
+          if (!depth)
+            {
+              err = MISP_PARSER_INVALID;
+              break;
+            }
+          if (!pop_list (&out, mark, &c))
+            {
+              err = MISP_PARSER_OUT_OF_MEMORY;
+              break;
+            }
+          CELL_READ (&mem[out.hi++ * CELL_SIZE], &saved);
+          mark = NUM_VAL (saved);
+          depth--;
+        }
+      else if (NUMERAL (ch)
+               || ((ch == '+' || ch == '-') && NUMERAL (peek (src, 1))))
+        {
+          c = read_num (src);
+        }
+      else if (!read_keyword (src, &c))
+        {
+          err = MISP_PARSER_INVALID;
+          break;
+        }
+
+      if (!push (&out, c))
+        {
+          err = MISP_PARSER_OUT_OF_MEMORY;
+          break;
+        }
+    }
+  if (!err && depth)
+    {
+      err = MISP_PARSER_INVALID;
+    }
 
-  if (*s == '(')
+  /* The forms are chained as (do f1 (do f2 ... fn)), the last param of a
+     do is a tail call so they run in constant frame space */
+  *root = LIST_NULL;
+  if (!err && out.hi < cells)
     {
-      s++;
-      *root = parse_list (&s, &buf);
+      CELL_READ (&mem[out.hi++ * CELL_SIZE], root);
     }
-  else if (*s)
+  while (!err && out.hi < cells)
     {
-      *root = parse_num (&s);
+      cell_t c;
+      CELL_READ (&mem[out.hi++ * CELL_SIZE], &c);
+      if (out.lo + 3 > out.hi)
+        {
+          err = MISP_PARSER_OUT_OF_MEMORY;
+          break;
+        }
+      cell_t link[3] = { NUM (MISP_OPC_DO), c, *root };
+      for (int i = 0; i < 3; i++)
+        {
+          CELL_WRITE (&mem[(out.lo + i) * CELL_SIZE], link[i]);
+        }
+      *root = LIST (3, out.lo);
+      out.lo += 3;
     }
-  else
+
+  /* mem past the code is expected to be zeroed */
+  size_t used = out.floor > out.lo ? out.floor : out.lo;
+  memset (&mem[used * CELL_SIZE], 0, (cells - used) * CELL_SIZE);
+  *code_size = out.lo * CELL_SIZE;
+  return err;
+}
+
+misp_parser_error_type_t
+misp_parse_mem (const char *s, size_t len, uint8_t *mem, size_t mem_size,
+                size_t *code_size, cell_t *root)
+{
+  struct src src = { s, s + len, NULL, NULL };
+  return parse (&src, mem, mem_size, code_size, root);
+}
+
+misp_parser_error_type_t
+misp_parse_stream (FILE *f, uint8_t *mem, size_t mem_size, size_t *code_size,
+                   cell_t *root)
+{
+  struct src src;
+  src.buf = malloc (CHUNK_SIZE);
+  if (!src.buf)
     {
-      *root = LIST_NULL;
+      return MISP_PARSER_OUT_OF_MEMORY;
     }
+  src.p = src.end = src.buf;
+  src.stream = f;
+
+  misp_parser_error_type_t err = parse (&src, mem, mem_size, code_size, root);
+  free (src.buf);
+  return err;
+}
 
-  *tree = buf.p;
-  *tree_size = buf.size * CELL_SIZE;
+misp_parser_error_type_t
+misp_parse_string (const char *s, uint8_t *tree[], size_t *tree_size,
+                   cell_t *root)
+{
+  /* A single arena, made larger and parsed again in the rare case where
+     the code does not fit in a cell per char */
+  size_t len = strlen (s);
+  size_t size = (len + 64) * CELL_SIZE;
+  for (;;)
+    {
+      uint8_t *arena = malloc (size);
+      if (!arena)
+        {
+          return MISP_PARSER_OUT_OF_MEMORY;
+        }
 
-  return MISP_PARSER_ERROR_OK;
+      misp_parser_error_type_t err
+          = misp_parse_mem (s, len, arena, size, tree_size, root);
+      if (err != MISP_PARSER_OUT_OF_MEMORY)
+        {
+          uint8_t *code = realloc (arena, *tree_size ? *tree_size : 1);
+          *tree = code ? code : arena;
+          return err;
+        }
+      free (arena);
+      size *= 2;
+    }
 }
@@ -19,14 +19,25 @@
 #ifndef MISP_PARSER_H
 #define MISP_PARSER_H
 #include "misp.h"
+#include <stdio.h>
 
-typedef enum
-{
-  MISP_PARSER_ERROR_OK = 0,
-  MISP_PARSER_INVALID,
-} misp_parser_error_type_t;
+/* misp_parse_string and misp_parse_mem are declared in misp.h */
 
-misp_parser_error_type_t misp_parse_string (const char *s, uint8_t *tree[],
-                                            size_t *tree_size, cell_t *root);
+// Parses the stream f, reading it in chunks.
+misp_parser_error_type_t misp_parse_stream (FILE *f, uint8_t *mem,
+                                            size_t mem_size,
+                                            size_t *code_size, cell_t *root);
+
+// The keyword of the opcode opc, NULL if it has none.
+const char *misp_opc_name (uint64_t opc);
+
+/* Constant folding over parsed code: the pure nodes whose params are all
+   known, arithmetic, comparisons, # on a quoted list and cond on a known
+   condition, are replaced in place by their value. Nothing moves, so the
+   program must not read or write the cells of its own code. */
+
+// Folds the code of the first code_size bytes of mem reached from root,
+// root included. Returns the number of nodes eliminated.
+size_t misp_fold (uint8_t *mem, size_t code_size, cell_t *root);
 
 #endif
@@ -0,0 +1,418 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#include "profile.h"
+#include "defs.h"
+#include "misp.h"
+#include "parser.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Frames past this depth are dropped from the root side of a sample */
+#define MAX_SAMPLE_DEPTH 128
+
+/* A frame is named by the list pointer and the opcode of its node */
+#define FRAME_KEY(ptr, opc) ((uint64_t)(ptr) << 16 | (opc))
+#define KEY_PTR(k) ((k) >> 16)
+#define KEY_OPC(k) ((k) & 0xFFFF)
+#define OPC_OTHER 0xFFFF /* the node has no number for its op */
+
+#define OPCS 256
+
+struct count
+{
+  uint64_t key;
+  uint64_t samples; /* 0 for a free slot */
+};
+
+struct stack
+{
+  uint64_t hash;
+  size_t off; /* of its frames in the pool, leaf first */
+  size_t len;
+  uint64_t samples;
+};
+
+struct misp_profile
+{
+  uint64_t interval;
+  uint64_t phase; /* steps since the last sample */
+  uint64_t samples;
+  uint64_t dropped; /* samples that did not fit in memory */
+
+  uint64_t opcs[OPCS];
+
+  /* open addressing tables, at most half full */
+  struct count *nodes;
+  size_t nodes_size;
+  size_t nodes_capacity;
+
+  struct stack *stacks;
+  size_t stacks_size;
+  size_t stacks_capacity;
+
+  uint64_t *pool;
+  size_t pool_size;
+  size_t pool_capacity;
+};
+
+static inline uint64_t
+mix (uint64_t h, uint64_t k)
+{
+  h ^= k;
+  h *= 0x9E3779B97F4A7C15;
+  return h ^ (h >> 29);
+}
+
+misp_profile_t *
+misp_profile_new (uint64_t interval)
+{
+  misp_profile_t *P = calloc (1, sizeof (misp_profile_t));
+  if (P)
+    {
+      P->interval = interval ? interval : 1;
+    }
+  return P;
+}
+
+void
+misp_profile_free (misp_profile_t *P)
+{
+  if (P)
+    {
+      free (P->nodes);
+      free (P->stacks);
+      free (P->pool);
+      free (P);
+    }
+}
+
+static bool
+grow_nodes (misp_profile_t *P)
+{
+  size_t capacity = P->nodes_capacity ? P->nodes_capacity * 2 : 256;
+  struct count *nodes = calloc (capacity, sizeof (struct count));
+  if (!nodes)
+    {
+      return false;
+    }
+  for (size_t i = 0; i < P->nodes_capacity; i++)
+    {
+      if (P->nodes[i].samples)
+        {
+          size_t j = mix (0, P->nodes[i].key) & (capacity - 1);
+          while (nodes[j].samples)
+            {
+              j = (j + 1) & (capacity - 1);
+            }
+          nodes[j] = P->nodes[i];
+        }
+    }
+  free (P->nodes);
+  P->nodes = nodes;
+  P->nodes_capacity = capacity;
+  return true;
+}
+
+static bool
+grow_stacks (misp_profile_t *P)
+{
+  size_t capacity = P->stacks_capacity ? P->stacks_capacity * 2 : 256;
+  struct stack *stacks = calloc (capacity, sizeof (struct stack));
+  if (!stacks)
+    {
+      return false;
+    }
+  for (size_t i = 0; i < P->stacks_capacity; i++)
+    {
+      if (P->stacks[i].samples)
+        {
+          size_t j = P->stacks[i].hash & (capacity - 1);
+          while (stacks[j].samples)
+            {
+              j = (j + 1) & (capacity - 1);
+            }
+          stacks[j] = P->stacks[i];
+        }
+    }
+  free (P->stacks);
+  P->stacks = stacks;
+  P->stacks_capacity = capacity;
+  return true;
+}
+
+static bool
+count_node (misp_profile_t *P, uint64_t key)
+{
+  if ((P->nodes_size + 1) * 2 > P->nodes_capacity && !grow_nodes (P))
+    {
+      return false;
+    }
+  size_t mask = P->nodes_capacity - 1;
+  size_t i = mix (0, key) & mask;
+  while (P->nodes[i].samples && P->nodes[i].key != key)
+    {
+      i = (i + 1) & mask;
+    }
+  if (!P->nodes[i].samples)
+    {
+      P->nodes[i].key = key;
+      P->nodes_size++;
+    }
+  P->nodes[i].samples++;
+  return true;
+}
+
+static bool
+count_stack (misp_profile_t *P, const uint64_t *frames, size_t n,
+             uint64_t hash)
+{
+  if ((P->stacks_size + 1) * 2 > P->stacks_capacity && !grow_stacks (P))
+    {
+      return false;
+    }
+  size_t mask = P->stacks_capacity - 1;
+  size_t i = hash & mask;
+  for (; P->stacks[i].samples; i = (i + 1) & mask)
+    {
+      struct stack *s = &P->stacks[i];
+      if (s->hash == hash && s->len == n
+          && !memcmp (&P->pool[s->off], frames, n * sizeof (uint64_t)))
+        {
+          s->samples++;
+          return true;
+        }
+    }
+
+  if (P->pool_size + n > P->pool_capacity)
+    {
+      size_t capacity = P->pool_capacity ? P->pool_capacity * 2 : 4096;
+      while (P->pool_size + n > capacity)
+        {
+          capacity *= 2;
+        }
+      uint64_t *pool = realloc (P->pool, capacity * sizeof (uint64_t));
+      if (!pool)
+        {
+          return false;
+        }
+      P->pool = pool;
+      P->pool_capacity = capacity;
+    }
+  memcpy (&P->pool[P->pool_size], frames, n * sizeof (uint64_t));
+  P->stacks[i] = (struct stack){ hash, P->pool_size, n, 1 };
+  P->pool_size += n;
+  P->stacks_size++;
+  return true;
+}
+
+static uint64_t
+frame_key (misp_t *M, cell_t node)
+{
+  uint64_t opc = OPC_OTHER;
+  if (IS_LIST (node) && LIST_LEN (node)
+      && (LIST_PTR (node) + 1) * CELL_SIZE <= M->mem_size)
+    {
+      cell_t op;
+      misp_list_get (M, node, &op, 0);
+      if (IS_NUM (op) && (uint64_t)NUM_VAL (op) < OPC_OTHER)
+        {
+          opc = NUM_VAL (op);
+        }
+    }
+  return FRAME_KEY (LIST_PTR (node), opc);
+}
+
+static void
+sample (misp_t *M, misp_profile_t *P)
+{
+  uint64_t frames[MAX_SAMPLE_DEPTH];
+  uint64_t hash = 0;
+  size_t n = 0;
+  cell_t env = M->env;
+
+  /* the parents were flushed when their child began */
+  misp_env_flush (M);
+  while (LIST_LEN (env) && n < MAX_SAMPLE_DEPTH)
+    {
+      uint8_t *h = &M->mem[LIST_PTR (env) * CELL_SIZE];
+      cell_t node;
+      CELL_READ (h + FRAME_NODE * CELL_SIZE, &node);
+      CELL_READ (h + FRAME_PARENT * CELL_SIZE, &env);
+      frames[n] = frame_key (M, node);
+      hash = mix (hash, frames[n++]);
+    }
+  if (!n)
+    {
+      return;
+    }
+
+  P->samples++;
+  P->opcs[KEY_OPC (frames[0]) < OPCS ? KEY_OPC (frames[0]) : OPCS - 1]++;
+  if (!count_node (P, frames[0]) || !count_stack (P, frames, n, hash))
+    {
+      P->dropped++;
+    }
+}
+
+uint64_t
+misp_profile_run (misp_t *M, misp_profile_t *P, uint64_t max_steps)
+{
+  uint64_t steps = 0;
+  while (steps < max_steps && !M->halted)
+    {
+      uint64_t n = P->interval - P->phase;
+      if (n > max_steps - steps)
+        {
+          n = max_steps - steps;
+        }
+      uint64_t done = misp_run (M, n);
+      steps += done;
+      P->phase += done;
+      if (P->phase >= P->interval)
+        {
+          P->phase = 0;
+          if (!M->halted)
+            {
+              sample (M, P);
+            }
+        }
+      if (!done)
+        {
+          break;
+        }
+    }
+  return steps;
+}
+
+static void
+opc_name (uint64_t opc, char *buf, size_t size)
+{
+  const char *name = opc == OPC_OTHER ? "?" : misp_opc_name (opc);
+  if (name)
+    {
+      snprintf (buf, size, "%s", name);
+    }
+  else
+    {
+      snprintf (buf, size, "%lu", opc);
+    }
+}
+
+static void
+frame_name (uint64_t key, char *buf, size_t size)
+{
+  size_t n;
+  opc_name (KEY_OPC (key), buf, size);
+  n = strlen (buf);
+  snprintf (buf + n, size - n, "@%lu", KEY_PTR (key));
+}
+
+int
+misp_profile_write (const misp_profile_t *P, FILE *f)
+{
+  char name[64];
+  for (size_t i = 0; i < P->stacks_capacity; i++)
+    {
+      const struct stack *s = &P->stacks[i];
+      if (!s->samples)
+        {
+          continue;
+        }
+      for (size_t j = s->len; j-- > 0;)
+        {
+          frame_name (P->pool[s->off + j], name, sizeof (name));
+          fprintf (f, j ? "%s;" : "%s", name);
+        }
+      fprintf (f, " %lu\n", s->samples);
+    }
+  return ferror (f) ? -1 : 0;
+}
+
+static int
+by_samples (const void *a, const void *b)
+{
+  const struct count *x = a, *y = b;
+  return x->samples < y->samples ? 1 : x->samples > y->samples ? -1 : 0;
+}
+
+// Prints the top counts of n, sorting them.
+static void
+report_counts (const misp_profile_t *P, FILE *f, struct count *counts,
+               size_t n, size_t top, bool nodes)
+{
+  char name[64];
+  qsort (counts, n, sizeof (struct count), by_samples);
+  for (size_t i = 0; i < n && i < top && counts[i].samples; i++)
+    {
+      if (nodes)
+        {
+          frame_name (counts[i].key, name, sizeof (name));
+        }
+      else
+        {
+          opc_name (counts[i].key == OPCS - 1 ? OPC_OTHER : counts[i].key,
+                    name, sizeof (name));
+        }
+      fprintf (f, "  %-16s %14lu steps %5.1f%%\n", name,
+               counts[i].samples * P->interval,
+               100.0 * counts[i].samples / P->samples);
+    }
+}
+
+void
+misp_profile_report (const misp_profile_t *P, FILE *f, size_t top)
+{
+  fprintf (f, "PROFILE: %lu samples, one every %lu steps", P->samples,
+           P->interval);
+  if (P->dropped)
+    {
+      fprintf (f, ", %lu not kept", P->dropped);
+    }
+  fprintf (f, "\n");
+  if (!P->samples)
+    {
+      return;
+    }
+
+  struct count opcs[OPCS];
+  for (size_t i = 0; i < OPCS; i++)
+    {
+      opcs[i] = (struct count){ i, P->opcs[i] };
+    }
+  fprintf (f, " by opcode:\n");
+  report_counts (P, f, opcs, OPCS, top, false);
+
+  struct count *nodes = malloc (P->nodes_size * sizeof (struct count));
+  if (!nodes)
+    {
+      return;
+    }
+  size_t n = 0;
+  for (size_t i = 0; i < P->nodes_capacity; i++)
+    {
+      if (P->nodes[i].samples)
+        {
+          nodes[n++] = P->nodes[i];
+        }
+    }
+  fprintf (f, " by node:\n");
+  report_counts (P, f, nodes, n, top, true);
+  free (nodes);
+}
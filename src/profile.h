@@ -16,56 +16,34 @@
 /* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 /*************************************************************************/
 
-#ifndef MISP_H
-#define MISP_H
+#ifndef MISP_PROFILE_H
+#define MISP_PROFILE_H
 
-#include <stdbool.h>
-#include <stddef.h>
-#include <stdint.h>
+#include "misp.h"
+#include <stdio.h>
 
-typedef struct
-{
-  uint64_t dt;
-  uint8_t mt;
-} cell_t;
+/* Steps between two samples by default, a prime so loops do not alias */
+#define MISP_PROFILE_DEFAULT_INTERVAL 997
 
-typedef enum
-{
-  MISP_PANIC_NO = 0,
-  MISP_PANIC_TYPE_ERROR = 1,
-  MISP_PANIC_OUT_OF_BOUNDS = 2,
-  MISP_PANIC_INVALID_OPC = 3,
-  MISP_PANIC_BAD_NODE = 4,
-  MISP_PANIC_BAD_NODE_PARAMS = 5,
-} misp_panic_type_t;
+typedef struct misp_profile misp_profile_t;
 
-typedef struct
-{
-  misp_panic_type_t type;
-  cell_t node;
-} misp_panic_t;
+// Makes a profile sampling every interval steps, NULL when out of memory.
+misp_profile_t *misp_profile_new (uint64_t interval);
 
-typedef struct
-{
-  /* MEMORY */
-  uint8_t *mem;
-  size_t mem_size;
+void misp_profile_free (misp_profile_t *P);
 
-  /* CONTROL FLOW */
-  cell_t env;
-  bool trapped;
-  bool halted;
+// Same as misp_run, with a sample of M taken every interval steps: the node
+// being evaluated, its opcode and the nodes of the env frame chain. Each
+// sample stands for interval steps. The bytecode engine only has frames
+// for the nodes it did not inline, their steps are counted in the frame.
+uint64_t misp_profile_run (misp_t *M, misp_profile_t *P, uint64_t max_steps);
 
-  misp_panic_t panic_code;
-} misp_t;
+// Writes the samples as folded stacks, a "root;...;leaf samples" line per
+// distinct stack as taken by flamegraph.pl. Nodes are named by their
+// keyword and list pointer, e.g. "loop@120".
+int misp_profile_write (const misp_profile_t *P, FILE *f);
 
-void misp_init (misp_t *M, uint8_t *mem, size_t mem_size, cell_t init);
-
-void misp_execute (misp_t *M);
-
-// NOTE: Need automatic garbage collector in order to ensure safety. A free
-// keyword cannot be implemented, because we cannot be sure that there are no
-// references to list, unless reference counted
-void misp_gc (misp_t *M);
+// Prints the steps by opcode and the top hottest nodes.
+void misp_profile_report (const misp_profile_t *P, FILE *f, size_t top);
 
 #endif
@@ -0,0 +1,144 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#include "trace.h"
+#include "defs.h"
+#include "misp.h"
+#include "parser.h"
+#include <stdlib.h>
+#include <string.h>
+
+misp_trace_t *
+misp_trace_new (size_t capacity, FILE *f)
+{
+  misp_trace_t *T = calloc (1, sizeof (misp_trace_t));
+  size_t n = 1;
+  while (n < capacity)
+    {
+      n *= 2;
+    }
+  if (!T || !(T->records = malloc (n * sizeof (misp_trace_record_t))))
+    {
+      free (T);
+      return NULL;
+    }
+  T->capacity = n;
+  T->f = f;
+  if (f)
+    {
+      misp_trace_header_t h = { MISP_TRACE_MAGIC, MISP_TRACE_VERSION,
+                                CELL_SIZE, LIST_PTR_BITS };
+      fwrite (&h, sizeof (h), 1, f);
+    }
+  return T;
+}
+
+void
+misp_trace_free (misp_trace_t *T)
+{
+  if (T)
+    {
+      misp_trace_flush (T);
+      free (T->records);
+      free (T);
+    }
+}
+
+int
+misp_trace_flush (misp_trace_t *T)
+{
+  if (!T->f)
+    {
+      return 0;
+    }
+  /* at most a ring of records is pending, in up to two runs */
+  while (T->flushed < T->count)
+    {
+      size_t i = T->flushed & (T->capacity - 1);
+      size_t n = T->count - T->flushed;
+      if (n > T->capacity - i)
+        {
+          n = T->capacity - i;
+        }
+      if (fwrite (&T->records[i], sizeof (misp_trace_record_t), n, T->f)
+          != n)
+        {
+          return -1;
+        }
+      T->flushed += n;
+    }
+  return fflush (T->f) ? -1 : 0;
+}
+
+void
+misp_trace_print (misp_t *M, const misp_trace_record_t *r, size_t code)
+{
+  const char *name
+      = r->opc == MISP_TRACE_NO_OPC ? "?" : misp_opc_name (r->opc);
+  printf ("%10lu env +%-5lu stack %-5u %-10s ", r->step, (uint64_t)r->env,
+          r->stack, name ? name : "");
+  if (r->len && (uint64_t)r->node + r->len <= code)
+    {
+      misp_debug (M, LIST (r->len, r->node));
+    }
+  else
+    {
+      /* the node was built while running, its cells are gone */
+      printf ("%u:0x%lx", r->len, (uint64_t)r->node);
+    }
+  printf ("\n");
+}
+
+void
+misp_trace_print_last (misp_t *M, const misp_trace_t *T, size_t n,
+                       size_t code)
+{
+  uint64_t first = T->count > n ? T->count - n : 0;
+  if (T->count - first > T->capacity)
+    {
+      first = T->count - T->capacity;
+    }
+  for (uint64_t i = first; i < T->count; i++)
+    {
+      misp_trace_print (M, &T->records[i & (T->capacity - 1)], code);
+    }
+}
+
+int
+misp_trace_decode (misp_t *M, FILE *f, size_t code)
+{
+  misp_trace_header_t h;
+  misp_trace_record_t r[256];
+  size_t n;
+
+  if (fread (&h, sizeof (h), 1, f) != 1
+      || memcmp (h.magic, MISP_TRACE_MAGIC, sizeof (h.magic))
+      || h.version != MISP_TRACE_VERSION || h.cell_size != CELL_SIZE
+      || h.list_ptr_bits != LIST_PTR_BITS)
+    {
+      return -1;
+    }
+  while ((n = fread (r, sizeof (misp_trace_record_t), 256, f)))
+    {
+      for (size_t i = 0; i < n; i++)
+        {
+          misp_trace_print (M, &r[i], code);
+        }
+    }
+  return 0;
+}
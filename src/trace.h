@@ -0,0 +1,128 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#ifndef MISP_TRACE_H
+#define MISP_TRACE_H
+
+#include "defs.h"
+#include "misp.h"
+#include "vm.h"
+#include <stdio.h>
+
+/* A trace records every step of the tree walker in a ring of fixed size
+   records, written out to a file each time the ring fills up. Files start
+   with a header and are only decoded by the build that wrote them, against
+   the code of the same program. */
+
+#define MISP_TRACE_MAGIC "MISPTRC"
+#define MISP_TRACE_VERSION 2
+#define MISP_TRACE_DEFAULT_CAPACITY (1 << 16)
+
+#define MISP_TRACE_NO_OPC 0xFFFF
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t cell_size;
+  uint32_t list_ptr_bits;
+} misp_trace_header_t;
+
+/* Cell indices take the width of list pointers */
+#ifdef MISP_WIDE_LISTS
+typedef uint64_t misp_trace_ptr_t;
+#else
+typedef uint32_t misp_trace_ptr_t;
+#endif
+
+typedef struct
+{
+  uint64_t step;         /* counted from the start of the trace */
+  misp_trace_ptr_t node; /* list pointer of the node stepped */
+  uint32_t len;          /* and its length */
+  uint16_t opc;          /* MISP_TRACE_NO_OPC if not a number */
+  uint16_t stack;        /* values on the stack of the frame, at most
+                            0xFFFF */
+  misp_trace_ptr_t env;  /* cells from the bottom of the frame region */
+} misp_trace_record_t;
+
+struct misp_trace
+{
+  misp_trace_record_t *records;
+  size_t capacity; /* a power of two */
+  uint64_t count;   /* records taken */
+  uint64_t flushed; /* records written to f */
+  FILE *f;
+};
+
+typedef struct misp_trace misp_trace_t;
+
+// Makes a trace keeping the last capacity records, rounded up to a power of
+// two. When f is set, it gets the header now and the records later. NULL
+// when out of memory.
+misp_trace_t *misp_trace_new (size_t capacity, FILE *f);
+
+// Flushes T and frees it, f is left open.
+void misp_trace_free (misp_trace_t *T);
+
+// Writes the records not written yet to f.
+int misp_trace_flush (misp_trace_t *T);
+
+// Records the step the tree walker is about to do.
+static inline void
+misp_trace_step (misp_t *M)
+{
+  misp_trace_t *T = M->trace;
+  misp_trace_record_t *r = &T->records[T->count & (T->capacity - 1)];
+  cell_t node = M->frame.node, op;
+  size_t stack = LIST_LEN (M->frame.stack);
+
+  r->step = T->count++;
+  r->node = LIST_PTR (node);
+  r->len = IS_LIST (node) ? LIST_LEN (node) : 0;
+  r->opc = MISP_TRACE_NO_OPC;
+  if (r->len)
+    {
+      misp_list_get (M, node, &op, 0);
+      if (IS_NUM (op) && (uint64_t)NUM_VAL (op) < MISP_TRACE_NO_OPC)
+        {
+          r->opc = NUM_VAL (op);
+        }
+    }
+  r->stack = stack < 0xFFFF ? stack : 0xFFFF;
+  r->env = LIST_PTR (M->env) - LIST_PTR (M->frames);
+
+  if (T->f && T->count - T->flushed == T->capacity)
+    {
+      misp_trace_flush (T);
+    }
+}
+
+// Prints r, with its node as misp_debug does when it lies in the code, the
+// code cells of M below code.
+void misp_trace_print (misp_t *M, const misp_trace_record_t *r, size_t code);
+
+// Prints the last n records still in the ring of T.
+void misp_trace_print_last (misp_t *M, const misp_trace_t *T, size_t n,
+                            size_t code);
+
+// Prints every record of the trace file f, recorded while running the
+// program loaded in M. Returns -1 if f is not a trace of this build.
+int misp_trace_decode (misp_t *M, FILE *f, size_t code);
+
+#endif
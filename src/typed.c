@@ -0,0 +1,500 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#include "bytecode.h"
+#include "defs.h"
+#include "gc.h"
+#include "misp.h"
+#include "opc.h"
+#include "vm.h"
+#include <string.h>
+
+/* Typed arrays of numbers, packed in the cells of a list:
+
+     (tnew bits len)  a new array of len zeros: u8 numbers with bits 8, i16,
+                      i32 or i64 numbers with bits 16, 32 or 64
+     (tget arr i)     the number at i
+     (tset arr i n)   stores n at i, cut down to the width, returns n
+     (tlen arr)       the number of numbers
+
+   The numbers lie back to back in the bits of number cells, 64 bits a
+   cell with packed cells and 63 with tagged ones, where a number may run
+   over to the next cell. The collector only sees number cells. An array
+   is a heap object
+
+     tag, len, cells of the numbers
+
+   and the list of the cells of the numbers. The tag is an empty list
+   pointing past LIST_MAX_MEM, which no program can make or reach, so the
+   two cells before a list tell if it is an array. getl, setl and sublist
+   see the cells, lfill, lcopy, lconcat and the vector ops see the numbers.
+   An empty array keeps one cell, the collector drops empty lists. */
+
+#define TAG_PTR(kind) (LIST_MAX_MEM + 1 + (kind))
+
+#ifdef MISP_CELL_TAGGED
+#define RAW_BITS 63
+#else
+#define RAW_BITS 64
+#endif
+
+#define RAW_MASK (~(uint64_t)0 >> (64 - RAW_BITS))
+
+static inline cell_t
+at (misp_t *M, size_t i)
+{
+  cell_t c;
+  CELL_READ (&M->mem[i * CELL_SIZE], &c);
+  return c;
+}
+
+static inline uint64_t
+raw_at (misp_t *M, size_t i)
+{
+  return (uint64_t)NUM_VAL (at (M, i)) & RAW_MASK;
+}
+
+// Writes the bits r to the cell i, which holds a number: no barrier.
+static inline void
+raw_put (misp_t *M, size_t i, uint64_t r)
+{
+  cell_t c = NUM (r);
+  CELL_WRITE (&M->mem[i * CELL_SIZE], c);
+}
+
+static inline size_t
+cells_for (size_t len, unsigned bits)
+{
+  size_t cells = (len * bits + RAW_BITS - 1) / RAW_BITS;
+  return cells ? cells : 1;
+}
+
+static inline uint64_t
+bits_mask (unsigned bits)
+{
+  return bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+}
+
+static inline int64_t
+extend (uint64_t v, unsigned bits)
+{
+  if (bits == 8 || bits == 64)
+    {
+      return v;
+    }
+  return (int64_t)(v << (64 - bits)) >> (64 - bits);
+}
+
+bool
+misp_typed_of (misp_t *M, cell_t list, struct misp_typed *t)
+{
+  if (!IS_LIST (list) || LIST_PTR (list) < 2)
+    {
+      return false;
+    }
+  cell_t tag = at (M, LIST_PTR (list) - 2), len = at (M, LIST_PTR (list) - 1);
+  if (!IS_LIST (tag) || LIST_LEN (tag) || LIST_PTR (tag) < TAG_PTR (0)
+      || !IS_NUM (len))
+    {
+      return false;
+    }
+  t->p = LIST_PTR (list);
+  t->len = NUM_VAL (len);
+  t->bits = 8 << (LIST_PTR (tag) - TAG_PTR (0));
+  return LIST_LEN (list) == cells_for (t->len, t->bits);
+}
+
+int64_t
+misp_typed_get (misp_t *M, const struct misp_typed *t, size_t i)
+{
+  size_t w = t->bits, b = i * w, c = t->p + b / RAW_BITS, o = b % RAW_BITS;
+  uint64_t v = raw_at (M, c) >> o;
+  if (o + w > RAW_BITS)
+    {
+      v |= raw_at (M, c + 1) << (RAW_BITS - o);
+    }
+  return extend (v & bits_mask (w), w);
+}
+
+void
+misp_typed_set (misp_t *M, const struct misp_typed *t, size_t i, int64_t n)
+{
+  size_t w = t->bits, b = i * w, c = t->p + b / RAW_BITS, o = b % RAW_BITS;
+  uint64_t m = bits_mask (w), v = n & m;
+  raw_put (M, c, ((raw_at (M, c) & ~(m << o)) | v << o) & RAW_MASK);
+  if (o + w > RAW_BITS)
+    {
+      size_t s = RAW_BITS - o;
+      raw_put (M, c + 1, (raw_at (M, c + 1) & ~(m >> s)) | v >> s);
+    }
+}
+
+/* Whole cells at once where the numbers do not run over, that is with
+   packed cells. The widths are spelled out for the loops to unroll. */
+
+static inline void
+unpack (misp_t *M, size_t c, size_t cells, unsigned bits, int64_t *out)
+{
+  size_t per = RAW_BITS / bits;
+  for (size_t k = 0; k < cells; k++)
+    {
+      uint64_t r = raw_at (M, c + k);
+      for (size_t o = 0; o < per; o++)
+        {
+          uint64_t v = (r >> (o * bits)) & bits_mask (bits);
+          out[k * per + o] = extend (v, bits);
+        }
+    }
+}
+
+static inline void
+pack (misp_t *M, size_t c, size_t cells, unsigned bits, const int64_t *in)
+{
+  size_t per = RAW_BITS / bits;
+  for (size_t k = 0; k < cells; k++)
+    {
+      uint64_t r = 0;
+      for (size_t o = 0; o < per; o++)
+        {
+          r |= ((uint64_t)in[k * per + o] & bits_mask (bits)) << (o * bits);
+        }
+      raw_put (M, c + k, r);
+    }
+}
+
+void
+misp_typed_load (misp_t *M, const struct misp_typed *t, size_t i, size_t n,
+                 int64_t *out)
+{
+  size_t j = 0;
+  if (RAW_BITS % t->bits == 0)
+    {
+      size_t per = RAW_BITS / t->bits, cells;
+      for (; j < n && (i + j) % per; j++)
+        {
+          out[j] = misp_typed_get (M, t, i + j);
+        }
+      cells = (n - j) / per;
+      switch (t->bits)
+        {
+        case 8:
+          unpack (M, t->p + (i + j) / per, cells, 8, &out[j]);
+          break;
+        case 16:
+          unpack (M, t->p + (i + j) / per, cells, 16, &out[j]);
+          break;
+        case 32:
+          unpack (M, t->p + (i + j) / per, cells, 32, &out[j]);
+          break;
+        default:
+          unpack (M, t->p + (i + j) / per, cells, 64, &out[j]);
+          break;
+        }
+      j += cells * per;
+    }
+  for (; j < n; j++)
+    {
+      out[j] = misp_typed_get (M, t, i + j);
+    }
+}
+
+void
+misp_typed_store (misp_t *M, const struct misp_typed *t, size_t i, size_t n,
+                  const int64_t *in)
+{
+  size_t j = 0;
+  if (RAW_BITS % t->bits == 0)
+    {
+      size_t per = RAW_BITS / t->bits, cells;
+      for (; j < n && (i + j) % per; j++)
+        {
+          misp_typed_set (M, t, i + j, in[j]);
+        }
+      cells = (n - j) / per;
+      switch (t->bits)
+        {
+        case 8:
+          pack (M, t->p + (i + j) / per, cells, 8, &in[j]);
+          break;
+        case 16:
+          pack (M, t->p + (i + j) / per, cells, 16, &in[j]);
+          break;
+        case 32:
+          pack (M, t->p + (i + j) / per, cells, 32, &in[j]);
+          break;
+        default:
+          pack (M, t->p + (i + j) / per, cells, 64, &in[j]);
+          break;
+        }
+      j += cells * per;
+    }
+  for (; j < n; j++)
+    {
+      misp_typed_set (M, t, i + j, in[j]);
+    }
+}
+
+// Copies n numbers from s at si to d at di, the two arrays may differ.
+static void
+typed_move (misp_t *M, const struct misp_typed *d, size_t di,
+            const struct misp_typed *s, size_t si, size_t n)
+{
+  int64_t buf[256];
+  for (size_t i = 0; i < n; i += 256)
+    {
+      size_t c = n - i < 256 ? n - i : 256;
+      misp_typed_load (M, s, si + i, c, buf);
+      misp_typed_store (M, d, di + i, c, buf);
+    }
+}
+
+static misp_panic_type_t
+typed_new (misp_t *M, uint64_t bits, uint64_t len, cell_t *ret)
+{
+  if (bits != 8 && bits != 16 && bits != 32 && bits != 64)
+    {
+      return MISP_PANIC_TYPE_ERROR;
+    }
+  if (len > (LIST_MAX_LEN - 2) / bits * RAW_BITS
+      || !misp_alloc (M, 2 + cells_for (len, bits), ret))
+    {
+      return MISP_PANIC_OUT_OF_MEMORY;
+    }
+  size_t p = LIST_PTR (*ret);
+  cell_t tag = LIST (0, TAG_PTR (__builtin_ctzll (bits) - 3));
+  CELL_WRITE (&M->mem[p * CELL_SIZE], tag);
+  raw_put (M, p + 1, len);
+  *ret = LIST (cells_for (len, bits), p + 2);
+  return MISP_PANIC_NO;
+}
+
+misp_panic_type_t
+misp_typed_fill (misp_t *M, const struct misp_typed *t, cell_t c)
+{
+  if (!IS_NUM (c))
+    {
+      return MISP_PANIC_TYPE_ERROR;
+    }
+
+  /* whole cells at once where the numbers do not run over */
+  size_t i = 0;
+  if (RAW_BITS % t->bits == 0)
+    {
+      uint64_t v = NUM_VAL (c) & bits_mask (t->bits), r = 0;
+      for (size_t j = 0; j < RAW_BITS; j += t->bits)
+        {
+          r |= v << j;
+        }
+      size_t full = t->len * t->bits / RAW_BITS;
+      for (size_t j = 0; j < full; j++)
+        {
+          raw_put (M, t->p + j, r);
+        }
+      i = full * RAW_BITS / t->bits;
+    }
+  for (; i < t->len; i++)
+    {
+      misp_typed_set (M, t, i, NUM_VAL (c));
+    }
+  return MISP_PANIC_NO;
+}
+
+misp_panic_type_t
+misp_typed_copy (misp_t *M, cell_t dst, cell_t src)
+{
+  struct misp_typed d, s;
+  bool dt = misp_typed_of (M, dst, &d), st = misp_typed_of (M, src, &s);
+  size_t n = st ? s.len : LIST_LEN (src);
+  if (n > (dt ? d.len : LIST_LEN (dst)))
+    {
+      return MISP_PANIC_OUT_OF_BOUNDS;
+    }
+
+  size_t i = 0;
+  if (dt && st && d.bits == s.bits)
+    {
+      // the cells both arrays fill whole are copied as they are
+      size_t full = n * d.bits / RAW_BITS;
+      memmove (&M->mem[d.p * CELL_SIZE], &M->mem[s.p * CELL_SIZE],
+               full * CELL_SIZE);
+      i = full * RAW_BITS / d.bits;
+    }
+  if (dt && st)
+    {
+      typed_move (M, &d, i, &s, i, n - i);
+      return MISP_PANIC_NO;
+    }
+  for (; i < n; i++)
+    {
+      cell_t c = st ? NUM (misp_typed_get (M, &s, i))
+                    : at (M, LIST_PTR (src) + i);
+      if (!dt)
+        {
+          misp_list_set (M, dst, c, i);
+        }
+      else if (!IS_NUM (c))
+        {
+          return MISP_PANIC_TYPE_ERROR;
+        }
+      else
+        {
+          misp_typed_set (M, &d, i, NUM_VAL (c));
+        }
+    }
+  return MISP_PANIC_NO;
+}
+
+misp_panic_type_t
+misp_typed_cat (misp_t *M, size_t args, size_t k, cell_t *ret)
+{
+  struct misp_typed t;
+  unsigned bits = 0;
+  bool typed = true;
+  size_t len = 0;
+  for (size_t i = 0; i < k; i++)
+    {
+      cell_t list = at (M, args + i);
+      if (!misp_typed_of (M, list, &t))
+        {
+          typed = false;
+          len += LIST_LEN (list);
+          continue;
+        }
+      typed = typed && (!bits || bits == t.bits);
+      bits = t.bits;
+      len += t.len;
+    }
+
+  /* arrays of one width make an array, anything else a list */
+  misp_panic_type_t type = MISP_PANIC_NO;
+  if (typed)
+    {
+      type = typed_new (M, bits, len, ret);
+    }
+  else if (len > LIST_MAX_LEN || !misp_alloc (M, len, ret))
+    {
+      type = MISP_PANIC_OUT_OF_MEMORY;
+    }
+  if (type)
+    {
+      return type;
+    }
+
+  // the collection may have moved the lists
+  struct misp_typed r;
+  misp_typed_of (M, *ret, &r);
+  len = 0;
+  for (size_t i = 0; i < k; i++)
+    {
+      cell_t list = at (M, args + i);
+      if (typed)
+        {
+          misp_typed_of (M, list, &t);
+          typed_move (M, &r, len, &t, 0, t.len);
+          len += t.len;
+        }
+      else if (misp_typed_of (M, list, &t))
+        {
+          for (size_t j = 0; j < t.len; j++)
+            {
+              cell_t c = NUM (misp_typed_get (M, &t, j));
+              CELL_WRITE (&M->mem[(LIST_PTR (*ret) + len + j) * CELL_SIZE],
+                          c);
+            }
+          len += t.len;
+        }
+      else
+        {
+          memcpy (&M->mem[(LIST_PTR (*ret) + len) * CELL_SIZE],
+                  &M->mem[LIST_PTR (list) * CELL_SIZE],
+                  LIST_LEN (list) * CELL_SIZE);
+          len += LIST_LEN (list);
+        }
+    }
+  return MISP_PANIC_NO;
+}
+
+misp_panic_type_t
+misp_typed_op (misp_t *M, uint64_t opc, size_t args, size_t k, cell_t *ret)
+{
+  static const size_t params[] = {
+    [MISP_OPC_TNEW - MISP_OPC_TNEW] = 2,
+    [MISP_OPC_TGET - MISP_OPC_TNEW] = 2,
+    [MISP_OPC_TSET - MISP_OPC_TNEW] = 3,
+    [MISP_OPC_TLEN - MISP_OPC_TNEW] = 1,
+  };
+  if (k < params[opc - MISP_OPC_TNEW])
+    {
+      return MISP_PANIC_BAD_NODE_PARAMS;
+    }
+  cell_t a = at (M, args), i = at (M, args + 1);
+  if (opc == MISP_OPC_TNEW)
+    {
+      if (!IS_NUM (a) || !IS_NUM (i))
+        {
+          return MISP_PANIC_TYPE_ERROR;
+        }
+      return typed_new (M, NUM_VAL (a), NUM_VAL (i), ret);
+    }
+
+  struct misp_typed t;
+  if (!misp_typed_of (M, a, &t) || (opc != MISP_OPC_TLEN && !IS_NUM (i)))
+    {
+      return MISP_PANIC_TYPE_ERROR;
+    }
+  if (opc != MISP_OPC_TLEN && (uint64_t)NUM_VAL (i) >= t.len)
+    {
+      return MISP_PANIC_OUT_OF_BOUNDS;
+    }
+  switch (opc)
+    {
+    case MISP_OPC_TGET:
+      *ret = NUM (misp_typed_get (M, &t, NUM_VAL (i)));
+      return MISP_PANIC_NO;
+    case MISP_OPC_TSET:
+      {
+        cell_t n = at (M, args + 2);
+        if (!IS_NUM (n))
+          {
+            return MISP_PANIC_TYPE_ERROR;
+          }
+        misp_typed_set (M, &t, NUM_VAL (i), NUM_VAL (n));
+        *ret = n;
+      }
+      return MISP_PANIC_NO;
+    default:
+      *ret = NUM (t.len);
+      return MISP_PANIC_NO;
+    }
+}
+
+void
+misp_typed_step (misp_t *M, cell_t node, uint64_t opc)
+{
+  cell_t stack, ret;
+  misp_env_stack (M, &stack);
+  misp_panic_type_t type
+      = misp_typed_op (M, opc, LIST_PTR (stack), LIST_LEN (stack), &ret);
+  if (type)
+    {
+      M->halted = true;
+      M->panic_code = (misp_panic_t){ type, node };
+      return;
+    }
+  misp_env_ret (M, ret);
+}
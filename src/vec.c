@@ -0,0 +1,601 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#include "bytecode.h"
+#include "defs.h"
+#include "misp.h"
+#include "opc.h"
+#include "vm.h"
+
+#if defined(MISP_CELL_TAGGED) && defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define MISP_VEC_AVX2 1
+#endif
+
+/* Vector ops over lists of numbers, each in a single step:
+
+     (vadd dst a b) (vsub dst a b) (vmul dst a b)
+       write a[i] op b[i] to dst[i] and return dst, which may be a or b
+     (vsum a) (vmin a) (vmax a) (vdot a b)
+       return a number
+
+   The lists must have the same length. The types are checked on the way,
+   a list found in a vector panics the VM, after dst was partly written
+   with numbers.
+
+   With tagged cells a vector is an array of words whose low bit is clear
+   and adding the words adds the numbers, so the kernels work on the words
+   directly: plain loops, or AVX2 when the CPU has it. Packed cells are read
+   and written one by one. Typed arrays are read and written number by
+   number, they may be mixed with lists. */
+
+/* Vectors go by chunks of CHUNK numbers */
+
+#define CHUNK 256
+
+#ifdef MISP_CELL_TAGGED
+
+typedef uint64_t word_t;
+
+/* (a >> 1) * b is the word of the product. The shift may as well be
+   logical: the sign bit it drops is multiplied by an even b. */
+#define MUL_WORD(a, b) (((a) >> 1) * (b))
+
+/* The binary kernels write a chunk of d only once the words of a and b
+   were all found to be numbers */
+
+static bool
+binary_words (uint64_t opc, word_t *d, const word_t *a, const word_t *b,
+              size_t n)
+{
+  word_t tags = 0;
+  for (size_t i = 0; i < n; i++)
+    {
+      tags |= a[i] | b[i];
+    }
+  if (tags & 1)
+    {
+      return false;
+    }
+  switch (opc)
+    {
+    case MISP_OPC_VADD:
+      for (size_t i = 0; i < n; i++)
+        {
+          d[i] = a[i] + b[i];
+        }
+      break;
+    case MISP_OPC_VSUB:
+      for (size_t i = 0; i < n; i++)
+        {
+          d[i] = a[i] - b[i];
+        }
+      break;
+    case MISP_OPC_VMUL:
+      for (size_t i = 0; i < n; i++)
+        {
+          d[i] = MUL_WORD (a[i], b[i]);
+        }
+      break;
+    }
+  return true;
+}
+
+static bool
+reduce_words (uint64_t opc, const word_t *a, const word_t *b, size_t n,
+              cell_t *ret)
+{
+  word_t tags = 0, r = 0;
+  switch (opc)
+    {
+    case MISP_OPC_VSUM:
+      for (size_t i = 0; i < n; i++)
+        {
+          tags |= a[i];
+          r += a[i];
+        }
+      break;
+    case MISP_OPC_VDOT:
+      for (size_t i = 0; i < n; i++)
+        {
+          tags |= a[i] | b[i];
+          r += MUL_WORD (a[i], b[i]);
+        }
+      break;
+    case MISP_OPC_VMIN:
+      r = n ? a[0] : 0;
+      for (size_t i = 0; i < n; i++)
+        {
+          tags |= a[i];
+          r = (int64_t)a[i] < (int64_t)r ? a[i] : r;
+        }
+      break;
+    case MISP_OPC_VMAX:
+      r = n ? a[0] : 0;
+      for (size_t i = 0; i < n; i++)
+        {
+          tags |= a[i];
+          r = (int64_t)a[i] > (int64_t)r ? a[i] : r;
+        }
+      break;
+    }
+  ret->w = r;
+  return !(tags & 1);
+}
+
+#ifdef MISP_VEC_AVX2
+
+#define AVX2 __attribute__ ((target ("avx2")))
+
+static inline AVX2 __m256i
+mullo (__m256i x, __m256i y)
+{
+  __m256i lo = _mm256_mul_epu32 (x, y);
+  __m256i cross
+      = _mm256_add_epi64 (_mm256_mul_epu32 (_mm256_srli_epi64 (x, 32), y),
+                          _mm256_mul_epu32 (x, _mm256_srli_epi64 (y, 32)));
+  return _mm256_add_epi64 (lo, _mm256_slli_epi64 (cross, 32));
+}
+
+static inline AVX2 __m256i
+mul_word (__m256i a, __m256i b)
+{
+  return mullo (_mm256_srli_epi64 (a, 1), b);
+}
+
+static inline AVX2 bool
+tags_clear (__m256i tags)
+{
+  return _mm256_testz_si256 (tags, _mm256_set1_epi64x (1));
+}
+
+static AVX2 bool
+binary_avx2 (uint64_t opc, word_t *d, const word_t *a, const word_t *b,
+             size_t n)
+{
+  __m256i tags = _mm256_setzero_si256 ();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      __m256i x = _mm256_loadu_si256 ((const __m256i *)&a[i]);
+      __m256i y = _mm256_loadu_si256 ((const __m256i *)&b[i]);
+      tags = _mm256_or_si256 (tags, _mm256_or_si256 (x, y));
+    }
+  for (size_t j = i; j < n; j++)
+    {
+      tags = _mm256_or_si256 (tags, _mm256_set1_epi64x (a[j] | b[j]));
+    }
+  if (!tags_clear (tags))
+    {
+      return false;
+    }
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      __m256i x = _mm256_loadu_si256 ((const __m256i *)&a[i]);
+      __m256i y = _mm256_loadu_si256 ((const __m256i *)&b[i]);
+      __m256i r;
+      switch (opc)
+        {
+        case MISP_OPC_VADD:
+          r = _mm256_add_epi64 (x, y);
+          break;
+        case MISP_OPC_VSUB:
+          r = _mm256_sub_epi64 (x, y);
+          break;
+        default:
+          r = mul_word (x, y);
+          break;
+        }
+      _mm256_storeu_si256 ((__m256i *)&d[i], r);
+    }
+  return binary_words (opc, &d[i], &a[i], &b[i], n - i);
+}
+
+static AVX2 bool
+reduce_avx2 (uint64_t opc, const word_t *a, const word_t *b, size_t n,
+             cell_t *ret)
+{
+  __m256i tags = _mm256_setzero_si256 ();
+  __m256i acc = opc == MISP_OPC_VMIN || opc == MISP_OPC_VMAX
+                    ? _mm256_set1_epi64x (a[0])
+                    : _mm256_setzero_si256 ();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      __m256i x = _mm256_loadu_si256 ((const __m256i *)&a[i]);
+      switch (opc)
+        {
+        case MISP_OPC_VSUM:
+          tags = _mm256_or_si256 (tags, x);
+          acc = _mm256_add_epi64 (acc, x);
+          break;
+        case MISP_OPC_VDOT:
+          {
+            __m256i y = _mm256_loadu_si256 ((const __m256i *)&b[i]);
+            tags = _mm256_or_si256 (tags, _mm256_or_si256 (x, y));
+            acc = _mm256_add_epi64 (acc, mul_word (x, y));
+          }
+          break;
+        case MISP_OPC_VMIN:
+          tags = _mm256_or_si256 (tags, x);
+          acc = _mm256_blendv_epi8 (acc, x, _mm256_cmpgt_epi64 (acc, x));
+          break;
+        case MISP_OPC_VMAX:
+          tags = _mm256_or_si256 (tags, x);
+          acc = _mm256_blendv_epi8 (acc, x, _mm256_cmpgt_epi64 (x, acc));
+          break;
+        }
+    }
+
+  /* the lanes, then the rest, are folded like one more vector */
+  word_t lanes[4];
+  _mm256_storeu_si256 ((__m256i *)lanes, acc);
+  cell_t r;
+  bool ok = reduce_words (opc, &a[i], b ? &b[i] : NULL, n - i, &r);
+  if (i == n && (opc == MISP_OPC_VMIN || opc == MISP_OPC_VMAX))
+    {
+      r.w = lanes[0];
+    }
+  for (int l = 0; l < 4; l++)
+    {
+      switch (opc)
+        {
+        case MISP_OPC_VSUM:
+        case MISP_OPC_VDOT:
+          r.w += lanes[l];
+          break;
+        case MISP_OPC_VMIN:
+          r.w = (int64_t)lanes[l] < (int64_t)r.w ? lanes[l] : r.w;
+          break;
+        case MISP_OPC_VMAX:
+          r.w = (int64_t)lanes[l] > (int64_t)r.w ? lanes[l] : r.w;
+          break;
+        }
+    }
+  *ret = r;
+  return ok && tags_clear (tags);
+}
+
+#endif
+
+static bool
+binary (uint64_t opc, uint8_t *d, const uint8_t *a, const uint8_t *b,
+        size_t n)
+{
+  word_t *dw = (word_t *)d;
+  const word_t *aw = (const word_t *)a, *bw = (const word_t *)b;
+#ifdef MISP_VEC_AVX2
+  bool avx2 = __builtin_cpu_supports ("avx2");
+#endif
+  for (size_t i = 0; i < n; i += CHUNK)
+    {
+      size_t c = n - i < CHUNK ? n - i : CHUNK;
+#ifdef MISP_VEC_AVX2
+      if (avx2)
+        {
+          if (!binary_avx2 (opc, &dw[i], &aw[i], &bw[i], c))
+            {
+              return false;
+            }
+          continue;
+        }
+#endif
+      if (!binary_words (opc, &dw[i], &aw[i], &bw[i], c))
+        {
+          return false;
+        }
+    }
+  return true;
+}
+
+static bool
+reduce (uint64_t opc, const uint8_t *a, const uint8_t *b, size_t n,
+        cell_t *ret)
+{
+#ifdef MISP_VEC_AVX2
+  if (__builtin_cpu_supports ("avx2"))
+    {
+      return reduce_avx2 (opc, (const word_t *)a, (const word_t *)b, n, ret);
+    }
+#endif
+  return reduce_words (opc, (const word_t *)a, (const word_t *)b, n, ret);
+}
+
+#else
+
+static bool
+binary (uint64_t opc, uint8_t *d, const uint8_t *a, const uint8_t *b,
+        size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    {
+      cell_t x, y, r;
+      CELL_READ (&a[i * CELL_SIZE], &x);
+      CELL_READ (&b[i * CELL_SIZE], &y);
+      if (!IS_NUM (x) || !IS_NUM (y))
+        {
+          return false;
+        }
+      switch (opc)
+        {
+        case MISP_OPC_VADD:
+          r = NUM (NUM_VAL (x) + NUM_VAL (y));
+          break;
+        case MISP_OPC_VSUB:
+          r = NUM (NUM_VAL (x) - NUM_VAL (y));
+          break;
+        default:
+          r = NUM (NUM_VAL (x) * NUM_VAL (y));
+          break;
+        }
+      CELL_WRITE (&d[i * CELL_SIZE], r);
+    }
+  return true;
+}
+
+static bool
+reduce (uint64_t opc, const uint8_t *a, const uint8_t *b, size_t n,
+        cell_t *ret)
+{
+  cell_t x, y;
+  int64_t r = 0;
+  if (opc == MISP_OPC_VMIN || opc == MISP_OPC_VMAX)
+    {
+      CELL_READ (a, &x);
+      r = NUM_VAL (x);
+    }
+  for (size_t i = 0; i < n; i++)
+    {
+      CELL_READ (&a[i * CELL_SIZE], &x);
+      if (!IS_NUM (x))
+        {
+          return false;
+        }
+      switch (opc)
+        {
+        case MISP_OPC_VSUM:
+          r += NUM_VAL (x);
+          break;
+        case MISP_OPC_VDOT:
+          CELL_READ (&b[i * CELL_SIZE], &y);
+          if (!IS_NUM (y))
+            {
+              return false;
+            }
+          r += NUM_VAL (x) * NUM_VAL (y);
+          break;
+        case MISP_OPC_VMIN:
+          r = NUM_VAL (x) < r ? NUM_VAL (x) : r;
+          break;
+        case MISP_OPC_VMAX:
+          r = NUM_VAL (x) > r ? NUM_VAL (x) : r;
+          break;
+        }
+    }
+  *ret = NUM (r);
+  return true;
+}
+
+#endif
+
+/* Vectors among which there is a typed array go by chunks of numbers,
+   t[i].bits is 0 for the lists */
+
+static bool
+load (misp_t *M, cell_t l, const struct misp_typed *t, size_t i, size_t n,
+      int64_t *out)
+{
+  if (t->bits)
+    {
+      misp_typed_load (M, t, i, n, out);
+      return true;
+    }
+  for (size_t j = 0; j < n; j++)
+    {
+      cell_t c;
+      misp_list_get (M, l, &c, i + j);
+      if (!IS_NUM (c))
+        {
+          return false;
+        }
+      out[j] = NUM_VAL (c);
+    }
+  return true;
+}
+
+static bool
+typed_binary (misp_t *M, uint64_t opc, const cell_t *l,
+              const struct misp_typed *t, size_t n)
+{
+  int64_t x[CHUNK], y[CHUNK];
+  for (size_t i = 0; i < n; i += CHUNK)
+    {
+      size_t c = n - i < CHUNK ? n - i : CHUNK;
+      if (!load (M, l[1], &t[1], i, c, x) || !load (M, l[2], &t[2], i, c, y))
+        {
+          return false;
+        }
+      switch (opc)
+        {
+        case MISP_OPC_VADD:
+          for (size_t j = 0; j < c; j++)
+            {
+              x[j] += y[j];
+            }
+          break;
+        case MISP_OPC_VSUB:
+          for (size_t j = 0; j < c; j++)
+            {
+              x[j] -= y[j];
+            }
+          break;
+        default:
+          for (size_t j = 0; j < c; j++)
+            {
+              x[j] *= y[j];
+            }
+          break;
+        }
+      if (t[0].bits)
+        {
+          misp_typed_store (M, &t[0], i, c, x);
+          continue;
+        }
+      for (size_t j = 0; j < c; j++)
+        {
+          misp_list_set (M, l[0], NUM (x[j]), i + j);
+        }
+    }
+  return true;
+}
+
+static bool
+typed_reduce (misp_t *M, uint64_t opc, const cell_t *l,
+              const struct misp_typed *t, size_t n, cell_t *ret)
+{
+  int64_t x[CHUNK], y[CHUNK], r = 0;
+  if ((opc == MISP_OPC_VMIN || opc == MISP_OPC_VMAX)
+      && !load (M, l[0], &t[0], 0, 1, &r))
+    {
+      return false;
+    }
+  for (size_t i = 0; i < n; i += CHUNK)
+    {
+      size_t c = n - i < CHUNK ? n - i : CHUNK;
+      if (!load (M, l[0], &t[0], i, c, x)
+          || (opc == MISP_OPC_VDOT && !load (M, l[1], &t[1], i, c, y)))
+        {
+          return false;
+        }
+      switch (opc)
+        {
+        case MISP_OPC_VSUM:
+          for (size_t j = 0; j < c; j++)
+            {
+              r += x[j];
+            }
+          break;
+        case MISP_OPC_VDOT:
+          for (size_t j = 0; j < c; j++)
+            {
+              r += x[j] * y[j];
+            }
+          break;
+        case MISP_OPC_VMIN:
+          for (size_t j = 0; j < c; j++)
+            {
+              r = x[j] < r ? x[j] : r;
+            }
+          break;
+        case MISP_OPC_VMAX:
+          for (size_t j = 0; j < c; j++)
+            {
+              r = x[j] > r ? x[j] : r;
+            }
+          break;
+        }
+    }
+  *ret = NUM (r);
+  return true;
+}
+
+void
+misp_vec_step (misp_t *M, cell_t node, uint64_t opc)
+{
+  bool has_dst = opc <= MISP_OPC_VMUL;
+  size_t k = has_dst ? 3 : opc == MISP_OPC_VDOT ? 2 : 1;
+  cell_t stack, l[3];
+  struct misp_typed t[3];
+  size_t len[3];
+  bool typed = false;
+  misp_env_stack (M, &stack);
+  if (LIST_LEN (stack) < k)
+    {
+      M->halted = true;
+      M->panic_code = (misp_panic_t){ MISP_PANIC_BAD_NODE_PARAMS, node };
+      return;
+    }
+  for (size_t i = 0; i < k; i++)
+    {
+      misp_env_get (M, &l[i], i);
+      if (!IS_LIST (l[i]))
+        {
+          M->halted = true;
+          M->panic_code = (misp_panic_t){ MISP_PANIC_TYPE_ERROR, node };
+          return;
+        }
+      if (misp_typed_of (M, l[i], &t[i]))
+        {
+          typed = true;
+          len[i] = t[i].len;
+        }
+      else
+        {
+          t[i].bits = 0;
+          len[i] = LIST_LEN (l[i]);
+        }
+      if (len[i] != len[0])
+        {
+          M->halted = true;
+          M->panic_code
+              = (misp_panic_t){ MISP_PANIC_OUT_OF_BOUNDS, node };
+          return;
+        }
+    }
+
+  size_t n = len[0];
+  uint8_t *p[3];
+  for (size_t i = 0; i < k; i++)
+    {
+      p[i] = &M->mem[LIST_PTR (l[i]) * CELL_SIZE];
+    }
+
+  bool ok;
+  cell_t ret = l[0];
+  if (has_dst)
+    {
+      /* a typed dst holds raw bits, which reference nothing */
+      if (!t[0].bits)
+        {
+          misp_list_barrier (M, LIST_PTR (l[0]), n);
+        }
+      ok = typed ? typed_binary (M, opc, l, t, n)
+                 : binary (opc, p[0], p[1], p[2], n);
+      misp_bc_written_range (M, LIST_PTR (l[0]),
+                             LIST_PTR (l[0]) + LIST_LEN (l[0]));
+    }
+  else if (!n && opc != MISP_OPC_VSUM && opc != MISP_OPC_VDOT)
+    {
+      M->halted = true;
+      M->panic_code = (misp_panic_t){ MISP_PANIC_OUT_OF_BOUNDS, node };
+      return;
+    }
+  else
+    {
+      ok = typed ? typed_reduce (M, opc, l, t, n, &ret)
+                 : reduce (opc, p[0], k > 1 ? p[1] : NULL, n, &ret);
+    }
+
+  if (!ok)
+    {
+      M->halted = true;
+      M->panic_code = (misp_panic_t){ MISP_PANIC_TYPE_ERROR, node };
+      return;
+    }
+  misp_env_ret (M, ret);
+}
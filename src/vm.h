@@ -0,0 +1,402 @@
+/*************************************************************************/
+/* MISP                                                                  */
+/* Copyright (C) 2023                                                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*************************************************************************/
+
+#ifndef MISP_VM_H
+#define MISP_VM_H
+
+#include "defs.h"
+#include "gc.h"
+#include "misp.h"
+#include <memory.h>
+
+/* Frame layout: parent, node, args, stack, trap, then the stack cells */
+#define FRAME_PARENT 0
+#define FRAME_NODE 1
+#define FRAME_ARGS 2
+#define FRAME_STACK 3
+#define FRAME_TRAP 4
+#define FRAME_HEADER 5
+
+/* Cells set aside for the frames, above the code */
+#define MISP_FRAMES_SIZE 400
+
+/* mem is expected to be aligned on this */
+#define MISP_CACHE_LINE 64
+
+static inline void
+misp_list_get (misp_t *M, cell_t list, cell_t *cell, size_t i)
+{
+  CELL_READ (&M->mem[(LIST_PTR (list) + i) * CELL_SIZE], cell);
+}
+
+static inline void
+misp_list_set (misp_t *M, cell_t list, cell_t cell, size_t i)
+{
+  if (M->heap.phase == MISP_GC_MARK)
+    {
+      misp_gc_barrier (M, LIST_PTR (list) + i);
+    }
+  CELL_WRITE (&M->mem[(LIST_PTR (list) + i) * CELL_SIZE], cell);
+}
+
+// [a, b[
+static inline void
+misp_list_sub (misp_t *M, cell_t list, cell_t *sub, size_t a, size_t b)
+{
+  *sub = LIST ((b - a), (LIST_PTR (list) + a));
+}
+
+/* Bulk writes go through the barrier once per cell only while marking */
+
+static inline void
+misp_list_barrier (misp_t *M, size_t i, size_t n)
+{
+  if (M->heap.phase == MISP_GC_MARK)
+    {
+      for (size_t j = 0; j < n; j++)
+        {
+          misp_gc_barrier (M, i + j);
+        }
+    }
+}
+
+// Copies the cells of src to the start of dst, which is at least as long.
+// The two may overlap.
+static inline void
+misp_list_copy (misp_t *M, cell_t dst, cell_t src)
+{
+  misp_list_barrier (M, LIST_PTR (dst), LIST_LEN (src));
+  memmove (&M->mem[LIST_PTR (dst) * CELL_SIZE],
+           &M->mem[LIST_PTR (src) * CELL_SIZE], LIST_LEN (src) * CELL_SIZE);
+}
+
+static inline void
+misp_list_fill (misp_t *M, cell_t list, cell_t cell)
+{
+  size_t n = LIST_LEN (list);
+  uint8_t *p = &M->mem[LIST_PTR (list) * CELL_SIZE];
+  if (!n)
+    {
+      return;
+    }
+  misp_list_barrier (M, LIST_PTR (list), n);
+  CELL_WRITE (p, cell);
+  /* double the filled part until it covers the list */
+  for (size_t done = 1; done < n; done *= 2)
+    {
+      memcpy (p + done * CELL_SIZE, p,
+              (done < n - done ? done : n - done) * CELL_SIZE);
+    }
+}
+
+/* The header of the current frame lives in M->frame and is only written
+   back to mem by misp_env_flush, when a child frame begins or before the
+   collector walks the env chain. */
+
+static inline void
+misp_env_flush (misp_t *M)
+{
+  if (LIST_LEN (M->env))
+    {
+      uint8_t *h = &M->mem[LIST_PTR (M->env) * CELL_SIZE];
+      CELL_WRITE (h + FRAME_PARENT * CELL_SIZE, M->frame.parent);
+      CELL_WRITE (h + FRAME_NODE * CELL_SIZE, M->frame.node);
+      CELL_WRITE (h + FRAME_ARGS * CELL_SIZE, M->frame.args);
+      CELL_WRITE (h + FRAME_STACK * CELL_SIZE, M->frame.stack);
+      CELL_WRITE (h + FRAME_TRAP * CELL_SIZE, M->frame.trap);
+    }
+}
+
+static inline void
+misp_env_load (misp_t *M)
+{
+  if (LIST_LEN (M->env))
+    {
+      uint8_t *h = &M->mem[LIST_PTR (M->env) * CELL_SIZE];
+      CELL_READ (h + FRAME_PARENT * CELL_SIZE, &M->frame.parent);
+      CELL_READ (h + FRAME_NODE * CELL_SIZE, &M->frame.node);
+      CELL_READ (h + FRAME_ARGS * CELL_SIZE, &M->frame.args);
+      CELL_READ (h + FRAME_STACK * CELL_SIZE, &M->frame.stack);
+      CELL_READ (h + FRAME_TRAP * CELL_SIZE, &M->frame.trap);
+    }
+}
+
+static inline void
+misp_env_parent (misp_t *M, cell_t *parent)
+{
+  *parent = M->frame.parent;
+}
+
+static inline void
+misp_env_node (misp_t *M, cell_t *node)
+{
+  *node = M->frame.node;
+}
+
+static inline void
+misp_env_args (misp_t *M, cell_t *args)
+{
+  *args = M->frame.args;
+}
+
+static inline void
+misp_env_trap (misp_t *M, cell_t *trap)
+{
+  *trap = M->frame.trap;
+}
+
+static inline void
+misp_env_stack (misp_t *M, cell_t *stack)
+{
+  *stack = M->frame.stack;
+}
+
+static inline void
+misp_env_push (misp_t *M, cell_t cell)
+{
+  cell_t stack = M->frame.stack;
+
+  if (LIST_PTR (stack) + LIST_LEN (stack)
+      >= LIST_PTR (M->env) + LIST_LEN (M->env))
+    {
+      M->halted = true;
+      M->panic_code
+          = (misp_panic_t){ MISP_PANIC_STACK_OVERFLOW, M->frame.node };
+      return;
+    }
+  stack = LIST (LIST_LEN (stack) + 1, LIST_PTR (stack));
+
+  misp_list_set (M, stack, cell, LIST_LEN (stack) - 1);
+  M->frame.stack = stack;
+}
+
+static inline void
+misp_env_pop (misp_t *M, size_t amount)
+{
+  cell_t stack = M->frame.stack;
+
+  stack = LIST (LIST_LEN (stack) - amount,
+                LIST_PTR (stack)); // TODO: check underflow?
+  M->frame.stack = stack;
+}
+
+static inline void
+misp_env_get (misp_t *M, cell_t *cell, size_t i)
+{
+  misp_list_get (M, M->frame.stack, cell, i);
+}
+
+// False when no frame fits above the stack anymore.
+static inline bool
+misp_env_top (misp_t *M, cell_t *top)
+{
+  cell_t stack = M->frame.stack;
+  size_t start = LIST_PTR (stack) + LIST_LEN (stack) - LIST_PTR (M->env);
+
+  /* start the next frame where its header fits in a single cache line */
+  while ((LIST_PTR (M->env) + start) * CELL_SIZE % MISP_CACHE_LINE
+         > MISP_CACHE_LINE - FRAME_HEADER * CELL_SIZE)
+    {
+      start++;
+    }
+  if (start + FRAME_HEADER > LIST_LEN (M->env))
+    {
+      return false;
+    }
+  misp_list_sub (M, M->env, top, start, LIST_LEN (M->env));
+  return true;
+}
+
+static inline void
+misp_env_begin (misp_t *M, cell_t node, cell_t args, cell_t trap)
+{
+  cell_t newenv;
+  if (!misp_env_top (M, &newenv))
+    {
+      M->halted = true;
+      M->panic_code = (misp_panic_t){ MISP_PANIC_STACK_OVERFLOW, node };
+      return;
+    }
+  misp_env_flush (M);
+
+  cell_t stack;
+  misp_list_sub (M, newenv, &stack, FRAME_HEADER, FRAME_HEADER);
+
+  M->frame = (misp_frame_t){ M->env, node, args, stack, trap };
+  M->env = newenv;
+}
+
+// Begins the root frame of M, at the bottom of its frame region.
+static inline void
+misp_env_root (misp_t *M, cell_t node, cell_t args)
+{
+  M->env = M->frames;
+  M->frame = (misp_frame_t){ LIST_NULL, LIST_NULL, LIST_NULL,
+                             LIST (0, LIST_PTR (M->env) + FRAME_HEADER),
+                             LIST_NULL };
+  misp_env_begin (M, node, args, LIST_NULL);
+  M->frame.parent = LIST_NULL;
+}
+
+/* Tail calls: the current frame is reused for a node whose value is the
+   value of the frame, so the frame region does not grow with them. */
+
+static inline void
+misp_env_tail (misp_t *M, cell_t node)
+{
+  M->frame.node = node;
+  M->frame.stack = LIST (0, LIST_PTR (M->frame.stack));
+}
+
+// The top n cells of the stack become the args of the let body node.
+static inline void
+misp_env_rebind (misp_t *M, cell_t node, size_t n)
+{
+  cell_t stack = M->frame.stack;
+  size_t base = LIST_PTR (M->env) + FRAME_HEADER;
+  size_t top = LIST_PTR (stack) + LIST_LEN (stack);
+
+  memmove (&M->mem[base * CELL_SIZE], &M->mem[(top - n) * CELL_SIZE],
+           n * CELL_SIZE);
+  M->frame.node = node;
+  M->frame.args = LIST (n, base);
+  M->frame.stack = LIST (0, base + n);
+  M->frame.trap = LIST_NULL;
+}
+
+static inline void
+misp_env_ret (misp_t *M, cell_t ret)
+{
+  M->env = M->frame.parent; // jump to parent
+  if (!LIST_LEN (M->env))
+    {
+      M->halted = true;
+      M->result = ret;
+      return;
+    }
+  misp_env_load (M);
+  misp_env_push (M, ret);
+}
+
+int64_t misp_numop (uint64_t op, int64_t a, int64_t b);
+
+void misp_debug (misp_t *M, cell_t c);
+
+// Prints the node, args and stack of the current frame.
+void misp_debug_env (misp_t *M);
+
+// Evaluates the pmap or preduce node whose params were evaluated on the
+// stack of the current frame, and returns its value.
+void misp_par_step (misp_t *M, cell_t node, uint64_t opc);
+
+// Stops the threads of pmap and preduce.
+void misp_par_release (misp_t *M);
+
+// Same for the vector ops, from vadd to vdot.
+void misp_vec_step (misp_t *M, cell_t node, uint64_t opc);
+
+// Same for the hash map ops, from hnew to hlen.
+void misp_hash_step (misp_t *M, cell_t node, uint64_t opc);
+
+// Runs the hash map op opc on its k params, the cells from args on. They
+// lie on a stack, so that they are kept up to date when the op allocates.
+misp_panic_type_t misp_hash_op (misp_t *M, uint64_t opc, size_t args,
+                                size_t k, cell_t *ret);
+
+// Same for the typed array ops, from tnew to tlen.
+void misp_typed_step (misp_t *M, cell_t node, uint64_t opc);
+
+// Runs the typed array op opc on its k params, as misp_hash_op.
+misp_panic_type_t misp_typed_op (misp_t *M, uint64_t opc, size_t args,
+                                 size_t k, cell_t *ret);
+
+/* A typed array, see typed.c */
+struct misp_typed
+{
+  size_t p;      /* first cell of the numbers */
+  size_t len;    /* numbers */
+  unsigned bits; /* 8, 16, 32 or 64 */
+};
+
+// Whether list is a typed array, described in t if so.
+bool misp_typed_of (misp_t *M, cell_t list, struct misp_typed *t);
+
+int64_t misp_typed_get (misp_t *M, const struct misp_typed *t, size_t i);
+
+// Stores n at i, cut down to the width of t.
+void misp_typed_set (misp_t *M, const struct misp_typed *t, size_t i,
+                     int64_t n);
+
+// Same for the numbers [i, i + n[, from or to an array of them.
+void misp_typed_load (misp_t *M, const struct misp_typed *t, size_t i,
+                      size_t n, int64_t *out);
+void misp_typed_store (misp_t *M, const struct misp_typed *t, size_t i,
+                       size_t n, const int64_t *in);
+
+/* lfill, lcopy and lconcat when a typed array is among the lists. They go
+   number by number and the numbers of arrays stay numbers in lists; the
+   concatenation of arrays of one width is an array. */
+
+misp_panic_type_t misp_typed_fill (misp_t *M, const struct misp_typed *t,
+                                   cell_t c);
+misp_panic_type_t misp_typed_copy (misp_t *M, cell_t dst, cell_t src);
+misp_panic_type_t misp_typed_cat (misp_t *M, size_t args, size_t k,
+                                  cell_t *ret);
+
+// Drops the snapshot of M and the mem mapped by misp_clone, if any.
+void misp_clone_release (misp_t *M);
+
+/* Native functions, see misp_register */
+
+#define NATIVE_ANY 2 /* type of a param taking either */
+
+struct misp_native
+{
+  misp_native_fn_t fn;
+  void *data;
+  size_t arity;
+  uint8_t types[MISP_NATIVE_MAX_ARITY]; /* TYPE_NUM, TYPE_LIST or ANY */
+};
+
+struct misp_natives
+{
+  size_t refs; /* VMs sharing the table, the clones of M included */
+  struct misp_native fns[MISP_NATIVES_MAX];
+};
+
+static inline const struct misp_native *
+misp_native_of (misp_t *M, uint64_t opc)
+{
+  if (!M->natives || opc < MISP_OPC_NATIVE_BASE
+      || opc - MISP_OPC_NATIVE_BASE >= MISP_NATIVES_MAX)
+    {
+      return NULL;
+    }
+  const struct misp_native *n = &M->natives->fns[opc - MISP_OPC_NATIVE_BASE];
+  return n->fn ? n : NULL;
+}
+
+// Checks the n->arity args and runs n, the args being the top of the
+// stack of the current frame. Returns the panic, if any.
+misp_panic_type_t misp_native_call (misp_t *M, const struct misp_native *n,
+                                    const cell_t *args, cell_t *ret);
+
+// Drops the share of M in its native functions.
+void misp_natives_release (misp_t *M);
+
+#endif
@@ -1,11 +1,54 @@
 local version = "0.1.0"
 set_version(version)
 
+option("tagged-cells")
+set_default(false)
+set_showmenu(true)
+set_description("Use 8 byte cells with the type tag in the low bit")
+add_defines("MISP_CELL_TAGGED")
+option_end()
+
+option("wide-lists")
+set_default(false)
+set_showmenu(true)
+set_description("Use 40 bit list pointers for a mem beyond 4G cells,",
+                "lists are then at most 2^24-1 cells long (2^23-1 with tagged cells)")
+add_defines("MISP_WIDE_LISTS")
+option_end()
+
+-- The VM for hosts, see include/misp.h. Hosts must be built with the same
+-- tagged-cells and wide-lists options.
+target("libmisp")
+set_kind("static")
+set_basename("misp")
+add_files("src/*.c|main.c")
+add_includedirs("include/", {public = true})
+add_includedirs("src/")
+add_headerfiles("include/misp.h")
+set_license("GPL-3.0-or-later")
+add_options("tagged-cells", "wide-lists")
+add_syslinks("pthread", {public = true})
+add_rules("mode.release", "mode.debug")
+
 target("misp")
 set_kind("binary")
-add_files("src/*.c")
-add_includedirs("include/")
+add_deps("libmisp")
+add_files("src/main.c")
+add_includedirs("src/")
 set_license("GPL-3.0-or-later")
+add_options("tagged-cells", "wide-lists")
 
 add_defines("MISP_VERSION=\""..version.."\"")
 add_rules("mode.debug")
+
+-- Runs the workloads of bench/, see misp-bench -h
+target("misp-bench")
+set_kind("binary")
+add_deps("libmisp")
+add_files("bench/bench.c")
+add_includedirs("src/")
+set_license("GPL-3.0-or-later")
+add_options("tagged-cells", "wide-lists")
+
+add_defines("MISP_BENCH_DIR=\"$(projectdir)/bench\"")
+add_rules("mode.release", "mode.debug")